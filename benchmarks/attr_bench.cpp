@@ -0,0 +1,54 @@
+// Compares the iostream based RealSystem with the raw descriptor based FdSystem
+// on a fake sysfs tree living on tmpfs. Usage: attr_bench [iterations]
+
+#include "ev3dev.h"
+#include "fake_sysfs.h"
+#include "ns_per_op.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace {
+
+using ev3dev_bench::ns_per_op;
+
+void run(const char* name, const ev3dev::ISystem& sys, int iterations) {
+    ev3dev::large_motor m{ev3dev::OUTPUT_A, sys};
+    if (! m.connected()) {
+        std::cerr << name << ": motor not found under " << sys.get_sys_root() << "\n";
+        std::exit(1);
+    }
+
+    volatile int sink{0};
+    int v{0};
+
+    std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << ns_per_op(iterations, [&] { sink = sink + m.position(); })
+              << std::setw(14) << ns_per_op(iterations, [&] { m.set_speed_sp(++v & 0x3ff); })
+              << std::setw(14) << ns_per_op(iterations, [&] { sink = sink + static_cast<int>(m.polarity().size()); })
+              << std::setw(14) << ns_per_op(iterations, [&] { sink = sink + static_cast<int>(m.state().size()); })
+              << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int iterations{argc > 1 ? std::atoi(argv[1]) : 100000};
+
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3dev::OUTPUT_A, ev3dev::motor::motor_large);
+    sysfs.write(sysfs.root() + "/tacho-motor/motor0/state", "running ramping\n");
+
+    const ev3dev::RealSystem stream_system{sysfs.root()};
+    const ev3dev::FdSystem fd_system{sysfs.root()};
+
+    std::cout << "ns/op over " << iterations << " iterations (" << sysfs.root() << ")\n"
+              << std::left << std::setw(12) << "backend" << std::right
+              << std::setw(14) << "get int" << std::setw(14) << "set int"
+              << std::setw(14) << "get string" << std::setw(14) << "get set" << "\n";
+
+    run("RealSystem", stream_system, iterations);
+    run("FdSystem", fd_system, iterations);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+// Timing shared by the micro benchmarks.
+
+#include <chrono>
+#include <functional>
+
+namespace ev3dev_bench {
+
+// Average time of one call of `op` over `iterations` calls. A warm-up opens
+// the files and fills whatever caches are involved first.
+inline double ns_per_op(int iterations, const std::function<void()>& op) {
+    using clock_type = std::chrono::steady_clock;
+
+    for (int i = 0; i != 100; ++i) {
+        op();
+    }
+
+    const auto start{clock_type::now()};
+    for (int i = 0; i != iterations; ++i) {
+        op();
+    }
+    const auto elapsed{clock_type::now() - start};
+
+    return static_cast<double>(std::chrono::duration_cast<std::chrono::nanoseconds>(elapsed).count()) / iterations;
+}
+
+} // namespace ev3dev_bench
@@ -0,0 +1,152 @@
+// Runs the plotter's homing, one commands::go and a G-code job against a
+// simulated plotter (SimSystem) and compares simulated with wall clock time.
+// Each scheduler step advances the simulation `speedup` times the 10 ms the
+// driver waits between polls. Homing still sleeps 300 ms of wall clock time
+// whenever it starts a motor. Usage: plotter_bench [speedup]
+
+#include "ev3dev.h"
+
+#include <driver.h>
+#include <scheduler.h>
+#include <server.h>
+#include <widgets.h>
+
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <variant>
+#include <vector>
+
+using namespace ev3plotter;
+
+namespace {
+
+using clock_type = std::chrono::steady_clock;
+
+ev3dev::SimSystem::motor_config plotter_motor(const char* address, const char* driver_name, int min, int max) {
+    ev3dev::SimSystem::motor_config config;
+    config.address = address;
+    config.driver_name = driver_name;
+    config.min_position = min;
+    config.max_position = max;
+    return config;
+}
+
+void report(const char* name, std::chrono::nanoseconds simulated, clock_type::duration wall) {
+    const auto ms{[](auto d) { return std::chrono::duration<double, std::milli>(d).count(); }};
+    std::cout << std::left << std::setw(10) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << ms(simulated) << std::setw(14) << ms(wall) << std::setprecision(1)
+              << std::setw(10) << ms(simulated) / ms(wall) << "x\n";
+}
+
+// A diamond, in absolute millimeters. Only diagonal moves: pos::calc_speeds()
+// rounds the speed of an axis that moves much less than the other down to 0,
+// and a motor told to run to a position at speed 0 never gets there, on the
+// brick neither.
+const std::vector<std::string> job{
+    "G21",           "G90",           "G0 Z0",         "G0 X60 Y60",    "G1 Z10",        "G1 X110 Y110",
+    "G1 X60 Y160",   "G1 X10 Y110",   "G1 X60 Y60",    "G0 Z0",         "G0 X0 Y0"};
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int speedup{argc > 1 ? std::atoi(argv[1]) : 20};
+
+    ev3dev::SimSystem sim;
+    sim.add_motor(plotter_motor(ev3dev::OUTPUT_A, ev3dev::motor::motor_medium, -30, 60));
+    sim.add_motor(plotter_motor(ev3dev::OUTPUT_B, ev3dev::motor::motor_large, -600, 600));
+    sim.add_motor(plotter_motor(ev3dev::OUTPUT_C, ev3dev::motor::motor_large, -1200, 1200));
+
+    state* s_ptr{nullptr};
+    const IWidget::widget_state* seen_widget{nullptr};
+    int widget_changes{0};
+
+    Scheduler scheduler{[&] {
+        sim.advance(std::chrono::milliseconds{10} * speedup);
+
+        // Homing shows a message, then its results, which wait for 'ok'.
+        if (s_ptr->widget_ && s_ptr->widget_.get() != seen_widget) {
+            seen_widget = s_ptr->widget_.get();
+            if (++widget_changes == 2) {
+                s_ptr->widget_->handle_event(event::ok);
+            }
+        }
+    }};
+
+    state s{scheduler, sim};
+    s_ptr = &s;
+    const Message idle{"Idle", "", "Ok", [] {}};
+    s.set_widget(idle.make());
+
+    std::cout << "speedup " << speedup << " per scheduler step\n"
+              << std::left << std::setw(10) << "phase" << std::right << std::setw(14) << "simulated ms"
+              << std::setw(14) << "wall ms" << std::setw(11) << "ratio" << "\n";
+
+    const auto run{[&](const char* name, const std::function<void()>& start) {
+        const auto simulated{sim.now()};
+        const auto wall{clock_type::now()};
+        start();
+        scheduler.run();
+        report(name, sim.now() - simulated, clock_type::now() - wall);
+    }};
+
+    run("home", [&] {
+        widget_changes = 0;
+        seen_widget = s.widget_.get();
+        commands::home(s, scheduler, idle, [&](auto result) {
+            if (result.index() == 0) {
+                s.homed_ = std::get<0>(result);
+            }
+        });
+    });
+
+    if (! s.homed_) {
+        std::cerr << "homing failed\n";
+        return 1;
+    }
+    std::cout << print_homing_results(*s.homed_);
+
+    run("go", [&] {
+        commands::go(s, scheduler, pos::x(*s.homed_, normalized_pos{500}), pos::y(*s.homed_, normalized_pos{1000}), {}, nullptr);
+    });
+
+    std::size_t next{0};
+    std::function<void()> run_next{[&] {
+        while (next != job.size()) {
+            const auto parsed{detail::parse_message(job[next++])};
+            if (parsed.index() != 0) {
+                std::cerr << std::get<detail::ParseError>(parsed).Error << "\n";
+                continue;
+            }
+
+            const auto& m{std::get<ServerMessage>(parsed)};
+            switch (m.Command) {
+            case GCodeCommand::UseMm: s.gcode_state_.use_mm = true; break;
+            case GCodeCommand::AbsolutePositioning: s.gcode_state_.relative_moves = false; break;
+            case GCodeCommand::Go: {
+                const auto& scale{s.gcode_state_.c_stepsToMm};
+                const auto to{[&](const std::optional<double>& v, int axis, auto to_raw) -> std::optional<raw_pos> {
+                    if (! v) {
+                        return {};
+                    }
+                    return to_raw(*s.homed_, normalized_pos{static_cast<int>(*v / scale[axis])});
+                }};
+                const auto [speed_x, speed_y]{pos::calc_speeds(s, m.X, m.Y)};
+                commands::go(s, scheduler, to(m.X, 0, pos::x), to(m.Y, 1, pos::y), to(m.Z, 2, pos::z), speed_x, speed_y, run_next);
+                return;
+            }
+            default: break;
+            }
+        }
+    }};
+
+    run("g-code", [&] { scheduler.schedule(run_next); });
+
+    const auto& skew{s.moves_.stats()};
+    const auto us{[](auto d) { return std::chrono::duration<double, std::micro>(d).count(); }};
+    std::cout << "start skew over " << skew.count << " moves: mean " << std::setprecision(1)
+              << us(skew.total) / static_cast<double>(skew.count) << " us, max " << us(skew.max) << " us\n";
+}
@@ -0,0 +1,53 @@
+// Compares reading the motor state as a std::set<std::string> with reading it
+// as a bitmask, on a fake sysfs tree living on tmpfs. Usage: state_bench [iterations]
+
+#include "ev3dev.h"
+#include "fake_sysfs.h"
+#include "ns_per_op.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+
+namespace {
+
+using ev3dev_bench::ns_per_op;
+
+void run(const char* name, const ev3dev::ISystem& sys, int iterations) {
+    ev3dev::large_motor m{ev3dev::OUTPUT_A, sys};
+    if (! m.connected()) {
+        std::cerr << name << ": motor not found under " << sys.get_sys_root() << "\n";
+        std::exit(1);
+    }
+
+    volatile int sink{0};
+
+    std::cout << std::left << std::setw(12) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << ns_per_op(iterations, [&] {
+                     const auto s{m.state()};
+                     sink = sink + static_cast<int>(s.find(ev3dev::motor::state_stalled) != s.end());
+                 })
+              << std::setw(14) << ns_per_op(iterations, [&] { sink = sink + static_cast<int>(m.is_stalled()); })
+              << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int iterations{argc > 1 ? std::atoi(argv[1]) : 100000};
+
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3dev::OUTPUT_A, ev3dev::motor::motor_large);
+    sysfs.write(sysfs.root() + "/tacho-motor/motor0/state", "running ramping stalled\n");
+
+    const ev3dev::RealSystem stream_system{sysfs.root()};
+    const ev3dev::FdSystem fd_system{sysfs.root()};
+
+    std::cout << "ns/op over " << iterations << " iterations (" << sysfs.root() << ")\n"
+              << std::left << std::setw(12) << "backend" << std::right
+              << std::setw(14) << "state()" << std::setw(14) << "is_stalled()" << "\n";
+
+    run("RealSystem", stream_system, iterations);
+    run("FdSystem", fd_system, iterations);
+}
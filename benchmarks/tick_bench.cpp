@@ -0,0 +1,96 @@
+// Measures one control tick, 16 attribute reads across 4 motors and 4
+// sensors, on a fake sysfs tree living on tmpfs: one read per attribute
+// through the device accessors, and read_batch with pread() and io_uring.
+// Usage: tick_bench [iterations]
+
+#include "ev3dev.h"
+#include "fake_sysfs.h"
+#include "ns_per_op.h"
+
+#include <cstdlib>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+namespace {
+
+using ev3dev_bench::ns_per_op;
+
+void report(const char* name, double ns) {
+    std::cout << std::left << std::setw(20) << name << std::right << std::fixed << std::setprecision(0)
+              << std::setw(14) << ns << "\n";
+}
+
+} // namespace
+
+int main(int argc, char* argv[]) {
+    const int iterations{argc > 1 ? std::atoi(argv[1]) : 20000};
+
+    const char* const outputs[]{ev3dev::OUTPUT_A, ev3dev::OUTPUT_B, ev3dev::OUTPUT_C, ev3dev::OUTPUT_D};
+    const char* const inputs[]{ev3dev::INPUT_1, ev3dev::INPUT_2, ev3dev::INPUT_3, ev3dev::INPUT_4};
+
+    ev3dev_testing::fake_sysfs sysfs;
+    for (int i = 0; i != 4; ++i) {
+        sysfs.add_motor(i, outputs[i], ev3dev::motor::motor_large);
+        sysfs.add_sensor(i, inputs[i], ev3dev::sensor::ev3_ultrasonic);
+    }
+
+    const ev3dev::FdSystem sys{sysfs.root()};
+
+    std::vector<ev3dev::large_motor> motors;
+    std::vector<ev3dev::ultrasonic_sensor> sensors;
+    for (int i = 0; i != 4; ++i) {
+        motors.emplace_back(outputs[i], sys);
+        sensors.emplace_back(inputs[i], sys);
+        if (! motors.back().connected() || ! sensors.back().connected()) {
+            std::cerr << "devices not found under " << sys.get_sys_root() << "\n";
+            return 1;
+        }
+    }
+
+    volatile int sink{0};
+
+    std::cout << "ns/tick over " << iterations << " ticks of 16 reads (" << sysfs.root() << ")\n"
+              << std::left << std::setw(20) << "path" << std::right << std::setw(14) << "ns/tick" << "\n";
+
+    report("accessors", ns_per_op(iterations, [&] {
+        for (auto& m : motors) {
+            sink = sink + m.position() + m.speed() + m.state_flags();
+        }
+        for (auto& s : sensors) {
+            sink = sink + s.value(0);
+        }
+    }));
+
+    for (auto backend : {ev3dev::read_batch::backend::pread, ev3dev::read_batch::backend::io_uring}) {
+        ev3dev::read_batch batch{sys, backend};
+        for (auto& m : motors) {
+            batch.add(m, "position");
+            batch.add(m, "speed");
+            batch.add(m, "state");
+        }
+        for (auto& s : sensors) {
+            batch.add(s, "value0");
+        }
+
+        const bool uring{batch.active_backend() == ev3dev::read_batch::backend::io_uring};
+        if (backend == ev3dev::read_batch::backend::io_uring && ! uring) {
+            std::cout << "io_uring not available, skipped\n";
+            continue;
+        }
+
+        // Parses every value, like the accessors do.
+        report(uring ? "read_batch io_uring" : "read_batch pread", ns_per_op(iterations, [&] {
+            batch.submit();
+            std::size_t slot{0};
+            for (std::size_t i = 0; i != motors.size(); ++i) {
+                sink = sink + batch.value(slot) + batch.value(slot + 1) + ev3dev::motor::flags_from_state(batch.text(slot + 2));
+                slot += 3;
+            }
+            for (std::size_t i = 0; i != sensors.size(); ++i) {
+                sink = sink + batch.value(slot++);
+            }
+        }));
+    }
+}
@@ -0,0 +1,218 @@
+#ifndef EV3DEV_DEVICE_BROKER_H
+#define EV3DEV_DEVICE_BROKER_H
+
+// One process, the broker, owns the device I/O of a brick. It publishes the
+// state of every motor and sensor into a POSIX shared memory segment, and
+// applies motor commands that any number of client processes queue there.
+// Readers add no sysfs load however many there are, and the commands of two
+// clients never interleave attribute by attribute.
+
+#include <ev3dev.h>
+
+#include <array>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace ev3dev::broker {
+
+// Everything in the segment must work across processes, which needs
+// lock-free atomics: a libatomic lock lives in one process only.
+static_assert(std::atomic<std::uint32_t>::is_always_lock_free, "shared atomics must be lock-free");
+static_assert(std::atomic<std::uintptr_t>::is_always_lock_free, "shared atomics must be lock-free");
+
+constexpr char default_name[] = "/ev3dev-broker";
+
+// One motor transaction, see motor::configure(). The setpoints whose bits are
+// set in `fields` are written, then the command is sent.
+struct motor_command {
+    enum : std::uint8_t { none, run_forever, run_to_abs_pos, run_to_rel_pos, run_timed, run_direct, stop, reset };
+    enum : std::uint8_t { keep, coast, brake, hold };
+    enum : std::uint8_t {
+        set_speed_sp = 0x01,
+        set_position_sp = 0x02,
+        set_duty_cycle_sp = 0x04,
+        set_time_sp = 0x08,
+        set_ramp_up_sp = 0x10,
+        set_ramp_down_sp = 0x20
+    };
+
+    std::uint8_t motor{0}; // index into segment::motors
+    std::uint8_t command{none};
+    std::uint8_t stop_action{keep};
+    std::uint8_t fields{0};
+    std::int32_t speed_sp{0};
+    std::int32_t position_sp{0};
+    std::int32_t duty_cycle_sp{0};
+    std::int32_t time_sp{0};
+    std::int32_t ramp_up_sp{0};
+    std::int32_t ramp_down_sp{0};
+};
+
+// Bounded multi-producer queue with a fixed size, so it can live in shared
+// memory (Dmitry Vyukov's bounded queue). Every cell carries a sequence
+// number that tells producers and the consumer whose turn it is.
+template <typename T, std::uint32_t N>
+class shared_ring {
+    static_assert((N & (N - 1)) == 0, "N must be a power of two");
+
+  public:
+    shared_ring() noexcept {
+        for (std::uint32_t i = 0; i < N; ++i) {
+            cells_[i].sequence.store(i, std::memory_order_relaxed);
+        }
+    }
+
+    shared_ring(const shared_ring&) = delete;
+    shared_ring& operator=(const shared_ring&) = delete;
+
+    // Fails if the ring is full.
+    bool push(const T& value) noexcept {
+        auto pos{tail_.load(std::memory_order_relaxed)};
+        for (;;) {
+            auto& c{cells_[pos & (N - 1)]};
+            const auto sequence{c.sequence.load(std::memory_order_acquire)};
+            const auto diff{static_cast<std::int32_t>(sequence - pos)};
+            if (diff == 0) {
+                if (tail_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed)) {
+                    c.value = value;
+                    c.sequence.store(pos + 1, std::memory_order_release);
+                    return true;
+                }
+            } else if (diff < 0) {
+                return false;
+            } else {
+                pos = tail_.load(std::memory_order_relaxed);
+            }
+        }
+    }
+
+    // Single consumer. Fails if the ring is empty.
+    bool pop(T& value) noexcept {
+        const auto pos{head_.load(std::memory_order_relaxed)};
+        auto& c{cells_[pos & (N - 1)]};
+        if (c.sequence.load(std::memory_order_acquire) != pos + 1) {
+            return false;
+        }
+
+        value = c.value;
+        c.sequence.store(pos + N, std::memory_order_release);
+        head_.store(pos + 1, std::memory_order_relaxed);
+        return true;
+    }
+
+  private:
+    struct cell {
+        std::atomic<std::uint32_t> sequence;
+        T value;
+    };
+
+    std::array<cell, N> cells_;
+    alignas(64) std::atomic<std::uint32_t> head_{0};
+    alignas(64) std::atomic<std::uint32_t> tail_{0};
+};
+
+struct device_info {
+    std::array<char, 32> address{};
+    std::array<char, 32> driver_name{};
+};
+
+// The layout of the shared memory segment. Bump layout_version whenever it
+// changes, clients refuse to attach to another version.
+struct segment {
+    static constexpr std::uint32_t magic_value{0x45563344}; // "EV3D"
+    static constexpr std::uint32_t layout_version{1};
+    static constexpr std::uint32_t command_capacity{64};
+
+    std::uint32_t magic{magic_value};
+    std::uint32_t version{layout_version};
+    // Set once the broker has filled in the device tables.
+    std::atomic<std::uint32_t> ready{0};
+    // Process id of the broker, for clients that want to check it is alive.
+    std::atomic<std::uint32_t> pid{0};
+
+    std::uint32_t motor_count{0};
+    std::uint32_t sensor_count{0};
+    std::array<device_info, device_snapshot::max_motors> motors{};
+    std::array<device_info, device_snapshot::max_sensors> sensors{};
+
+    seqlock<device_snapshot::data> state;
+    shared_ring<motor_command, command_capacity> commands;
+
+    std::atomic<std::uint32_t> commands_applied{0};
+    std::atomic<std::uint32_t> commands_failed{0};
+    // Polls in which reading a device failed.
+    std::atomic<std::uint32_t> read_errors{0};
+};
+
+// The broker side. Creates the segment, finds the motors on the output ports
+// and the sensors on the input ports, then poll() applies queued commands
+// and publishes fresh state. The segment is removed on destruction. Throws
+// if a broker that is still alive owns a segment of the same name; one left
+// behind by a broker that died is replaced.
+class device_broker {
+  public:
+    explicit device_broker(std::string name = default_name, const ISystem& system = default_system);
+    ~device_broker();
+
+    device_broker(const device_broker&) = delete;
+    device_broker& operator=(const device_broker&) = delete;
+
+    // Applies every queued command, then reads all devices and publishes them.
+    void poll();
+
+    // Calls poll() every `period` until `stop` is set.
+    void run(std::chrono::microseconds period, const std::atomic<bool>& stop);
+
+    const segment& shared() const noexcept { return *segment_; }
+
+  private:
+    void apply(const motor_command& c);
+
+    std::string name_;
+    std::size_t size_{0};
+    segment* segment_{nullptr};
+    std::vector<motor> motors_;
+    std::vector<sensor> sensors_;
+    device_snapshot snapshot_;
+};
+
+// The client side. Attaches to the segment of a running broker.
+class broker_client {
+  public:
+    explicit broker_client(std::string_view name = default_name);
+    ~broker_client();
+
+    broker_client(const broker_client&) = delete;
+    broker_client& operator=(const broker_client&) = delete;
+
+    // The latest published state, copied without syscalls.
+    device_snapshot::data state() const noexcept { return segment_->state.load(); }
+    // Number of states published so far.
+    unsigned version() const noexcept { return segment_->state.version(); }
+
+    std::size_t motor_count() const noexcept { return segment_->motor_count; }
+    std::size_t sensor_count() const noexcept { return segment_->sensor_count; }
+    const device_info& motor_info(std::size_t i) const { return segment_->motors.at(i); }
+    const device_info& sensor_info(std::size_t i) const { return segment_->sensors.at(i); }
+
+    // Index of the motor / sensor on port `address`.
+    std::optional<std::size_t> find_motor(std::string_view address) const noexcept;
+    std::optional<std::size_t> find_sensor(std::string_view address) const noexcept;
+
+    // Queues a command for the broker. Fails if the queue is full.
+    bool submit(const motor_command& c) noexcept { return segment_->commands.push(c); }
+
+    const segment& shared() const noexcept { return *segment_; }
+
+  private:
+    std::size_t size_{0};
+    segment* segment_{nullptr};
+};
+
+} // namespace ev3dev::broker
+
+#endif // EV3DEV_DEVICE_BROKER_H
@@ -0,0 +1,289 @@
+#include "broker/device_broker.h"
+
+#include <algorithm>
+#include <cerrno>
+#include <new>
+#include <system_error>
+#include <thread>
+
+#include <fcntl.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+using namespace ev3dev::broker;
+
+namespace {
+    [[noreturn]] void throw_errno(const std::string& what) {
+        throw std::system_error{std::error_code{errno, std::system_category()}, what};
+    }
+
+    template <std::size_t N>
+    void copy_name(std::array<char, N>& to, const std::string& from) noexcept {
+        const auto n{std::min(from.size(), N - 1)};
+        std::copy_n(from.begin(), n, to.begin());
+        to[n] = '\0';
+    }
+
+    std::optional<std::size_t> find(
+        const std::array<device_info, 8>& devices, std::size_t count, std::string_view address) noexcept {
+        for (std::size_t i = 0; i < count; ++i) {
+            if (std::string_view{devices[i].address.data()} == address) {
+                return i;
+            }
+        }
+        return {};
+    }
+
+    // Unmaps and unlinks a segment under construction unless released, so a
+    // broker that fails to start leaves nothing behind.
+    struct segment_guard {
+        const std::string& name;
+        void* memory{nullptr};
+        std::size_t size{0};
+        bool armed{true};
+
+        ~segment_guard() {
+            if (memory) {
+                ::munmap(memory, size);
+            }
+            if (armed) {
+                ::shm_unlink(name.c_str());
+            }
+        }
+
+        void release() noexcept {
+            memory = nullptr;
+            armed = false;
+        }
+    };
+
+    // Whether the broker that created segment `name` is gone. A segment too
+    // small to hold a pid, or without one, was abandoned before the broker
+    // got that far.
+    bool owner_dead(const std::string& name) noexcept {
+        const int fd{::shm_open(name.c_str(), O_RDONLY, 0)};
+        if (fd < 0) {
+            return errno == ENOENT;
+        }
+
+        struct stat st {};
+        if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < sizeof(segment)) {
+            ::close(fd);
+            return true;
+        }
+
+        void* memory{::mmap(nullptr, sizeof(segment), PROT_READ, MAP_SHARED, fd, 0)};
+        ::close(fd);
+        if (memory == MAP_FAILED) {
+            return false;
+        }
+        const auto pid{static_cast<const segment*>(memory)->pid.load()};
+        ::munmap(memory, sizeof(segment));
+
+        return pid == 0 || (::kill(static_cast<pid_t>(pid), 0) != 0 && errno == ESRCH);
+    }
+
+    const char* const output_ports[]{ev3dev::OUTPUT_A, ev3dev::OUTPUT_B, ev3dev::OUTPUT_C, ev3dev::OUTPUT_D};
+    const char* const input_ports[]{ev3dev::INPUT_1, ev3dev::INPUT_2, ev3dev::INPUT_3, ev3dev::INPUT_4};
+} // namespace
+
+static_assert(ev3dev::device_snapshot::max_motors == 8 && ev3dev::device_snapshot::max_sensors == 8);
+
+// ###############
+// device_broker
+// ###############
+
+device_broker::device_broker(std::string name, const ISystem& system)
+    : name_{std::move(name)}
+    , size_{sizeof(segment)}
+    , snapshot_{system} {
+    int fd{::shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660)};
+    if (fd < 0 && errno == EEXIST) {
+        // Left behind by a broker that did not exit cleanly, or still in use.
+        if (! owner_dead(name_)) {
+            throw std::system_error{std::make_error_code(std::errc::device_or_resource_busy), "broker already running on " + name_};
+        }
+        ::shm_unlink(name_.c_str());
+        fd = ::shm_open(name_.c_str(), O_CREAT | O_EXCL | O_RDWR, 0660);
+    }
+    if (fd < 0) {
+        throw_errno("shm_open " + name_);
+    }
+    segment_guard guard{name_};
+
+    if (::ftruncate(fd, static_cast<off_t>(size_)) != 0) {
+        const auto error{errno};
+        ::close(fd);
+        errno = error;
+        throw_errno("ftruncate " + name_);
+    }
+
+    void* memory{::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        throw_errno("mmap " + name_);
+    }
+    guard.memory = memory;
+    guard.size = size_;
+
+    segment_ = new (memory) segment{};
+    segment_->pid.store(static_cast<std::uint32_t>(::getpid()));
+
+    for (auto port : output_ports) {
+        motor m{port, system};
+        if (m.connected()) {
+            auto& info{segment_->motors[motors_.size()]};
+            copy_name(info.address, m.address());
+            copy_name(info.driver_name, m.driver_name());
+            snapshot_.track(m);
+            motors_.push_back(std::move(m));
+        }
+    }
+
+    for (auto port : input_ports) {
+        sensor s{port, system};
+        if (s.connected()) {
+            auto& info{segment_->sensors[sensors_.size()]};
+            copy_name(info.address, s.address());
+            copy_name(info.driver_name, s.driver_name());
+            snapshot_.track(s);
+            sensors_.push_back(std::move(s));
+        }
+    }
+
+    segment_->motor_count = static_cast<std::uint32_t>(motors_.size());
+    segment_->sensor_count = static_cast<std::uint32_t>(sensors_.size());
+    segment_->ready.store(1, std::memory_order_release);
+    guard.release();
+}
+
+device_broker::~device_broker() {
+    segment_->ready.store(0, std::memory_order_release);
+    segment_->~segment();
+    ::munmap(segment_, size_);
+    ::shm_unlink(name_.c_str());
+}
+
+void device_broker::poll() {
+    motor_command c;
+    while (segment_->commands.pop(c)) {
+        try {
+            apply(c);
+            segment_->commands_applied.fetch_add(1, std::memory_order_relaxed);
+        } catch (...) {
+            segment_->commands_failed.fetch_add(1, std::memory_order_relaxed);
+        }
+    }
+
+    try {
+        // A device that fails to read keeps its last values, the rest are
+        // published all the same.
+        if (snapshot_.update() != 0) {
+            segment_->read_errors.fetch_add(1, std::memory_order_relaxed);
+        }
+        segment_->state.store(snapshot_.read());
+    } catch (...) {
+        segment_->read_errors.fetch_add(1, std::memory_order_relaxed);
+    }
+}
+
+void device_broker::run(std::chrono::microseconds period, const std::atomic<bool>& stop) {
+    auto next{std::chrono::steady_clock::now()};
+    while (! stop.load()) {
+        poll();
+        next = std::max(next + period, std::chrono::steady_clock::now());
+        std::this_thread::sleep_until(next);
+    }
+}
+
+void device_broker::apply(const motor_command& c) {
+    if (c.motor >= motors_.size()) {
+        throw std::system_error{std::make_error_code(std::errc::no_such_device), "no such motor"};
+    }
+
+    auto& m{motors_[c.motor]};
+    auto t{m.configure()};
+
+    switch (c.stop_action) {
+    case motor_command::coast: t.stop_action(motor::stop_action_coast); break;
+    case motor_command::brake: t.stop_action(motor::stop_action_brake); break;
+    case motor_command::hold: t.stop_action(motor::stop_action_hold); break;
+    default: break;
+    }
+
+    if (c.fields & motor_command::set_ramp_up_sp) {
+        t.ramp_up_sp(c.ramp_up_sp);
+    }
+    if (c.fields & motor_command::set_ramp_down_sp) {
+        t.ramp_down_sp(c.ramp_down_sp);
+    }
+    if (c.fields & motor_command::set_time_sp) {
+        t.time_sp(c.time_sp);
+    }
+    if (c.fields & motor_command::set_duty_cycle_sp) {
+        t.duty_cycle_sp(c.duty_cycle_sp);
+    }
+    if (c.fields & motor_command::set_speed_sp) {
+        t.speed_sp(c.speed_sp);
+    }
+    if (c.fields & motor_command::set_position_sp) {
+        t.position_sp(c.position_sp);
+    }
+
+    switch (c.command) {
+    case motor_command::run_forever: t.run_forever(); break;
+    case motor_command::run_to_abs_pos: t.run_to_abs_pos(); break;
+    case motor_command::run_to_rel_pos: t.run_to_rel_pos(); break;
+    case motor_command::run_timed: t.run_timed(); break;
+    case motor_command::run_direct: t.run_direct(); break;
+    case motor_command::stop: t.stop(); break;
+    case motor_command::reset:
+        t.apply();
+        m.reset();
+        break;
+    default: t.apply(); break;
+    }
+}
+
+// ###############
+// broker_client
+// ###############
+
+broker_client::broker_client(std::string_view name) : size_{sizeof(segment)} {
+    const std::string shm_name{name};
+    const int fd{::shm_open(shm_name.c_str(), O_RDWR, 0)};
+    if (fd < 0) {
+        throw_errno("shm_open " + shm_name);
+    }
+
+    struct stat st {};
+    if (::fstat(fd, &st) != 0 || static_cast<std::size_t>(st.st_size) < size_) {
+        ::close(fd);
+        throw std::system_error{std::make_error_code(std::errc::invalid_argument), "broker segment too small"};
+    }
+
+    void* memory{::mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0)};
+    ::close(fd);
+    if (memory == MAP_FAILED) {
+        throw_errno("mmap " + shm_name);
+    }
+
+    segment_ = static_cast<segment*>(memory);
+    if (segment_->magic != segment::magic_value || segment_->version != segment::layout_version ||
+        segment_->ready.load(std::memory_order_acquire) == 0) {
+        ::munmap(memory, size_);
+        throw std::system_error{std::make_error_code(std::errc::protocol_error), "broker not ready or incompatible"};
+    }
+}
+
+broker_client::~broker_client() { ::munmap(segment_, size_); }
+
+std::optional<std::size_t> broker_client::find_motor(std::string_view address) const noexcept {
+    return find(segment_->motors, segment_->motor_count, address);
+}
+
+std::optional<std::size_t> broker_client::find_sensor(std::string_view address) const noexcept {
+    return find(segment_->sensors, segment_->sensor_count, address);
+}
@@ -0,0 +1,60 @@
+// ev3dev-broker [--name /ev3dev-broker] [--period-ms 10] [--sys-root /sys/class]
+//
+// Owns the device I/O of the brick and shares it with other processes, see
+// broker/device_broker.h. Stops on SIGINT / SIGTERM.
+
+#include <broker/device_broker.h>
+
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <cstdlib>
+#include <exception>
+#include <fmt/format.h>
+#include <optional>
+#include <string>
+#include <string_view>
+
+namespace {
+    std::atomic<bool> stop_requested{false};
+
+    extern "C" void on_signal(int) { stop_requested = true; }
+} // namespace
+
+int main(int argc, char* argv[]) {
+    std::string name{ev3dev::broker::default_name};
+    int period_ms{10};
+    std::optional<std::string> sys_root;
+
+    for (int i = 1; i + 1 < argc; i += 2) {
+        const std::string_view option{argv[i]};
+        if (option == "--name") {
+            name = argv[i + 1];
+        } else if (option == "--period-ms") {
+            period_ms = std::atoi(argv[i + 1]);
+        } else if (option == "--sys-root") {
+            sys_root = argv[i + 1];
+        } else {
+            fmt::print(stderr, "Unknown option '{}'\n", option);
+            return 1;
+        }
+    }
+
+    std::signal(SIGINT, on_signal);
+    std::signal(SIGTERM, on_signal);
+
+    try {
+        const ev3dev::FdSystem system{sys_root ? *sys_root : ev3dev::default_system.get_sys_root()};
+        ev3dev::broker::device_broker broker{name, system};
+
+        const auto& shared{broker.shared()};
+        fmt::print("Serving {} motor(s) and {} sensor(s) on '{}'\n", shared.motor_count, shared.sensor_count, name);
+
+        broker.run(std::chrono::milliseconds{period_ms}, stop_requested);
+    } catch (const std::exception& e) {
+        fmt::print(stderr, "ev3dev-broker: {}\n", e.what());
+        return 1;
+    }
+
+    return 0;
+}
@@ -101,8 +101,8 @@ void control::drive(int speed, int time)
     _motor_left .set_time_sp(time).run_timed();
     _motor_right.set_time_sp(time).run_timed();
 
-    while (_motor_left.state().count("running") || _motor_right.state().count("running"))
-      this_thread::sleep_for(chrono::milliseconds(10));
+    _motor_left .wait_while(motor::state_running);
+    _motor_right.wait_while(motor::state_running);
 
     _state = state_idle;
   }
@@ -126,8 +126,8 @@ void control::turn(int direction)
   _motor_left. set_position_sp( direction).set_speed_sp(500).run_to_rel_pos();
   _motor_right.set_position_sp(-direction).set_speed_sp(500).run_to_rel_pos();
 
-  while (_motor_left.state().count("running") || _motor_right.state().count("running"))
-    this_thread::sleep_for(chrono::milliseconds(10));
+  _motor_left .wait_while(motor::state_running);
+  _motor_right.wait_while(motor::state_running);
 
   _state = state_idle;
 }
@@ -67,18 +67,13 @@ void drive(int speed, int distance, TMotors&&... motors)
         (void)dummy;
     }
 
-    auto running{[](const Motor& motor){
-        return motor.motor.state().count("running") != 0;
+    auto waitStopped{[](const Motor& motor){
+        motor.motor.wait_while(ev3dev::motor::state_running);
     }};
 
-    auto allStopped{[&](){
-        std::initializer_list<int> runningCounts{running(motors)...};
-        return std::accumulate(runningCounts.begin(), runningCounts.end(), 0, [](auto a, auto b){ return a + b; }) == 0;
-    }};
-
-    while (!allStopped())
     {
-        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        std::initializer_list<int> dummy{(waitStopped(motors), 0)...};
+        (void)dummy;
     }
 
     std::cout << "Done driving " << names << "!\n";
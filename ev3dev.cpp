@@ -28,7 +28,6 @@
 #include <iostream>
 #include <sstream>
 #include <fstream>
-#include <list>
 #include <map>
 #include <array>
 #include <algorithm>
@@ -37,26 +36,46 @@
 #include <chrono>
 #include <thread>
 #include <stdexcept>
+#include <charconv>
+#include <cmath>
+#include <cstdio>
+#include <utility>
+#include <limits>
 #include <string.h>
+#include <ctype.h>
 #include <math.h>
 
 #include <dirent.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
 #include <sys/mman.h>
+#include <sys/socket.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <stdlib.h>
 #include <errno.h>
 
 #ifndef FSTREAM_CACHE_SIZE
-#  define FSTREAM_CACHE_SIZE 16
+#  define FSTREAM_CACHE_SIZE 32
 #endif
 
 #ifndef NO_LINUX_HEADERS
 #  include <linux/fb.h>
 #  include <linux/input.h>
+#  include <linux/netlink.h>
 #else
 #  define KEY_CNT 8
 #endif
+
+#if !defined(NO_LINUX_HEADERS) && __has_include(<linux/io_uring.h>)
+#  include <linux/io_uring.h>
+#  include <sys/syscall.h>
+#  include <sys/uio.h>
+#  if defined(__NR_io_uring_setup) && defined(__NR_io_uring_enter)
+#    define EV3DEV_IO_URING 1
+#  endif
+#endif
 static const int bits_per_long = sizeof(long) * 8;
 
 ev3dev::RealSystem ev3dev::default_system{};
@@ -65,91 +84,214 @@ ev3dev::RealSystem ev3dev::default_system{};
 namespace ev3dev {
 namespace {
 
-// This class implements a small LRU cache. It assumes the number of elements
-// is small, and so uses a simple linear search.
-template <typename K, typename V>
-class lru_cache {
-    private:
-        // typedef st::pair<K, V> item;
-        // std::pair seems to be missing necessary move constructors :(
-        struct item {
-            K first;
-            V second;
-
-            template <typename TMakeValue>
-            item(const K &k, TMakeValue&& makeValue) : first(k), second{makeValue(k)} {}
-            item(item &&m) = default;
-        };
+//-----------------------------------------------------------------------------
+// Attribute I/O shared by the by-name accessors and the attribute handles.
+// Reads and writes that fail could mean the sysfs attribute was recreated and
+// the cached file handle got stale, so the file is reopened and the operation
+// retried (once). Failures come back as error codes, the throwing accessors
+// add the path when they turn them into exceptions.
+
+[[noreturn]] void throw_attr_error(std::error_code ec, const std::string &path) {
+    if (ec == std::errc::function_not_supported)
+        throw std::system_error(ec, "no device connected");
+    throw std::system_error(ec, path);
+}
 
-    public:
-        lru_cache(size_t size = 3) : _size(size) {}
-
-        template <typename TMakeValue>
-        V& get(const K &k, TMakeValue&& makeValue) {
-            iterator i = find(k);
-            if (i != _items.end()) {
-                // Found the key, bring the item to the front.
-                _items.splice(_items.begin(), _items, i);
-                return i->second;
-            } else {
-                // If the cache is full, remove oldest items to make room.
-                while (_items.size() + 1 > _size) {
-                    _items.pop_back();
-                }
+// The message is only built when there is an error to throw.
+template <typename T>
+T value_or_throw(outcome::result<T> &&r, const std::string &path, std::string_view name = {}) {
+    if (!r)
+        throw_attr_error(r.error(), std::string{path}.append(name));
+    if constexpr (!std::is_void_v<T>)
+        return std::move(r).value();
+}
 
-                // Insert a new default constructed value for this new key.
-                return _items.emplace_front(k, std::forward<TMakeValue>(makeValue)).second;
-            }
-        }
+std::error_code no_such_device() noexcept {
+    return std::make_error_code(std::errc::no_such_device);
+}
+
+outcome::result<int> try_read_int_attr(file_istream &is, const std::string &path) {
+    for(int attempt = 0; attempt < 2; ++attempt) {
+        is.prepare(path);
+        if (!is.is_open())
+            break;
+
+        int result = 0;
+        if (is.read_int(result))
+            return result;
+
+        is.close();
+        is.clear();
+    }
+    return no_such_device();
+}
+
+outcome::result<std::string> try_read_string_attr(file_istream &is, const std::string &path) {
+    // Clear the flags bits in case something happened (like reaching EOF).
+    is.prepare(path);
+    if (!is.is_open())
+        return no_such_device();
+
+    std::string result;
+    is.read_string(result);
+    return result;
+}
+
+outcome::result<std::string> try_read_line_attr(file_istream &is, const std::string &path) {
+    is.prepare(path);
+    if (!is.is_open())
+        return no_such_device();
+
+    std::string result;
+    is.read_line(result);
+    return result;
+}
+
+outcome::result<std::size_t> try_read_raw_attr(file_istream &is, const std::string &path,
+        char *buf, std::size_t size) {
+    is.prepare(path);
+    if (!is.is_open())
+        return no_such_device();
+    return is.read(buf, size);
+}
+
+std::string read_string_attr(file_istream &is, const std::string &path) {
+    return value_or_throw(try_read_string_attr(is, path), path);
+}
+
+std::string read_line_attr(file_istream &is, const std::string &path) {
+    return value_or_throw(try_read_line_attr(is, path), path);
+}
+
+std::size_t read_raw_attr(file_istream &is, const std::string &path, char *buf, std::size_t size) {
+    return value_or_throw(try_read_raw_attr(is, path, buf, size), path);
+}
+
+bool write_value(file_ostream &os, int value) { return os.write_int(value); }
+bool write_value(file_ostream &os, std::string_view value) { return os.write_string(value); }
+
+template <typename T>
+std::error_code write_attr(file_ostream &os, const std::string &path, T value) {
+    for(int attempt = 0; attempt < 2; ++attempt) {
+        os.prepare(path);
+        if (!os.is_open())
+            return no_such_device();
 
-        void clear() {
-            _items.clear();
+        if (write_value(os, value))
+            return {};
+
+        const int error = errno;
+        if (attempt == 0 && error == ENODEV) {
+            os.close();
+            os.clear();
+        } else {
+            return error ? std::error_code(error, std::system_category())
+                         : std::make_error_code(std::errc::io_error);
         }
+    }
+    return no_such_device();
+}
 
-    private:
-        typedef typename std::list<item>::iterator iterator;
+mode_set parse_mode_set(const std::string &s, std::string *pCur) {
+    using namespace std;
+
+    mode_set result;
+    size_t pos, last_pos = 0;
+    string t;
+    do {
+        pos = s.find(' ', last_pos);
 
-        iterator find(const K &k) {
-            return std::find_if(_items.begin(), _items.end(),
-                    [&](const item &i) { return i.first == k; });
+        if (pos != string::npos) {
+            t = s.substr(last_pos, pos-last_pos);
+            last_pos = pos+1;
+        } else {
+            t = s.substr(last_pos);
         }
 
-        size_t _size;
-        std::list<item> _items;
-};
+        if (!t.empty()) {
+            if (*t.begin()=='[') {
+                t = t.substr(1, t.length()-2);
+                if (pCur)
+                    *pCur = t;
+            }
+            result.insert(t);
+        }
+    } while (pos!=string::npos);
 
-// A global cache of files.
-file_istream& ifstream_cache(const std::string &path, const ISystem& sys) {
-    static lru_cache<std::string, std::unique_ptr<file_istream>> cache(FSTREAM_CACHE_SIZE);
-    static std::mutex mx;
+    return result;
+}
 
-    std::lock_guard<std::mutex> lock(mx);
-    auto& stream = *cache.get(path, [&sys](const auto &path) { return sys.OpenForRead(path); });
-    return stream;
+// Parses a space separated list of motor state flags into motor::flag_* bits
+// without allocating. Unknown flags are ignored.
+uint8_t parse_state_flags(const char *s, std::size_t n) noexcept {
+    static constexpr std::pair<std::string_view, uint8_t> flags[] = {
+        {motor::state_running,    motor::flag_running},
+        {motor::state_ramping,    motor::flag_ramping},
+        {motor::state_holding,    motor::flag_holding},
+        {motor::state_overloaded, motor::flag_overloaded},
+        {motor::state_stalled,    motor::flag_stalled}
+    };
+
+    uint8_t result = 0;
+    std::size_t i = 0;
+    while (i < n) {
+        while (i < n && isspace(static_cast<unsigned char>(s[i])))
+            ++i;
+        const std::size_t start = i;
+        while (i < n && !isspace(static_cast<unsigned char>(s[i])))
+            ++i;
+
+        const std::string_view word{s + start, i - start};
+        for (auto &f : flags) {
+            if (f.first == word)
+                result |= f.second;
+        }
+    }
+    return result;
 }
 
-file_ostream& ofstream_cache(const std::string &path, const ISystem& sys) {
-    static lru_cache<std::string, std::unique_ptr<file_ostream>> cache(FSTREAM_CACHE_SIZE);
-    static std::mutex mx;
+// Converts n values of the plain (host byte order) type Raw.
+template <typename Raw, typename T>
+void convert_bin_data(const char *raw, T *out, std::size_t n) noexcept {
+    for (std::size_t i = 0; i != n; ++i) {
+        Raw v;
+        memcpy(&v, raw + i * sizeof(Raw), sizeof(Raw));
+        out[i] = static_cast<T>(v);
+    }
+}
 
-    std::lock_guard<std::mutex> lock(mx);
+template <typename Raw>
+void convert_bin_data(const char *raw, float *out, std::size_t n, float scale) noexcept {
+    for (std::size_t i = 0; i != n; ++i) {
+        Raw v;
+        memcpy(&v, raw + i * sizeof(Raw), sizeof(Raw));
+        out[i] = static_cast<float>(v) * scale;
+    }
+}
 
-    auto& stream = *cache.get(path, [&sys](const auto &path) { return sys.OpenForWrite(path); });
-    return stream;
+int16_t load_s16_be(const char *p) noexcept {
+    const auto hi = static_cast<unsigned char>(p[0]);
+    const auto lo = static_cast<unsigned char>(p[1]);
+    return static_cast<int16_t>(static_cast<uint16_t>((hi << 8) | lo));
 }
 
-//-----------------------------------------------------------------------------
-file_ostream &ofstream_open(const std::string &path, const ISystem& sys) {
-    auto &file = ofstream_cache(path, sys);
-    file.prepare(path);
-    return file;
+// The format whose values are stored exactly as a T.
+template <typename T>
+constexpr bin_format native_bin_format() noexcept {
+    if constexpr (std::is_same_v<T, uint8_t>)  return bin_format::u8;
+    if constexpr (std::is_same_v<T, int8_t>)   return bin_format::s8;
+    if constexpr (std::is_same_v<T, uint16_t>) return bin_format::u16;
+    if constexpr (std::is_same_v<T, int16_t>)  return bin_format::s16;
+    if constexpr (std::is_same_v<T, int32_t>)  return bin_format::s32;
+    if constexpr (std::is_same_v<T, float>)    return bin_format::float32;
+    return bin_format::unknown;
 }
 
-file_istream &ifstream_open(const std::string &path, const ISystem& sys) {
-    auto &file = ifstream_cache(path, sys);
-    // Clear the flags bits in case something happened (like reaching EOF).
-    file.prepare(path);
-    return file;
+// The number of whole values in `raw` that fit into `out`.
+template <typename T>
+std::size_t bin_data_count(bin_format format, gsl::span<const char> raw, gsl::span<T> out) noexcept {
+    const std::size_t size = bin_format_size(format);
+    return size == 0 ? 0 : std::min(raw.size() / size, out.size());
 }
 
 struct file_ofstream : public file_ostream {
@@ -191,1072 +333,4578 @@ struct file_ifstream : public file_istream {
         }
     }
 
+    // Straight from the file buffer, no sentry and no stream state.
+    std::size_t read(char *buf, std::size_t size) override {
+        const auto n = _stream.rdbuf()->sgetn(buf, static_cast<std::streamsize>(size));
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
+    }
+
     std::istream& get() override { return _stream; }
     const std::istream& get() const override { return _stream; }
     std::ifstream _stream;
 };
 
-} // namespace
-
-
-//-----------------------------------------------------------------------------
-// RealSystem
 //-----------------------------------------------------------------------------
+// Parses a decimal integer the way `operator>>` would, minus the locale.
+bool parse_int(const char *first, const char *last, int &value) {
+    while (first != last && isspace(static_cast<unsigned char>(*first)))
+        ++first;
 
-RealSystem::RealSystem() : _sys_root{"/sys/class"} {}
+    if (first != last && *first == '+')
+        ++first;
 
-std::unique_ptr<file_ostream> RealSystem::OpenForWrite(const std::string &path) const {
-    auto file = std::make_unique<file_ofstream>(path);
-    // if (file->_stream.is_open()) {
-    //     // Don't buffer writes to avoid latency. Also saves a bit of memory.
-    //     file->_stream.rdbuf()->pubsetbuf(NULL, 0);
-    //     file->_stream.open(path);
-    // }
-    return file;
+    return std::from_chars(first, last, value).ec == std::errc{};
 }
 
-std::unique_ptr<file_istream> RealSystem::OpenForRead(const std::string &path) const {
-    auto file = std::make_unique<file_ifstream>(path);
-    //file->_stream.open(path);
-    return file;
+// Reads the attribute into a buffer from offset 0. Sysfs regenerates the
+// contents on every read from the start of the file, so no seek is needed.
+ssize_t pread_attr(int fd, char *buf, std::size_t size) {
+    ssize_t n;
+    do {
+        n = pread(fd, buf, size, 0);
+    } while (n < 0 && errno == EINTR);
+    return n;
 }
 
-void RealSystem::System(const char *command) const {
-    (void)!std::system(command);
+bool pwrite_attr(int fd, const char *buf, std::size_t size) {
+    ssize_t n;
+    do {
+        n = pwrite(fd, buf, size, 0);
+    } while (n < 0 && errno == EINTR);
+    return n == static_cast<ssize_t>(size);
 }
 
-const std::string& RealSystem::get_sys_root() const {
-    return _sys_root;
-}
+// Stream buffer over a raw descriptor. Only used when somebody asks a fd
+// backed file for its std::istream / std::ostream; the typed read/write
+// methods bypass it.
+class fd_streambuf : public std::streambuf {
+    public:
+        explicit fd_streambuf(const int &fd) : _fd(fd) {}
 
-void RealSystem::ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const {
-    struct dirent *dp;
-    auto dirCloser{[](DIR *dir) { closedir(dir); }};
-    std::unique_ptr<DIR, decltype(dirCloser)> dfd{nullptr, dirCloser};
+        void rewind() {
+            _offset = 0;
+            setg(_buf, _buf, _buf);
+            setp(_buf, _buf + sizeof(_buf));
+        }
 
-    dfd.reset(opendir(dir.c_str()));
-    if (dfd) {
-        while ((dp = readdir(dfd.get())) != nullptr) {
-            if (!fileFound(dp->d_name))
-            {
-                return;
+    protected:
+        int_type underflow() override {
+            if (gptr() < egptr())
+                return traits_type::to_int_type(*gptr());
+
+            ssize_t n;
+            do {
+                n = pread(_fd, _buf, sizeof(_buf), _offset);
+            } while (n < 0 && errno == EINTR);
+
+            if (n <= 0)
+                return traits_type::eof();
+
+            _offset += n;
+            setg(_buf, _buf, _buf + n);
+            return traits_type::to_int_type(*gptr());
+        }
+
+        int_type overflow(int_type c) override {
+            if (sync() != 0)
+                return traits_type::eof();
+
+            if (!traits_type::eq_int_type(c, traits_type::eof())) {
+                *pptr() = traits_type::to_char_type(c);
+                pbump(1);
             }
+            return traits_type::not_eof(c);
         }
-    }
-}
 
-//-----------------------------------------------------------------------------
-bool device::connect(
-        const std::string &dir,
-        const std::string &pattern,
-        const std::map<std::string, std::set<std::string>> &match
-        ) noexcept
-{
-    using namespace std;
+        // Writes whatever has been put so far with a single pwrite(), so
+        // that a sysfs attribute always sees the complete value at once.
+        int sync() override {
+            const auto size = static_cast<std::size_t>(pptr() - pbase());
+            if (size == 0)
+                return 0;
 
-    const size_t pattern_length = pattern.length();
+            ssize_t n;
+            do {
+                n = pwrite(_fd, pbase(), size, _offset);
+            } while (n < 0 && errno == EINTR);
 
-    bool result{false};
-    _system.ListFiles(dir, [&](zstring_ref fileName) {
-        if (strncmp(fileName.c_str(), pattern.c_str(), pattern_length)==0) {
-            try {
-                _path = dir + fileName.c_str() + '/';
+            if (n != static_cast<ssize_t>(size))
+                return -1;
 
-                bool bMatch = true;
-                for (auto &m : match) {
-                    const auto &attribute = m.first;
-                    const auto &matches   = m.second;
-                    const auto strValue   = get_attr_string(attribute);
+            _offset += n;
+            setp(_buf, _buf + sizeof(_buf));
+            return 0;
+        }
 
-                    if (!matches.empty() && !matches.begin()->empty() &&
-                            (matches.find(strValue) == matches.end()))
-                    {
-                        bMatch = false;
-                        break;
-                    }
-                }
+    private:
+        const int &_fd;
+        off_t _offset = 0;
+        char _buf[128];
+};
 
-                if (bMatch) {
-                    result = true;
-                    return false;
-                }
-            } catch (...) { }
+struct file_fd_ostream : public file_ostream {
+    // unitbuf: every insertion into get() ends up in a pwrite() of its own.
+    file_fd_ostream() { _stream.setf(std::ios::unitbuf); }
+    ~file_fd_ostream() override { close(); }
 
-            _path.clear();
+    bool is_open() const override { return _fd >= 0; }
+    void close() override {
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
         }
+    }
+    void clear() override { _stream.clear(); }
+    void prepare(const std::string& path) override {
+        if (_fd < 0)
+            _fd = open(path.c_str(), O_WRONLY | O_CLOEXEC);
 
-        return true;
-    });
+        _buf.rewind();
+        _stream.clear();
+    }
 
-    return result;
-}
+    std::ostream& get() override { return _stream; }
+    const std::ostream& get() const override { return _stream; }
 
-//-----------------------------------------------------------------------------
-int device::device_index() const {
-    using namespace std;
+    bool write_int(int value) override {
+        char buf[16];
+        const auto r = std::to_chars(buf, buf + sizeof(buf), value);
+        return pwrite_attr(_fd, buf, static_cast<std::size_t>(r.ptr - buf));
+    }
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    bool write_string(std::string_view value) override {
+        return pwrite_attr(_fd, value.data(), value.size());
+    }
 
-    if (_device_index < 0) {
-        unsigned f = 1;
-        _device_index = 0;
-        for (auto it=_path.rbegin(); it!=_path.rend(); ++it) {
-            if(*it =='/')
-                continue;
-            if ((*it < '0') || (*it > '9'))
-                break;
+    int _fd = -1;
+    fd_streambuf _buf{_fd};
+    std::ostream _stream{&_buf};
+};
+
+struct file_fd_istream : public file_istream {
+    ~file_fd_istream() override { close(); }
 
-            _device_index += (*it -'0') * f;
-            f *= 10;
+    int native_handle() const noexcept override { return _fd; }
+
+    bool is_open() const override { return _fd >= 0; }
+    void close() override {
+        if (_fd >= 0) {
+            ::close(_fd);
+            _fd = -1;
         }
     }
+    void clear() override { _stream.clear(); }
+    void prepare(const std::string& path) override {
+        if (_fd < 0)
+            _fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
 
-    return _device_index;
-}
+        _buf.rewind();
+        _stream.clear();
+    }
 
-//-----------------------------------------------------------------------------
-int device::get_attr_int(const std::string &name) const {
-    using namespace std;
+    std::istream& get() override { return _stream; }
+    const std::istream& get() const override { return _stream; }
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    bool read_int(int &value) override {
+        char buf[32];
+        const auto n = pread_attr(_fd, buf, sizeof(buf));
+        return n > 0 && parse_int(buf, buf + n, value);
+    }
 
-    for(int attempt = 0; attempt < 2; ++attempt) {
-        auto &is = ifstream_open(_path + name, _system);
-        if (is.is_open()) {
-            int result = 0;
-            try {
-                is.get() >> result;
-                return result;
-            } catch(...) {
-                // This could mean the sysfs attribute was recreated and the
-                // corresponding file handle got stale. Lets close the file and try
-                // again (once):
-                if (attempt != 0) throw;
+    bool read_string(std::string &value) override {
+        char buf[4096];
+        const auto n = pread_attr(_fd, buf, sizeof(buf));
+        if (n <= 0)
+            return false;
 
-                is.close();
-                is.clear();
-            }
-        } else break;
+        const char *first = buf, *last = buf + n;
+        while (first != last && isspace(static_cast<unsigned char>(*first)))
+            ++first;
+
+        const char *end = first;
+        while (end != last && !isspace(static_cast<unsigned char>(*end)))
+            ++end;
+
+        if (first == end)
+            return false;
+
+        value.assign(first, end);
+        return true;
     }
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
-}
 
-//-----------------------------------------------------------------------------
-void device::set_attr_int(const std::string &name, int value) {
-    using namespace std;
+    bool read_line(std::string &value) override {
+        char buf[4096];
+        const auto n = pread_attr(_fd, buf, sizeof(buf));
+        if (n < 0)
+            return false;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+        const char *first = buf, *last = buf + n;
+        value.assign(first, std::find(first, last, '\n'));
+        return true;
+    }
 
-    for(int attempt = 0; attempt < 2; ++attempt) {
-        auto &os = ofstream_open(_path + name, _system);
-        if (os.is_open()) {
-            if (os.get() << value) return;
-
-            // An error could mean that sysfs attribute was recreated and the cached
-            // file handle is stale. Lets close the file and try again (once):
-            if (attempt == 0 && errno == ENODEV) {
-                os.close();
-                os.clear();
-            } else {
-                throw system_error(std::error_code(errno, std::system_category()));
-            }
-        } else {
-            throw system_error(make_error_code(errc::no_such_device), _path + name);
-        }
+    std::size_t read(char *buf, std::size_t size) override {
+        const auto n = pread_attr(_fd, buf, size);
+        return n > 0 ? static_cast<std::size_t>(n) : 0;
     }
-}
+
+    int _fd = -1;
+    fd_streambuf _buf{_fd};
+    std::istream _stream{&_buf};
+};
+
+} // namespace
+
 
 //-----------------------------------------------------------------------------
-std::string device::get_attr_string(const std::string &name) const {
-    using namespace std;
+// ISystem
+//-----------------------------------------------------------------------------
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+ISystem::ISystem() = default;
 
-    auto &is = ifstream_open(_path + name, _system);
-    if (is.is_open()) {
-        string result;
-        is.get() >> result;
-        return result;
-    }
+ISystem::ISystem(const ISystem&) noexcept {}
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+ISystem::~ISystem() = default;
+
+std::unique_ptr<file_istream> ISystem::OpenForPoll(const std::string &path) const {
+    return OpenForRead(path);
 }
 
-//-----------------------------------------------------------------------------
-void device::set_attr_string(const std::string &name, const std::string &value) {
-    using namespace std;
+device_registry& ISystem::registry() const {
+    std::call_once(_registry_once, [this] { _registry = std::make_unique<device_registry>(*this); });
+    return *_registry;
+}
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+//-----------------------------------------------------------------------------
+// device_registry
+//-----------------------------------------------------------------------------
 
-    auto &os = ofstream_open(_path + name, _system);
-    if (os.is_open()) {
-        if (!(os.get() << value)) throw system_error(std::error_code(errno, std::system_category()));
-        return;
+void device_registry::class_dir::reindex() {
+    by_address.clear();
+    by_driver.clear();
+    for (std::size_t i = 0; i != entries.size(); ++i) {
+        if (!entries[i].address.empty())
+            by_address[entries[i].address].push_back(i);
+        if (!entries[i].driver_name.empty())
+            by_driver[entries[i].driver_name].push_back(i);
     }
+}
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+// Must be called with _mutex held.
+device_registry::entry device_registry::read_entry(const std::string &dir, const std::string &name) {
+    // Attributes a device does not have are left empty.
+    auto read_or_empty = [this](const std::string &path) {
+        auto is = _system.OpenForRead(path);
+        auto value = try_read_string_attr(*is, path);
+        return value ? std::move(value).value() : std::string{};
+    };
+
+    entry e;
+    e.name = name;
+    e.path = dir + name + '/';
+    e.address = read_or_empty(e.path + "address");
+    e.driver_name = read_or_empty(e.path + "driver_name");
+
+    auto &epoch = _epochs[e.path];
+    if (!epoch)
+        epoch = std::make_shared<std::atomic<unsigned>>(0);
+    e.epoch = epoch;
+    return e;
 }
 
-//-----------------------------------------------------------------------------
-std::string device::get_attr_line(const std::string &name) const {
-    using namespace std;
+// "." and "..", which RealSystem lists like any other name.
+static bool is_dot_entry(const char *name) noexcept {
+    return name[0] == '.' && (name[1] == '\0' || (name[1] == '.' && name[2] == '\0'));
+}
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+// Must be called with _mutex held.
+const device_registry::class_dir& device_registry::scan(const std::string &dir) {
+    auto found = _dirs.find(dir);
+    if (found != _dirs.end() && !found->second.stale)
+        return found->second;
+
+    class_dir result;
+    _system.ListFiles(dir, [&](zstring_ref fileName) {
+        if (!is_dot_entry(fileName.c_str()))
+            result.entries.push_back(read_entry(dir, fileName.c_str()));
+        return true;
+    });
+    result.reindex();
+    ++_scans;
+
+    if (found == _dirs.end())
+        return _dirs.emplace(dir, std::move(result)).first->second;
 
-    auto &is = ifstream_open(_path + name, _system);
-    if (is.is_open()) {
-        string result;
-        getline(is.get(), result);
-        return result;
+    // Devices that disappeared since the last scan.
+    for (auto &old : found->second.entries) {
+        if (std::none_of(result.entries.begin(), result.entries.end(),
+                    [&old](const entry &e) { return e.name == old.name; }))
+            ++*old.epoch;
     }
 
-    throw system_error(make_error_code(errc::no_such_device), _path+name);
+    found->second = std::move(result);
+    return found->second;
 }
 
-//-----------------------------------------------------------------------------
-mode_set device::get_attr_set(
-        const std::string &name, std::string *pCur) const
+std::vector<device_registry::entry> device_registry::find(
+        const std::string &dir,
+        const std::string &pattern,
+        const std::map<std::string, std::set<std::string>> &match)
 {
     using namespace std;
 
-    string s = get_attr_line(name);
-
-    mode_set result;
-    size_t pos, last_pos = 0;
-    string t;
-    do {
-        pos = s.find(' ', last_pos);
-
-        if (pos != string::npos) {
-            t = s.substr(last_pos, pos-last_pos);
-            last_pos = pos+1;
-        } else {
-            t = s.substr(last_pos);
+    // An empty set, or a set holding an empty string, matches anything.
+    auto wanted = [&match](const char *attribute) -> const set<string>* {
+        auto m = match.find(attribute);
+        if (m == match.end() || m->second.empty() || m->second.begin()->empty())
+            return nullptr;
+        return &m->second;
+    };
+    const set<string> *addresses = wanted("address");
+    const set<string> *drivers = wanted("driver_name");
+
+    lock_guard<mutex> lock(_mutex);
+    const class_dir &d = scan(dir);
+
+    // Narrow down by address, then driver name, through the indexes.
+    vector<size_t> candidates;
+    if (addresses || drivers) {
+        const auto &index = addresses ? d.by_address : d.by_driver;
+        for (const auto &key : addresses ? *addresses : *drivers) {
+            auto found = index.find(key);
+            if (found != index.end())
+                candidates.insert(candidates.end(), found->second.begin(), found->second.end());
         }
+        sort(candidates.begin(), candidates.end());
+    } else {
+        candidates.resize(d.entries.size());
+        for (size_t i = 0; i != candidates.size(); ++i)
+            candidates[i] = i;
+    }
 
-        if (!t.empty()) {
-            if (*t.begin()=='[') {
-                t = t.substr(1, t.length()-2);
-                if (pCur)
-                    *pCur = t;
-            }
-            result.insert(t);
-        }
-    } while (pos!=string::npos);
-
+    vector<entry> result;
+    for (auto i : candidates) {
+        const entry &e = d.entries[i];
+        if (e.name.compare(0, pattern.length(), pattern) != 0)
+            continue;
+        if (addresses && drivers && drivers->find(e.driver_name) == drivers->end())
+            continue;
+        result.push_back(e);
+    }
     return result;
 }
 
-//-----------------------------------------------------------------------------
-std::string device::get_attr_from_set(const std::string &name) const {
+void device_registry::rescan(const std::string &dir) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto found = _dirs.find(dir);
+    if (found != _dirs.end())
+        found->second.stale = true;
+}
+
+bool device_registry::refresh(const std::string &dir) {
     using namespace std;
 
-    string s = get_attr_line(name);
+    lock_guard<mutex> lock(_mutex);
+    auto found = _dirs.find(dir);
+    if (found == _dirs.end() || found->second.stale) {
+        scan(dir);
+        _dirs[dir].refreshed = chrono::steady_clock::now();
+        return true;
+    }
 
-    size_t pos, last_pos = 0;
-    string t;
-    do {
-        pos = s.find(' ', last_pos);
+    class_dir &d = found->second;
+    const auto now = chrono::steady_clock::now();
+    if (now - d.refreshed < refresh_interval)
+        return false;
+    d.refreshed = now;
 
-        if (pos != string::npos) {
-            t = s.substr(last_pos, pos-last_pos);
-            last_pos = pos+1;
-        } else {
-            t = s.substr(last_pos);
-        }
+    vector<string> names;
+    _system.ListFiles(dir, [&names](zstring_ref name) {
+        if (!is_dot_entry(name.c_str()))
+            names.emplace_back(name);
+        return true;
+    });
 
-        if (!t.empty()) {
-            if (*t.begin()=='[') {
-                return t.substr(1, t.length()-2);
-            }
-        }
-    } while (pos!=string::npos);
+    vector<entry> entries;
+    for (auto &name : names) {
+        auto known = find_if(d.entries.begin(), d.entries.end(),
+                [&name](const entry &e) { return e.name == name; });
+        entries.push_back(known != d.entries.end() ? *known : read_entry(dir, name));
+    }
 
-    return { "none" };
+    // Devices that disappeared since the last scan.
+    for (auto &old : d.entries) {
+        if (std::find(names.begin(), names.end(), old.name) == names.end())
+            ++*old.epoch;
+    }
+
+    d.entries = move(entries);
+    d.reindex();
+    ++_scans;
+    return true;
 }
 
-//-----------------------------------------------------------------------------
-constexpr char sensor::ev3_touch[];
-constexpr char sensor::ev3_color[];
-constexpr char sensor::ev3_ultrasonic[];
-constexpr char sensor::ev3_gyro[];
-constexpr char sensor::ev3_infrared[];
-constexpr char sensor::nxt_touch[];
-constexpr char sensor::nxt_light[];
-constexpr char sensor::nxt_sound[];
-constexpr char sensor::nxt_ultrasonic[];
-constexpr char sensor::nxt_i2c_sensor[];
-constexpr char sensor::nxt_analog[];
+void device_registry::rescan() {
+    std::lock_guard<std::mutex> lock(_mutex);
+    for (auto &d : _dirs)
+        d.second.stale = true;
+}
 
-//-----------------------------------------------------------------------------
-sensor::sensor(address_type address, const ISystem& system) : device{system} {
-    connect({{ "address", { address }}});
+void device_registry::device_added(const std::string &dir, const std::string &name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    // A replug under the same name: whoever still holds the old one reopens.
+    auto epoch = _epochs.find(dir + name + '/');
+    if (epoch != _epochs.end())
+        ++*epoch->second;
+
+    auto found = _dirs.find(dir);
+    if (found == _dirs.end() || found->second.stale)
+        return;
+
+    auto &entries = found->second.entries;
+    auto e = read_entry(dir, name);
+    auto existing = std::find_if(entries.begin(), entries.end(),
+            [&name](const entry &i) { return i.name == name; });
+    if (existing != entries.end())
+        *existing = std::move(e);
+    else
+        entries.push_back(std::move(e));
+    found->second.reindex();
 }
 
-//-----------------------------------------------------------------------------
-sensor::sensor(address_type address, const std::set<sensor_type> &types, const ISystem& system) : device{system} {
-    connect({{ "address", { address }}, { "driver_name", types }});
+void device_registry::device_removed(const std::string &dir, const std::string &name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+
+    auto epoch = _epochs.find(dir + name + '/');
+    if (epoch != _epochs.end())
+        ++*epoch->second;
+
+    auto found = _dirs.find(dir);
+    if (found == _dirs.end())
+        return;
+
+    auto &entries = found->second.entries;
+    entries.erase(std::remove_if(entries.begin(), entries.end(),
+                [&name](const entry &i) { return i.name == name; }),
+            entries.end());
+    found->second.reindex();
+}
+
+unsigned device_registry::scans() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _scans;
 }
 
 //-----------------------------------------------------------------------------
-bool sensor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
-{
-    std::string _strClassDir { _system.get_sys_root() + "/lego-sensor/" };
-    static const std::string _strPattern  { "sensor" };
+// device_watcher
+//-----------------------------------------------------------------------------
 
-    try {
-        if (device::connect(_strClassDir, _strPattern, match)) {
-            return true;
-        }
-    } catch (...) { }
+namespace {
 
-    _path.clear();
+// The class directories device objects connect to.
+constexpr const char *watched_classes[] = {
+    "tacho-motor", "lego-sensor", "dc-motor", "servo-motor", "lego-port", "leds", "power_supply"
+};
 
-    return false;
+[[noreturn]] void throw_errno(const char *what) {
+    throw std::system_error(errno, std::system_category(), what);
 }
 
-//-----------------------------------------------------------------------------
-std::string sensor::type_name() const {
-    auto type = driver_name();
-    if (type.empty()) {
-        static const std::string s("<none>");
-        return s;
-    }
+} // namespace
 
-    static const std::map<sensor_type, const std::string> lookup_table {
-        { ev3_touch,       "EV3 touch" },
-        { ev3_color,       "EV3 color" },
-        { ev3_ultrasonic,  "EV3 ultrasonic" },
-        { ev3_gyro,        "EV3 gyro" },
-        { ev3_infrared,    "EV3 infrared" },
-        { nxt_touch,       "NXT touch" },
-        { nxt_light,       "NXT light" },
-        { nxt_sound,       "NXT sound" },
-        { nxt_ultrasonic,  "NXT ultrasonic" },
-        { nxt_i2c_sensor,  "I2C sensor" }
-        };
+device_watcher::device_watcher(const ISystem &system, source src) : _system(system), _source(src) {
+    _wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (_wake_fd < 0)
+        throw_errno("eventfd");
 
-    auto s = lookup_table.find(type);
-    if (s != lookup_table.end())
-        return s->second;
+    if (_source == source::inotify) {
+        _fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+        if (_fd < 0) {
+            ::close(_wake_fd);
+            throw_errno("inotify_init1");
+        }
 
-    return type;
+        // Classes without a directory have no devices at all on this system.
+        for (auto c : watched_classes) {
+            const std::string dir = _system.get_sys_root() + '/' + c + '/';
+            const int wd = inotify_add_watch(_fd, dir.c_str(),
+                    IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR);
+            if (wd >= 0)
+                _watches[wd] = dir;
+        }
+    } else {
+#ifndef NO_LINUX_HEADERS
+        _fd = socket(AF_NETLINK, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, NETLINK_KOBJECT_UEVENT);
+        if (_fd < 0) {
+            ::close(_wake_fd);
+            throw_errno("socket(NETLINK_KOBJECT_UEVENT)");
+        }
+
+        sockaddr_nl addr{};
+        addr.nl_family = AF_NETLINK;
+        addr.nl_groups = 1; // kernel uevents
+        if (bind(_fd, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) < 0) {
+            const int err = errno;
+            ::close(_fd);
+            ::close(_wake_fd);
+            errno = err;
+            throw_errno("bind(NETLINK_KOBJECT_UEVENT)");
+        }
+#else
+        ::close(_wake_fd);
+        throw std::system_error(make_error_code(std::errc::function_not_supported), "uevent");
+#endif
+    }
 }
 
-//-----------------------------------------------------------------------------
-int sensor::value(unsigned index) const {
-    if (static_cast<int>(index) >= num_values())
-        throw std::invalid_argument("index");
+device_watcher::~device_watcher() {
+    stop();
+    ::close(_fd);
+    ::close(_wake_fd);
+}
 
-    char svalue[7] = "value0";
-    svalue[5] += index;
+unsigned device_watcher::subscribe(callback cb) {
+    std::lock_guard<std::mutex> lock(_subscribers_mutex);
+    _subscribers.emplace_back(_next_id, std::move(cb));
+    return _next_id++;
+}
 
-    return get_attr_int(svalue);
+void device_watcher::unsubscribe(unsigned id) {
+    std::lock_guard<std::mutex> lock(_subscribers_mutex);
+    _subscribers.erase(std::remove_if(_subscribers.begin(), _subscribers.end(),
+                [id](const auto &s) { return s.first == id; }),
+            _subscribers.end());
 }
 
-//-----------------------------------------------------------------------------
-float sensor::float_value(unsigned index) const {
-    return value(index) * powf(10, -decimals());
+void device_watcher::handle(const event &e) {
+    auto &registry = _system.registry();
+    if (e.kind == event::added)
+        registry.device_added(e.class_dir, e.name);
+    else
+        registry.device_removed(e.class_dir, e.name);
+
+    // Callbacks may unsubscribe, so call them on a copy.
+    std::vector<std::pair<unsigned, callback>> subscribers;
+    {
+        std::lock_guard<std::mutex> lock(_subscribers_mutex);
+        subscribers = _subscribers;
+    }
+    for (auto &s : subscribers)
+        s.second(e);
 }
 
-//-----------------------------------------------------------------------------
-const std::vector<char>& sensor::bin_data() const {
-    using namespace std;
+unsigned device_watcher::read_inotify() {
+    alignas(inotify_event) char buf[4096];
+    unsigned handled = 0;
 
-    if (_path.empty())
-        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+    for (;;) {
+        const ssize_t n = ::read(_fd, buf, sizeof(buf));
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return handled;
+        }
 
-    if (_bin_data.empty()) {
-        static const map<string, int> lookup_table {
-            {"u8",     1},
-            {"s8",     1},
-            {"u16",    2},
-            {"s16",    2},
-            {"s16_be", 2},
-            {"s32",    4},
-            {"float",  4}
-        };
+        for (ssize_t offset = 0; offset < n; ) {
+            const auto *ev = reinterpret_cast<const inotify_event*>(buf + offset);
+            offset += static_cast<ssize_t>(sizeof(inotify_event) + ev->len);
 
-        int value_size = 1;
+            if (ev->mask & IN_Q_OVERFLOW) {
+                // Events were lost, start over from the file system.
+                _system.registry().rescan();
+                continue;
+            }
 
-        auto s = lookup_table.find(bin_data_format());
-        if (s != lookup_table.end())
-            value_size = s->second;
+            auto dir = _watches.find(ev->wd);
+            if (dir == _watches.end() || ev->len == 0)
+                continue;
 
-        _bin_data.resize(num_values() * value_size);
+            const auto kind = (ev->mask & (IN_CREATE | IN_MOVED_TO)) ? event::added : event::removed;
+            handle({kind, dir->second, ev->name});
+            ++handled;
+        }
     }
+}
 
-    const string fname = _path + "bin_data";
-    auto &is = ifstream_open(fname, _system);
-    if (is.is_open()) {
-        is.get().read(_bin_data.data(), _bin_data.size());
-        return _bin_data;
-    }
+unsigned device_watcher::read_uevent() {
+    char buf[8192];
+    unsigned handled = 0;
 
-    throw system_error(make_error_code(errc::no_such_device), fname);
-}
+    for (;;) {
+        const ssize_t n = ::recv(_fd, buf, sizeof(buf) - 1, 0);
+        if (n <= 0) {
+            if (n < 0 && errno == EINTR)
+                continue;
+            return handled;
+        }
+        buf[n] = '\0';
+
+        // "ACTION@DEVPATH\0KEY=VALUE\0KEY=VALUE\0..."
+        std::string_view action, subsystem, devpath;
+        for (const char *p = buf; p < buf + n; p += strlen(p) + 1) {
+            const std::string_view field{p};
+            if (field.compare(0, 7, "ACTION=") == 0)
+                action = field.substr(7);
+            else if (field.compare(0, 10, "SUBSYSTEM=") == 0)
+                subsystem = field.substr(10);
+            else if (field.compare(0, 8, "DEVPATH=") == 0)
+                devpath = field.substr(8);
+        }
 
-//-----------------------------------------------------------------------------
-i2c_sensor::i2c_sensor(address_type address, const std::set<sensor_type> &types, const ISystem& system)
-    : sensor(address, types, system)
-{ }
+        if (action != "add" && action != "remove")
+            continue;
+        if (std::none_of(std::begin(watched_classes), std::end(watched_classes),
+                    [&subsystem](const char *c) { return subsystem == c; }))
+            continue;
 
-//-----------------------------------------------------------------------------
-constexpr char touch_sensor::mode_touch[];
+        const auto slash = devpath.rfind('/');
+        const std::string name{devpath.substr(slash == std::string_view::npos ? 0 : slash + 1)};
+        const std::string dir = _system.get_sys_root() + '/' + std::string{subsystem} + '/';
 
-touch_sensor::touch_sensor(address_type address, const ISystem& system)
-    : sensor(address, { ev3_touch, nxt_touch }, system)
-{ }
+        handle({action == "add" ? event::added : event::removed, dir, name});
+        ++handled;
+    }
+}
 
-//-----------------------------------------------------------------------------
-constexpr char color_sensor::mode_col_reflect[];
-constexpr char color_sensor::mode_col_ambient[];
-constexpr char color_sensor::mode_col_color[];
-constexpr char color_sensor::mode_ref_raw[];
-constexpr char color_sensor::mode_rgb_raw[];
-constexpr char color_sensor::color_nocolor[];
-constexpr char color_sensor::color_black[];
-constexpr char color_sensor::color_blue[];
-constexpr char color_sensor::color_green[];
-constexpr char color_sensor::color_yellow[];
-constexpr char color_sensor::color_red[];
-constexpr char color_sensor::color_white[];
-constexpr char color_sensor::color_brown[];
+unsigned device_watcher::dispatch(std::chrono::milliseconds timeout) {
+    pollfd fds[2] = {
+        {_fd, POLLIN, 0},
+        {_wake_fd, POLLIN, 0}
+    };
 
-color_sensor::color_sensor(address_type address, const ISystem& system)
-    : sensor(address, { ev3_color }, system)
-{ }
+    int ready;
+    do {
+        ready = poll(fds, 2, static_cast<int>(timeout.count()));
+    } while (ready < 0 && errno == EINTR);
 
-//-----------------------------------------------------------------------------
-constexpr char ultrasonic_sensor::mode_us_dist_cm[];
-constexpr char ultrasonic_sensor::mode_us_dist_in[];
-constexpr char ultrasonic_sensor::mode_us_listen[];
-constexpr char ultrasonic_sensor::mode_us_si_cm[];
-constexpr char ultrasonic_sensor::mode_us_si_in[];
+    if (ready <= 0 || !(fds[0].revents & POLLIN))
+        return 0;
 
-ultrasonic_sensor::ultrasonic_sensor(address_type address, const ISystem& system)
-    : sensor(address, { ev3_ultrasonic, nxt_ultrasonic }, system)
-{ }
+    return _source == source::inotify ? read_inotify() : read_uevent();
+}
 
-ultrasonic_sensor::ultrasonic_sensor(address_type address, const std::set<sensor_type>& sensorTypes, const ISystem& system)
-    : sensor(address, sensorTypes, system)
-{ }
+void device_watcher::start() {
+    if (_thread.joinable())
+        return;
 
-//-----------------------------------------------------------------------------
-constexpr char gyro_sensor::mode_gyro_ang[];
-constexpr char gyro_sensor::mode_gyro_rate[];
-constexpr char gyro_sensor::mode_gyro_fas[];
-constexpr char gyro_sensor::mode_gyro_g_a[];
-constexpr char gyro_sensor::mode_gyro_cal[];
+    _stop = false;
+    _thread = std::thread([this] {
+        while (!_stop.load())
+            dispatch(std::chrono::milliseconds{-1});
+    });
+}
 
-gyro_sensor::gyro_sensor(address_type address, const ISystem& system)
-    : sensor(address, { ev3_gyro }, system)
-{ }
+void device_watcher::stop() {
+    if (!_thread.joinable())
+        return;
 
-//-----------------------------------------------------------------------------
-constexpr char infrared_sensor::mode_ir_prox[];
-constexpr char infrared_sensor::mode_ir_seek[];
-constexpr char infrared_sensor::mode_ir_remote[];
-constexpr char infrared_sensor::mode_ir_rem_a[];
-constexpr char infrared_sensor::mode_ir_cal[];
+    _stop = true;
+    const uint64_t one = 1;
+    if (::write(_wake_fd, &one, sizeof(one)) < 0) {
+        // The counter cannot overflow with one write per stop(), nothing to do.
+    }
+    _thread.join();
 
-infrared_sensor::infrared_sensor(address_type address, const ISystem& system)
-    : sensor(address, { ev3_infrared }, system)
-{ }
+    uint64_t drained;
+    if (::read(_wake_fd, &drained, sizeof(drained)) < 0) {
+        // Already drained.
+    }
+}
 
 //-----------------------------------------------------------------------------
-constexpr char sound_sensor::mode_db[];
-constexpr char sound_sensor::mode_dba[];
+// RealSystem
+//-----------------------------------------------------------------------------
 
-sound_sensor::sound_sensor(address_type address, const ISystem& system)
-    : sensor(address, { nxt_sound, nxt_analog }, system)
-{
-    if (connected() && driver_name() == nxt_analog) {
-        lego_port port(address);
+RealSystem::RealSystem() : _sys_root{"/sys/class"} {}
 
-        if (port.connected()) {
-            port.set_set_device(nxt_sound);
+RealSystem::RealSystem(std::string sys_root) : _sys_root{std::move(sys_root)} {}
 
-            if (port.status() != nxt_sound) {
-                // Failed to load lego-nxt-sound friver. Wrong port?
-                _path.clear();
-            }
-        } else {
-            _path.clear();
-        }
-    }
+std::unique_ptr<file_ostream> RealSystem::OpenForWrite(const std::string &path) const {
+    auto file = std::make_unique<file_ofstream>(path);
+    // if (file->_stream.is_open()) {
+    //     // Don't buffer writes to avoid latency. Also saves a bit of memory.
+    //     file->_stream.rdbuf()->pubsetbuf(NULL, 0);
+    //     file->_stream.open(path);
+    // }
+    return file;
 }
 
-//-----------------------------------------------------------------------------
-constexpr char light_sensor::mode_reflect[];
-constexpr char light_sensor::mode_ambient[];
+std::unique_ptr<file_istream> RealSystem::OpenForRead(const std::string &path) const {
+    auto file = std::make_unique<file_ifstream>(path);
+    //file->_stream.open(path);
+    return file;
+}
 
-light_sensor::light_sensor(address_type address, const ISystem& system)
-    : sensor(address, { nxt_light }, system)
-{ }
+std::unique_ptr<file_istream> RealSystem::OpenForPoll(const std::string &) const {
+    return std::make_unique<file_fd_istream>();
+}
 
-//-----------------------------------------------------------------------------
-constexpr char motor::motor_large[];
-constexpr char motor::motor_medium[];
-constexpr char motor::motor_nxt[];
-constexpr char motor::command_run_forever[];
-constexpr char motor::command_run_to_abs_pos[];
-constexpr char motor::command_run_to_rel_pos[];
-constexpr char motor::command_run_timed[];
-constexpr char motor::command_run_direct[];
-constexpr char motor::command_stop[];
-constexpr char motor::command_reset[];
-constexpr char motor::encoder_polarity_normal[];
-constexpr char motor::encoder_polarity_inversed[];
-constexpr char motor::polarity_normal[];
-constexpr char motor::polarity_inversed[];
-constexpr char motor::state_running[];
-constexpr char motor::state_ramping[];
-constexpr char motor::state_holding[];
-constexpr char motor::state_overloaded[];
-constexpr char motor::state_stalled[];
-constexpr char motor::stop_action_coast[];
-constexpr char motor::stop_action_brake[];
-constexpr char motor::stop_action_hold[];
+void RealSystem::System(const char *command) const {
+    (void)!std::system(command);
+}
 
-//-----------------------------------------------------------------------------
-motor::motor(address_type address, const ISystem& system) : device{system} {
-    connect({{ "address", { address } }});
+const std::string& RealSystem::get_sys_root() const {
+    return _sys_root;
 }
 
-//-----------------------------------------------------------------------------
-motor::motor(address_type address, const motor_type &t, const ISystem& system) : device{system} {
-    connect({{ "address", { address } }, { "driver_name", { t }}});
+void RealSystem::ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const {
+    struct dirent *dp;
+    auto dirCloser{[](DIR *dir) { closedir(dir); }};
+    std::unique_ptr<DIR, decltype(dirCloser)> dfd{nullptr, dirCloser};
+
+    dfd.reset(opendir(dir.c_str()));
+    if (dfd) {
+        while ((dp = readdir(dfd.get())) != nullptr) {
+            if (!fileFound(dp->d_name))
+            {
+                return;
+            }
+        }
+    }
 }
 
 //-----------------------------------------------------------------------------
-bool motor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
-{
-    std::string _strClassDir { _system.get_sys_root() + "/tacho-motor/" };
-    static const std::string _strPattern  { "motor" };
-
-    try {
-        return device::connect(_strClassDir, _strPattern, match);
-    } catch (...) { }
+// FdSystem
+//-----------------------------------------------------------------------------
 
-    _path.clear();
+std::unique_ptr<file_ostream> FdSystem::OpenForWrite(const std::string &) const {
+    return std::make_unique<file_fd_ostream>();
+}
 
-    return false;
+std::unique_ptr<file_istream> FdSystem::OpenForRead(const std::string &) const {
+    return std::make_unique<file_fd_istream>();
 }
 
 //-----------------------------------------------------------------------------
-medium_motor::medium_motor(address_type address, const ISystem& system)
-    : motor(address, motor_medium, system)
-{ }
-
+// InstrumentedSystem
 //-----------------------------------------------------------------------------
-large_motor::large_motor(address_type address, const ISystem& system)
-    : motor(address, motor_large, system)
-{ }
+struct InstrumentedSystem::counters {
+    struct op {
+        std::atomic<std::uint64_t> count{0};
+        std::atomic<std::uint64_t> errors{0};
+        std::atomic<std::uint64_t> bytes{0};
+        std::atomic<std::uint64_t> total_ns{0};
+        std::atomic<std::uint64_t> max_ns{0};
+        std::array<std::atomic<std::uint64_t>, histogram_buckets> histogram{};
+
+        void record(std::chrono::nanoseconds time, std::size_t size, bool ok) noexcept {
+            using namespace std;
+
+            const auto ns = static_cast<uint64_t>(max<chrono::nanoseconds::rep>(time.count(), 0));
+            size_t bucket = 0;
+            for (auto v = ns >> 1; v != 0 && bucket + 1 < histogram_buckets; v >>= 1)
+                ++bucket;
+
+            count.fetch_add(1, memory_order_relaxed);
+            if (!ok)
+                errors.fetch_add(1, memory_order_relaxed);
+            bytes.fetch_add(size, memory_order_relaxed);
+            total_ns.fetch_add(ns, memory_order_relaxed);
+            histogram[bucket].fetch_add(1, memory_order_relaxed);
+
+            auto old_max = max_ns.load(memory_order_relaxed);
+            while (ns > old_max && !max_ns.compare_exchange_weak(old_max, ns, memory_order_relaxed))
+                ;
+        }
 
-//-----------------------------------------------------------------------------
-nxt_motor::nxt_motor(address_type address, const ISystem& system)
-    : motor(address, motor_nxt, system)
-{ }
+        void reset() noexcept {
+            for (auto *c : {&count, &errors, &bytes, &total_ns, &max_ns})
+                c->store(0, std::memory_order_relaxed);
+            for (auto &h : histogram)
+                h.store(0, std::memory_order_relaxed);
+        }
+    };
 
-//-----------------------------------------------------------------------------
-dc_motor::dc_motor(address_type address, const ISystem& system) : device{system} {
-    std::string _strClassDir { _system.get_sys_root() + "/dc-motor/" };
-    static const std::string _strPattern  { "motor" };
+    op& operator[](InstrumentedSystem::op o) noexcept { return ops[static_cast<std::size_t>(o)]; }
 
-    connect(_strClassDir, _strPattern, {{ "address", { address }}});
-}
+    std::array<op, op_count> ops;
+    std::atomic<std::uint64_t> reopens{0};
+    // Whether the path was ever opened for reading / writing.
+    std::atomic<bool> opened_for_read{false};
+    std::atomic<bool> opened_for_write{false};
+};
 
-constexpr char dc_motor::command_run_forever[];
-constexpr char dc_motor::command_run_timed[];
-constexpr char dc_motor::command_run_direct[];
-constexpr char dc_motor::command_stop[];
-constexpr char dc_motor::polarity_normal[];
-constexpr char dc_motor::polarity_inversed[];
-constexpr char dc_motor::stop_action_coast[];
-constexpr char dc_motor::stop_action_brake[];
+namespace {
 
-//-----------------------------------------------------------------------------
-servo_motor::servo_motor(address_type address, const ISystem& system) : device{system} {
-    std::string _strClassDir { _system.get_sys_root() + "/servo-motor/" };
-    static const std::string _strPattern  { "motor" };
+using instrument_clock = std::chrono::steady_clock;
 
-    connect(_strClassDir, _strPattern, {{ "address", { address }}});
+// Characters of a value as it appears in the file, for the byte counts.
+std::size_t text_size(int value) noexcept {
+    char buf[16];
+    return static_cast<std::size_t>(std::to_chars(buf, buf + sizeof(buf), value).ptr - buf);
 }
 
-constexpr char servo_motor::command_run[];
-constexpr char servo_motor::command_float[];
-constexpr char servo_motor::polarity_normal[];
-constexpr char servo_motor::polarity_inversed[];
+// Times prepare(): the first one, and any that opens a file closed in the
+// meantime, is an open, otherwise the time goes to the next read or write.
+template <typename Stream>
+class prepare_timer {
+    public:
+        prepare_timer(InstrumentedSystem::op open_op, std::chrono::nanoseconds open_time) noexcept
+            : _open_op(open_op), _open_time(open_time) {}
+
+        template <typename Counters>
+        void prepare(Stream &inner, Counters &c, const std::string &path) {
+            const bool was_open = inner.is_open();
+            const auto start = instrument_clock::now();
+            inner.prepare(path);
+            const auto time = instrument_clock::now() - start;
+
+            if (_first) {
+                _first = false;
+                c[_open_op].record(_open_time + time, 0, inner.is_open());
+            } else if (!was_open) {
+                c[_open_op].record(time, 0, inner.is_open());
+                c.reopens.fetch_add(1, std::memory_order_relaxed);
+            } else {
+                _pending += time;
+            }
+        }
 
-//-----------------------------------------------------------------------------
-led::led(std::string name, const ISystem& system) : device{system} {
-    std::string _strClassDir { _system.get_sys_root() + "/leds/" };
-    connect(_strClassDir, name, std::map<std::string, std::set<std::string>>());
-}
+        // Time spent in prepare() since the last read or write.
+        std::chrono::nanoseconds take_pending() noexcept {
+            return std::exchange(_pending, std::chrono::nanoseconds{0});
+        }
 
-//-----------------------------------------------------------------------------
-void led::flash(unsigned on_ms, unsigned off_ms) {
-    static const mode_type timer("timer");
-    set_trigger(timer);
-    if (on_ms) {
-        // A workaround for ev3dev/ev3dev#225.
-        // It takes some time for delay_{on,off} sysfs attributes to appear after
-        // led trigger has been set to "timer".
-        for (int i = 0; ; ++i) {
-            std::this_thread::sleep_for(std::chrono::milliseconds(100));
-            try {
-                set_delay_on (on_ms );
-                set_delay_off(off_ms);
-                break;
-            } catch(...) {
-                if (i >= 5) throw;
-            }
+    private:
+        InstrumentedSystem::op _open_op;
+        std::chrono::nanoseconds _open_time;
+        std::chrono::nanoseconds _pending{0};
+        bool _first = true;
+};
+
+void write_json_string(std::ostream &os, std::string_view s) {
+    os << '"';
+    for (const char ch : s) {
+        switch (ch) {
+            case '"':  os << "\\\""; break;
+            case '\\': os << "\\\\"; break;
+            case '\n': os << "\\n"; break;
+            default:
+                if (static_cast<unsigned char>(ch) < 0x20) {
+                    char buf[8];
+                    snprintf(buf, sizeof(buf), "\\u%04x", static_cast<unsigned>(static_cast<unsigned char>(ch)));
+                    os << buf;
+                } else {
+                    os << ch;
+                }
         }
     }
+    os << '"';
 }
 
-//-----------------------------------------------------------------------------
-#if defined(EV3DEV_PLATFORM_BRICKPI)
+const char *op_name(InstrumentedSystem::op o) noexcept {
+    switch (o) {
+        case InstrumentedSystem::op::open_read:  return "open_read";
+        case InstrumentedSystem::op::open_write: return "open_write";
+        case InstrumentedSystem::op::read:       return "read";
+        case InstrumentedSystem::op::write:      return "write";
+    }
+    return "";
+}
 
-led led::blue_led1{"brickpi:led1:blue:ev3dev"};
-led led::blue_led2{"brickpi:led2:blue:ev3dev"};
+} // namespace
 
-std::vector<led*> led::led1{ &led::blue_led1 };
-std::vector<led*> led::led2{ &led::blue_led2 };
+class InstrumentedSystem::istream : public file_istream {
+    public:
+        istream(std::unique_ptr<file_istream> inner, counters &c, std::chrono::nanoseconds open_time)
+            : _inner(std::move(inner)), _counters(c), _prepare(op::open_read, open_time) {}
 
-std::vector<float> led::black{ static_cast<float>(0) };
-std::vector<float> led::blue{ static_cast<float>(1) };
+        bool is_open() const override { return _inner->is_open(); }
+        void close() override { _inner->close(); }
+        void clear() override { _inner->clear(); }
+        void prepare(const std::string &path) override { _prepare.prepare(*_inner, _counters, path); }
 
-//-----------------------------------------------------------------------------
-void led::all_off() {
+        std::istream& get() override { return _inner->get(); }
+        const std::istream& get() const override { return _inner->get(); }
+        int native_handle() const noexcept override { return _inner->native_handle(); }
 
-    blue_led1.off();
-    blue_led2.off();
+        bool read_int(int &value) override {
+            return timed([&] { return _inner->read_int(value); }, [&](bool ok) { return ok ? text_size(value) : 0; });
+        }
+        bool read_string(std::string &value) override {
+            return timed([&] { return _inner->read_string(value); }, [&](bool ok) { return ok ? value.size() : 0; });
+        }
+        bool read_line(std::string &value) override {
+            return timed([&] { return _inner->read_line(value); }, [&](bool ok) { return ok ? value.size() : 0; });
+        }
+        std::size_t read(char *buf, std::size_t size) override {
+            std::size_t n = 0;
+            timed([&] { n = _inner->read(buf, size); return n != 0 || size == 0; }, [&](bool) { return n; });
+            return n;
+        }
 
-}
+    private:
+        template <typename Read, typename Size>
+        bool timed(Read &&read, Size &&size) {
+            const auto start = instrument_clock::now();
+            const bool ok = read();
+            const auto time = instrument_clock::now() - start + _prepare.take_pending();
+            _counters[op::read].record(time, size(ok), ok);
+            return ok;
+        }
 
-#elif defined(EV3DEV_PLATFORM_BRICKPI3)
-led led::amber_led1{"brickpi3:amber:ev3dev"};
+        std::unique_ptr<file_istream> _inner;
+        counters &_counters;
+        prepare_timer<file_istream> _prepare;
+};
 
-std::vector<led*> led::led1{ &led::amber_led1 };
+class InstrumentedSystem::ostream : public file_ostream {
+    public:
+        ostream(std::unique_ptr<file_ostream> inner, counters &c, std::chrono::nanoseconds open_time)
+            : _inner(std::move(inner)), _counters(c), _prepare(op::open_write, open_time) {}
 
-std::vector<float> led::black{ static_cast<float>(0) };
-std::vector<float> led::blue{ static_cast<float>(1) };
+        bool is_open() const override { return _inner->is_open(); }
+        void close() override { _inner->close(); }
+        void clear() override { _inner->clear(); }
+        void prepare(const std::string &path) override { _prepare.prepare(*_inner, _counters, path); }
 
-//-----------------------------------------------------------------------------
-void led::all_off() {
+        std::ostream& get() override { return _inner->get(); }
+        const std::ostream& get() const override { return _inner->get(); }
 
-    amber_led1.off();
+        bool write_int(int value) override {
+            return timed([&] { return _inner->write_int(value); }, text_size(value));
+        }
+        bool write_string(std::string_view value) override {
+            return timed([&] { return _inner->write_string(value); }, value.size());
+        }
 
-}
-#elif defined(EV3DEV_PLATFORM_PISTORMS)
+    private:
+        template <typename Write>
+        bool timed(Write &&write, std::size_t size) {
+            const auto start = instrument_clock::now();
+            const bool ok = write();
+            const int error = errno;
+            const auto time = instrument_clock::now() - start + _prepare.take_pending();
+            _counters[op::write].record(time, ok ? size : 0, ok);
+            // The caller looks at errno to decide whether to retry.
+            errno = error;
+            return ok;
+        }
 
-led led::red_left{"pistorms:BB:red:ev3dev"};
-led led::red_right{"pistorms:BA:red:ev3dev"};
-led led::green_left{"pistorms:BB:green:ev3dev"};
-led led::green_right{"pistorms:BA:green:ev3dev"};
-led led::blue_left{"pistorms:BB:blue:ev3dev"};
-led led::blue_right{"pistorms:BA:blue:ev3dev"};
+        std::unique_ptr<file_ostream> _inner;
+        counters &_counters;
+        prepare_timer<file_ostream> _prepare;
+};
 
-std::vector<led*> led::left{ &led::red_left, &led::green_left, &led::blue_left };
-std::vector<led*> led::right{ &led::red_right, &led::green_right, &led::blue_right };
+InstrumentedSystem::InstrumentedSystem(const ISystem &inner) : _inner(inner) {}
 
-std::vector<float> led::black{ static_cast<float>(0), static_cast<float>(0), static_cast<float>(0) };
-std::vector<float> led::red{ static_cast<float>(1), static_cast<float>(0), static_cast<float>(0) };
-std::vector<float> led::green{ static_cast<float>(0), static_cast<float>(1), static_cast<float>(0) };
-std::vector<float> led::blue{ static_cast<float>(0), static_cast<float>(0), static_cast<float>(1) };
-std::vector<float> led::yellow{ static_cast<float>(1), static_cast<float>(1), static_cast<float>(0) };
-std::vector<float> led::purple{ static_cast<float>(1), static_cast<float>(0), static_cast<float>(1) };
-std::vector<float> led::cyan{ static_cast<float>(0), static_cast<float>(1), static_cast<float>(1) };
-std::vector<float> led::white{ static_cast<float>(1), static_cast<float>(1), static_cast<float>(1) };
-std::vector<float> led::orange{ static_cast<float>(1), static_cast<float>(0.5), static_cast<float>(0) };
+InstrumentedSystem::~InstrumentedSystem() {
+    if (_dump_file.empty())
+        return;
 
-//-----------------------------------------------------------------------------
-void led::all_off() {
+    std::ofstream os(_dump_file);
+    if (os)
+        dump(os, _dump_format);
+}
 
-    red_left.off();
-    red_right.off();
-    green_left.off();
-    green_right.off();
-    blue_left.off();
-    blue_right.off();
+InstrumentedSystem::counters& InstrumentedSystem::counters_for(const std::string &path) const {
+    {
+        std::shared_lock<std::shared_mutex> lock(_mutex);
+        auto found = _paths.find(path);
+        if (found != _paths.end())
+            return *found->second;
+    }
 
+    std::lock_guard<std::shared_mutex> lock(_mutex);
+    auto &c = _paths[path];
+    if (!c)
+        c = std::make_unique<counters>();
+    return *c;
 }
 
-#else
-
-led led::red_left{"led0:red:brick-status"};
-led led::red_right{"led1:red:brick-status"};
-led led::green_left{"led0:green:brick-status"};
-led led::green_right{"led1:green:brick-status"};
+std::unique_ptr<file_ostream> InstrumentedSystem::OpenForWrite(const std::string &path) const {
+    auto &c = counters_for(path);
+    if (c.opened_for_write.exchange(true, std::memory_order_relaxed))
+        c.reopens.fetch_add(1, std::memory_order_relaxed);
 
-std::vector<led*> led::left{ &led::red_left, &led::green_left };
-std::vector<led*> led::right{ &led::red_right, &led::green_right };
+    const auto start = instrument_clock::now();
+    auto inner = _inner.OpenForWrite(path);
+    return std::make_unique<ostream>(std::move(inner), c, instrument_clock::now() - start);
+}
 
-std::vector<float> led::black{ static_cast<float>(0), static_cast<float>(0) };
-std::vector<float> led::red{ static_cast<float>(1), static_cast<float>(0) };
-std::vector<float> led::green{ static_cast<float>(0), static_cast<float>(1) };
-std::vector<float> led::amber{ static_cast<float>(1), static_cast<float>(1) };
-std::vector<float> led::orange{ static_cast<float>(1), static_cast<float>(0.5) };
-std::vector<float> led::yellow{ static_cast<float>(0.1), static_cast<float>(1) };
+std::unique_ptr<file_istream> InstrumentedSystem::OpenForRead(const std::string &path) const {
+    return open_read(path, false);
+}
 
-//-----------------------------------------------------------------------------
-void led::all_off() {
+std::unique_ptr<file_istream> InstrumentedSystem::OpenForPoll(const std::string &path) const {
+    return open_read(path, true);
+}
 
-    red_left.off();
-    red_right.off();
-    green_left.off();
-    green_right.off();
+std::unique_ptr<file_istream> InstrumentedSystem::open_read(const std::string &path, bool for_poll) const {
+    auto &c = counters_for(path);
+    if (c.opened_for_read.exchange(true, std::memory_order_relaxed))
+        c.reopens.fetch_add(1, std::memory_order_relaxed);
 
+    const auto start = instrument_clock::now();
+    auto inner = for_poll ? _inner.OpenForPoll(path) : _inner.OpenForRead(path);
+    return std::make_unique<istream>(std::move(inner), c, instrument_clock::now() - start);
 }
 
-#endif
+std::chrono::nanoseconds InstrumentedSystem::op_stats::percentile(double p) const noexcept {
+    const auto wanted = static_cast<std::uint64_t>(std::ceil(p * static_cast<double>(count)));
+    std::uint64_t seen = 0;
+    for (std::size_t i = 0; i != histogram_buckets; ++i) {
+        seen += histogram[i];
+        if (seen >= wanted && seen != 0)
+            return std::min(std::chrono::nanoseconds{std::int64_t{2} << i}, max);
+    }
+    return max;
+}
 
-//-----------------------------------------------------------------------------
-void led::set_color(const std::vector<led*> &group, const std::vector<float> &color) {
-    const size_t n = std::min(group.size(), color.size());
-    for(size_t i = 0; i < n; ++i)
-        group[i]->set_brightness_pct(color[i]);
+std::chrono::nanoseconds InstrumentedSystem::path_stats::total() const noexcept {
+    std::chrono::nanoseconds result{0};
+    for (auto &o : ops)
+        result += o.total;
+    return result;
 }
 
-//-----------------------------------------------------------------------------
-power_supply power_supply::battery { "" };
+std::vector<InstrumentedSystem::path_stats> InstrumentedSystem::stats() const {
+    using namespace std;
 
-//-----------------------------------------------------------------------------
-power_supply::power_supply(std::string name, const ISystem& system) : device{system} {
-    if (name.empty())
-        name = "lego-ev3-battery";
+    vector<path_stats> result;
+    {
+        shared_lock<shared_mutex> lock(_mutex);
+        result.reserve(_paths.size());
+        for (auto &p : _paths) {
+            path_stats s;
+            s.path = p.first;
+            s.reopens = p.second->reopens.load(memory_order_relaxed);
+            for (size_t i = 0; i != op_count; ++i) {
+                auto &from = p.second->ops[i];
+                auto &to = s.ops[i];
+                to.count  = from.count.load(memory_order_relaxed);
+                to.errors = from.errors.load(memory_order_relaxed);
+                to.bytes  = from.bytes.load(memory_order_relaxed);
+                to.total  = chrono::nanoseconds{static_cast<int64_t>(from.total_ns.load(memory_order_relaxed))};
+                to.max    = chrono::nanoseconds{static_cast<int64_t>(from.max_ns.load(memory_order_relaxed))};
+                for (size_t b = 0; b != histogram_buckets; ++b)
+                    to.histogram[b] = from.histogram[b].load(memory_order_relaxed);
+            }
+            result.push_back(move(s));
+        }
+    }
 
-    connect(_system.get_sys_root() + "/power_supply", name, std::map<std::string, std::set<std::string>>());
+    stable_sort(result.begin(), result.end(), [](const path_stats &a, const path_stats &b) {
+        return a.total() > b.total();
+    });
+    return result;
 }
 
-//-----------------------------------------------------------------------------
-button::file_descriptor::file_descriptor(const char *path, int flags)
-    : _fd(open(path, flags))
-{ }
+void InstrumentedSystem::reset() {
+    std::shared_lock<std::shared_mutex> lock(_mutex);
+    for (auto &p : _paths) {
+        for (auto &o : p.second->ops)
+            o.reset();
+        p.second->reopens.store(0, std::memory_order_relaxed);
+    }
+}
 
-button::file_descriptor::~file_descriptor() {
-    if (_fd != -1) close(_fd);
+void InstrumentedSystem::dump(std::ostream &os, format f) const {
+    using namespace std::chrono;
+
+    const auto all = stats();
+    const auto us = [](nanoseconds t) { return duration<double, std::micro>(t).count(); };
+
+    if (f == format::json) {
+        os << "{\"paths\":[";
+        for (std::size_t i = 0; i != all.size(); ++i) {
+            const auto &p = all[i];
+            os << (i ? "," : "") << "{\"path\":";
+            write_json_string(os, p.path);
+            os << ",\"reopens\":" << p.reopens;
+            for (std::size_t o = 0; o != op_count; ++o) {
+                const auto &s = p.ops[o];
+                os << ",\"" << op_name(static_cast<op>(o)) << "\":{\"count\":" << s.count
+                   << ",\"errors\":" << s.errors << ",\"bytes\":" << s.bytes
+                   << ",\"total_ns\":" << s.total.count() << ",\"max_ns\":" << s.max.count()
+                   << ",\"histogram\":[";
+                for (std::size_t b = 0; b != histogram_buckets; ++b)
+                    os << (b ? "," : "") << s.histogram[b];
+                os << "]}";
+            }
+            os << '}';
+        }
+        os << "]}\n";
+        return;
+    }
+
+    for (const auto &p : all) {
+        os << p.path << "  (" << us(p.total()) << " us total, " << p.reopens << " reopens)\n";
+        for (std::size_t o = 0; o != op_count; ++o) {
+            const auto &s = p.ops[o];
+            if (s.count == 0)
+                continue;
+            os << "    " << op_name(static_cast<op>(o))
+               << ": count " << s.count << ", errors " << s.errors << ", bytes " << s.bytes
+               << ", mean " << us(s.total) / static_cast<double>(s.count) << " us"
+               << ", p50 <= " << us(s.percentile(0.5)) << " us"
+               << ", p99 <= " << us(s.percentile(0.99)) << " us"
+               << ", max " << us(s.max) << " us\n";
+        }
+    }
+}
+
+void InstrumentedSystem::dump_at_exit(std::string file, format f) {
+    _dump_file = std::move(file);
+    _dump_format = f;
 }
 
 //-----------------------------------------------------------------------------
-button::button(int bit)
-    :
-       _bit(bit),
-      _buf((KEY_CNT + bits_per_long - 1) / bits_per_long),
-      _fd( new file_descriptor("/dev/input/by-path/platform-gpio_keys-event", O_RDONLY) )
-{ }
-
+// RecordingSystem and ReplaySystem
 //-----------------------------------------------------------------------------
-bool button::pressed() const {
-#ifndef NO_LINUX_HEADERS
-    if (ioctl(*_fd, EVIOCGKEY(_buf.size()), _buf.data()) < 0) {
-        // handle error
-    }
-#endif
-    return (_buf[_bit / bits_per_long] & 1 << (_bit % bits_per_long));
-}
+// The file starts with "EV3REC", a version byte and the sys root. Every event
+// follows as its kind, the nanoseconds since the previous event and a
+// payload. Numbers are LEB128 varints, strings a varint length and the bytes.
+// Paths are sent once with a `path` event and referred to by index after
+// that. Reads and writes are stored as the attribute text, so a replay does
+// not depend on whether the library reads an int, a word or raw bytes. Opens
+// are logged when the stream actually opens, with whether that worked.
+namespace {
 
-//-----------------------------------------------------------------------------
-bool button::process() {
-    bool new_state = pressed();
+constexpr char record_magic[] = {'E', 'V', '3', 'R', 'E', 'C'};
+constexpr char record_version = 1;
 
-    if (new_state != _state) {
-        _state = new_state;
-        if (onclick) onclick(new_state);
-        return true;
-    }
+enum class record_kind : unsigned char { path, open_read, open_write, read, write, system, list };
 
-    return false;
+void put_varint(std::string &out, std::uint64_t v) {
+    while (v >= 0x80) {
+        out.push_back(static_cast<char>((v & 0x7f) | 0x80));
+        v >>= 7;
+    }
+    out.push_back(static_cast<char>(v));
 }
 
-//-----------------------------------------------------------------------------
-#ifndef NO_LINUX_HEADERS
-button button::back (KEY_BACKSPACE);
-button button::left (KEY_LEFT);
-button button::right(KEY_RIGHT);
-button button::up   (KEY_UP);
-button button::down (KEY_DOWN);
-button button::enter(KEY_ENTER);
-#endif
-
-//-----------------------------------------------------------------------------
-bool button::process_all() {
-    std::array<bool, 6> changed{{
-        back. process(),
-            left. process(),
-            right.process(),
-            up.   process(),
-            down. process(),
-            enter.process()
-    }};
-    return std::any_of(changed.begin(), changed.end(), [](bool c){ return c; });
+void put_string(std::string &out, std::string_view s) {
+    put_varint(out, s.size());
+    out.append(s);
 }
 
-//-----------------------------------------------------------------------------
-void sound::beep(const std::string &args, bool bSynchronous, const ISystem& system) {
-    std::ostringstream cmd;
-    cmd << "/usr/bin/beep " << args;
-    if (!bSynchronous) cmd << " &";
-    system.System(cmd.str().c_str());
+std::string int_text(int value) {
+    char buf[16];
+    return std::string(buf, static_cast<std::size_t>(std::to_chars(buf, buf + sizeof(buf), value).ptr - buf));
 }
 
-//-----------------------------------------------------------------------------
-void sound::tone(
-        const std::vector< std::vector<float> > &sequence,
-        bool bSynchronous,
-        const ISystem& system)
-{
-    std::ostringstream args;
-    bool first = true;
+// Reads the format above, throws on truncated or malformed input.
+class record_reader {
+    public:
+        record_reader(const std::string &data, const std::string &file) : _p(data.data()), _end(data.data() + data.size()), _file(file) {}
 
-    for(auto v : sequence) {
-        if (first) {
-            first = false;
-        } else {
-            args << " -n";
+        bool done() const noexcept { return _p == _end; }
+
+        unsigned char byte() {
+            need(1);
+            return static_cast<unsigned char>(*_p++);
         }
 
-        if (v.size() > 0) {
-            args << " -f " << v[0];
-        } else {
-            continue;
+        std::uint64_t varint() {
+            std::uint64_t v = 0;
+            for (unsigned shift = 0; shift < 64; shift += 7) {
+                const unsigned char b = byte();
+                v |= static_cast<std::uint64_t>(b & 0x7f) << shift;
+                if (!(b & 0x80))
+                    return v;
+            }
+            fail();
         }
 
-        if (v.size() > 1) {
-            args << " -l " << v[1];
-        } else {
-            continue;
+        std::string string() {
+            const auto n = varint();
+            need(n);
+            std::string s(_p, static_cast<std::size_t>(n));
+            _p += n;
+            return s;
         }
 
-        if (v.size() > 2) {
-            args << " -D " << v[2];
-        } else {
-            continue;
+        void need(std::uint64_t n) {
+            if (static_cast<std::uint64_t>(_end - _p) < n)
+                fail();
         }
+
+        [[noreturn]] void fail() const {
+            throw std::system_error(std::make_error_code(std::errc::bad_message), _file);
+        }
+
+    private:
+        const char *_p;
+        const char *_end;
+        const std::string &_file;
+};
+
+} // namespace
+
+struct RecordingSystem::log {
+    log(const std::string &file, const std::string &sys_root) : out(file, std::ios::binary) {
+        if (!out)
+            throw std::system_error(std::error_code(errno, std::system_category()), file);
+
+        buffer.append(record_magic, sizeof(record_magic));
+        buffer.push_back(record_version);
+        put_string(buffer, sys_root);
+        last = std::chrono::steady_clock::now();
     }
 
-    beep(args.str(), bSynchronous, system);
-}
+    // The index of `path`, sent along first if it is new. Must hold mutex.
+    std::uint64_t path_id(const std::string &path) {
+        auto found = paths.find(path);
+        if (found != paths.end())
+            return found->second;
 
-//-----------------------------------------------------------------------------
-void sound::tone(float frequency, float ms, bool bSynchronous, const ISystem& system) {
-    tone({{frequency, ms, 0.0f}}, bSynchronous, system);
-}
+        begin(record_kind::path);
+        put_string(buffer, path);
+        return paths.emplace(path, paths.size()).first->second;
+    }
 
-//-----------------------------------------------------------------------------
-void sound::play(const std::string &soundfile, bool bSynchronous, const ISystem& system) {
-    std::ostringstream cmd;
-    cmd << "/usr/bin/aplay -q " << soundfile;
+    // Starts an event. Must hold mutex.
+    void begin(record_kind kind) {
+        const auto now = std::chrono::steady_clock::now();
+        buffer.push_back(static_cast<char>(kind));
+        put_varint(buffer, static_cast<std::uint64_t>(std::chrono::duration_cast<std::chrono::nanoseconds>(now - last).count()));
+        last = now;
+        ++events;
+    }
 
-    if (!bSynchronous) cmd << " &";
+    void open(record_kind kind, const std::string &path, bool ok) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto id = path_id(path);
+        begin(kind);
+        put_varint(buffer, id);
+        buffer.push_back(ok ? 1 : 0);
+        flush_if_full();
+    }
 
-    system.System(cmd.str().c_str());
-}
+    void io(record_kind kind, const std::string &path, bool ok, std::string_view text) {
+        std::lock_guard<std::mutex> lock(mutex);
+        const auto id = path_id(path);
+        begin(kind);
+        put_varint(buffer, id);
+        buffer.push_back(ok ? 1 : 0);
+        put_string(buffer, ok ? text : std::string_view{});
+        flush_if_full();
+    }
 
-//-----------------------------------------------------------------------------
-void sound::speak(const std::string &text, bool bSynchronous, const ISystem& system) {
-    std::ostringstream cmd;
+    void flush_if_full() {
+        if (buffer.size() >= 64 * 1024)
+            flush();
+    }
 
-    cmd << "/usr/bin/espeak -a 200 --stdout \"" << text << "\""
-        << " | /usr/bin/aplay -q";
+    // Must hold mutex.
+    void flush() {
+        out.write(buffer.data(), static_cast<std::streamsize>(buffer.size()));
+        out.flush();
+        buffer.clear();
+    }
 
-    if (!bSynchronous) cmd << " &";
+    std::mutex mutex;
+    std::ofstream out;
+    std::string buffer;
+    std::unordered_map<std::string, std::uint64_t> paths;
+    std::chrono::steady_clock::time_point last;
+    std::uint64_t events = 0;
+};
 
-    system.System(cmd.str().c_str());
+class RecordingSystem::istream : public file_istream {
+    public:
+        istream(std::unique_ptr<file_istream> inner, log &l, std::string path)
+            : _inner(std::move(inner)), _log(l), _path(std::move(path)) {}
+
+        bool is_open() const override { return _inner->is_open(); }
+        void close() override { _inner->close(); }
+        void clear() override { _inner->clear(); }
+        void prepare(const std::string &path) override {
+            // Streams open lazily, so this is where an open succeeds or fails.
+            const bool was_open = _inner->is_open();
+            _inner->prepare(path);
+            if (!was_open)
+                _log.open(record_kind::open_read, _path, _inner->is_open());
+        }
+
+        std::istream& get() override { return _inner->get(); }
+        const std::istream& get() const override { return _inner->get(); }
+        int native_handle() const noexcept override { return _inner->native_handle(); }
+
+        bool read_int(int &value) override {
+            const bool ok = _inner->read_int(value);
+            _log.io(record_kind::read, _path, ok, ok ? int_text(value) : std::string{});
+            return ok;
+        }
+        bool read_string(std::string &value) override {
+            const bool ok = _inner->read_string(value);
+            _log.io(record_kind::read, _path, ok, value);
+            return ok;
+        }
+        bool read_line(std::string &value) override {
+            const bool ok = _inner->read_line(value);
+            _log.io(record_kind::read, _path, ok, value);
+            return ok;
+        }
+        std::size_t read(char *buf, std::size_t size) override {
+            const std::size_t n = _inner->read(buf, size);
+            _log.io(record_kind::read, _path, n != 0 || size == 0, {buf, n});
+            return n;
+        }
+
+    private:
+        std::unique_ptr<file_istream> _inner;
+        log &_log;
+        std::string _path;
+};
+
+class RecordingSystem::ostream : public file_ostream {
+    public:
+        ostream(std::unique_ptr<file_ostream> inner, log &l, std::string path)
+            : _inner(std::move(inner)), _log(l), _path(std::move(path)) {}
+
+        bool is_open() const override { return _inner->is_open(); }
+        void close() override { _inner->close(); }
+        void clear() override { _inner->clear(); }
+        void prepare(const std::string &path) override {
+            const bool was_open = _inner->is_open();
+            _inner->prepare(path);
+            if (!was_open)
+                _log.open(record_kind::open_write, _path, _inner->is_open());
+        }
+
+        std::ostream& get() override { return _inner->get(); }
+        const std::ostream& get() const override { return _inner->get(); }
+
+        bool write_int(int value) override {
+            return recorded(_inner->write_int(value), int_text(value));
+        }
+        bool write_string(std::string_view value) override {
+            return recorded(_inner->write_string(value), value);
+        }
+
+    private:
+        bool recorded(bool ok, std::string_view text) {
+            // The caller looks at errno to decide whether to retry.
+            const int error = errno;
+            _log.io(record_kind::write, _path, ok, text);
+            errno = error;
+            return ok;
+        }
+
+        std::unique_ptr<file_ostream> _inner;
+        log &_log;
+        std::string _path;
+};
+
+RecordingSystem::RecordingSystem(const ISystem &inner, const std::string &file)
+    : _inner(inner), _log(std::make_unique<log>(file, inner.get_sys_root())) {}
+
+RecordingSystem::~RecordingSystem() {
+    flush();
 }
 
-//-----------------------------------------------------------------------------
-lcd::lcd() :
-    _fb(nullptr), _fbsize(0), _llength(0), _xres(0), _yres(0), _bpp(0)
-{
-    init();
+std::unique_ptr<file_ostream> RecordingSystem::OpenForWrite(const std::string &path) const {
+    return std::make_unique<ostream>(_inner.OpenForWrite(path), *_log, path);
 }
 
-//-----------------------------------------------------------------------------
-lcd::~lcd() {
-    deinit();
+std::unique_ptr<file_istream> RecordingSystem::OpenForRead(const std::string &path) const {
+    return std::make_unique<istream>(_inner.OpenForRead(path), *_log, path);
 }
 
-//-----------------------------------------------------------------------------
-void lcd::fill(unsigned char pixel) {
-    if (_fb && _fbsize) {
-        memset(_fb, pixel, _fbsize);
+std::unique_ptr<file_istream> RecordingSystem::OpenForPoll(const std::string &path) const {
+    return std::make_unique<istream>(_inner.OpenForPoll(path), *_log, path);
+}
+
+void RecordingSystem::System(const char *command) const {
+    {
+        std::lock_guard<std::mutex> lock(_log->mutex);
+        _log->begin(record_kind::system);
+        put_string(_log->buffer, command);
     }
+    _inner.System(command);
+}
+
+void RecordingSystem::ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const {
+    std::vector<std::string> names;
+    _inner.ListFiles(dir, [&](zstring_ref name) {
+        names.emplace_back(name);
+        return fileFound(name);
+    });
+
+    std::lock_guard<std::mutex> lock(_log->mutex);
+    const auto id = _log->path_id(std::string(dir));
+    _log->begin(record_kind::list);
+    put_varint(_log->buffer, id);
+    put_varint(_log->buffer, names.size());
+    for (auto &name : names)
+        put_string(_log->buffer, name);
+}
+
+std::uint64_t RecordingSystem::events() const {
+    std::lock_guard<std::mutex> lock(_log->mutex);
+    return _log->events;
+}
+
+void RecordingSystem::flush() {
+    std::lock_guard<std::mutex> lock(_log->mutex);
+    _log->flush();
 }
 
 //-----------------------------------------------------------------------------
-void lcd::init() {
-    using namespace std;
+struct ReplaySystem::recording {
+    struct path_log {
+        bool readable = false;
+        bool writable = false;
+        std::deque<std::pair<bool, std::string>> reads;
+        std::deque<std::pair<bool, std::string>> writes;
+    };
+
+    // Must hold mutex.
+    void mismatch(std::string what) {
+        ++result.mismatches;
+        if (result.details.size() < 16)
+            result.details.push_back(std::move(what));
+    }
 
-#ifdef _LINUX_FB_H
-    int fbf = open("/dev/fb0", O_RDWR);
-    if (fbf < 0)
-        return;
+    std::mutex mutex;
+    std::string sys_root;
+    std::unordered_map<std::string, path_log> paths;
+    std::map<std::string, std::deque<std::vector<std::string>>, std::less<>> listings;
+    std::deque<std::string> system_calls;
+    std::chrono::nanoseconds duration{0};
+    report result;
+};
 
-    fb_fix_screeninfo i;
-    if (ioctl(fbf, FBIOGET_FSCREENINFO, &i) < 0)
-        return;
+class ReplaySystem::istream : public file_istream {
+    public:
+        istream(recording &r, recording::path_log *l) : _rec(r), _log(l) {}
 
-    _fbsize  = i.smem_len;
-    _llength = i.line_length;
+        bool is_open() const override { return _log && _log->readable; }
+        void close() override {}
+        void clear() override {}
+        void prepare(const std::string &) override {}
 
-    _fb = (unsigned char*)mmap(NULL, _fbsize, PROT_READ|PROT_WRITE, MAP_SHARED, fbf, 0);
-    if (_fb == nullptr)
-        return;
+        std::istream& get() override { return _empty; }
+        const std::istream& get() const override { return _empty; }
 
-    fb_var_screeninfo v;
+        bool read_int(int &value) override {
+            std::string text;
+            return next(text) && parse_int(text.data(), text.data() + text.size(), value);
+        }
+        bool read_string(std::string &value) override { return next(value); }
+        bool read_line(std::string &value) override { return next(value); }
+        std::size_t read(char *buf, std::size_t size) override {
+            std::string text;
+            if (!next(text))
+                return 0;
+            const std::size_t n = std::min(size, text.size());
+            memcpy(buf, text.data(), n);
+            return n;
+        }
 
-    if (ioctl(fbf, FBIOGET_VSCREENINFO, &v) < 0)
-        return;
+    private:
+        bool next(std::string &text) {
+            std::lock_guard<std::mutex> lock(_rec.mutex);
+            ++_rec.result.reads;
+            if (!_log || _log->reads.empty()) {
+                ++_rec.result.missing_reads;
+                return false;
+            }
 
-    _xres = v.xres;
-    _yres = v.yres;
-    _bpp  = v.bits_per_pixel;
-#endif
-}
+            auto entry = std::move(_log->reads.front());
+            _log->reads.pop_front();
+            text = std::move(entry.second);
+            return entry.first;
+        }
 
-//-----------------------------------------------------------------------------
-void lcd::deinit() {
-    if (_fb) {
-        munmap(_fb, 0);
-    }
+        recording &_rec;
+        recording::path_log *_log;
+        std::istringstream _empty;
+};
 
-    _fbsize = 0;
-}
+class ReplaySystem::ostream : public file_ostream {
+    public:
+        ostream(recording &r, recording::path_log *l, std::string path) : _rec(r), _log(l), _path(std::move(path)) {}
 
-//-----------------------------------------------------------------------------
-remote_control::remote_control(unsigned channel)
-    : _sensor(new infrared_sensor), _owns_sensor(true)
-{
-    if ((channel >= 1) && (channel <=4))
-        _channel = channel-1;
+        bool is_open() const override { return _log && _log->writable; }
+        void close() override {}
+        void clear() override {}
+        void prepare(const std::string &) override {}
 
-    if (_sensor->connected())
-        _sensor->set_mode(infrared_sensor::mode_ir_remote);
+        std::ostream& get() override { return _discard; }
+        const std::ostream& get() const override { return _discard; }
+
+        bool write_int(int value) override { return check(int_text(value)); }
+        bool write_string(std::string_view value) override { return check(value); }
+
+    private:
+        bool check(std::string_view text) {
+            std::lock_guard<std::mutex> lock(_rec.mutex);
+            ++_rec.result.writes;
+            if (!_log || _log->writes.empty()) {
+                _rec.mismatch(_path + ": unexpected write of '" + std::string(text) + "'");
+                return true;
+            }
+
+            auto expected = std::move(_log->writes.front());
+            _log->writes.pop_front();
+            if (expected.first && expected.second != text) {
+                _rec.mismatch(_path + ": wrote '" + std::string(text) + "', recorded '" + expected.second + "'");
+            }
+            if (!expected.first)
+                errno = EIO;
+            return expected.first;
+        }
+
+        recording &_rec;
+        recording::path_log *_log;
+        std::string _path;
+        std::ostringstream _discard;
+};
+
+ReplaySystem::ReplaySystem(const std::string &file) : _rec(std::make_unique<recording>()) {
+    std::ifstream in(file, std::ios::binary);
+    if (!in)
+        throw std::system_error(std::error_code(errno, std::system_category()), file);
+    const std::string data{std::istreambuf_iterator<char>(in), std::istreambuf_iterator<char>()};
+
+    record_reader r(data, file);
+    r.need(sizeof(record_magic) + 1);
+    for (const char c : record_magic) {
+        if (static_cast<char>(r.byte()) != c)
+            r.fail();
+    }
+    if (static_cast<char>(r.byte()) != record_version)
+        r.fail();
+    _rec->sys_root = r.string();
+
+    std::vector<std::string> paths;
+    auto path = [&]() -> const std::string& {
+        const auto id = r.varint();
+        if (id >= paths.size())
+            r.fail();
+        return paths[static_cast<std::size_t>(id)];
+    };
+
+    std::uint64_t total_ns = 0;
+    bool first = true;
+    while (!r.done()) {
+        const auto kind = static_cast<record_kind>(r.byte());
+        const auto delta = r.varint();
+        // The time before the first event is spent before recording starts.
+        if (!first)
+            total_ns += delta;
+        first = false;
+
+        switch (kind) {
+            case record_kind::path:
+                paths.push_back(r.string());
+                break;
+            case record_kind::open_read:
+            case record_kind::open_write: {
+                auto &log = _rec->paths[path()];
+                // A path counts as openable if it ever opened while recording.
+                if (r.byte() != 0)
+                    (kind == record_kind::open_read ? log.readable : log.writable) = true;
+                break;
+            }
+            case record_kind::read:
+            case record_kind::write: {
+                auto &log = _rec->paths[path()];
+                const bool ok = r.byte() != 0;
+                auto text = r.string();
+                (kind == record_kind::read ? log.reads : log.writes).emplace_back(ok, std::move(text));
+                break;
+            }
+            case record_kind::system:
+                _rec->system_calls.push_back(r.string());
+                break;
+            case record_kind::list: {
+                const auto &dir = path();
+                std::vector<std::string> names;
+                for (auto n = r.varint(); n != 0; --n)
+                    names.push_back(r.string());
+                _rec->listings[dir].push_back(std::move(names));
+                break;
+            }
+            default:
+                r.fail();
+        }
+    }
+    _rec->duration = std::chrono::nanoseconds{static_cast<std::int64_t>(total_ns)};
 }
 
-//-----------------------------------------------------------------------------
-remote_control::remote_control(infrared_sensor &ir, unsigned channel)
-    : _sensor(&ir), _owns_sensor(false)
-{
-    if ((channel >= 1) && (channel <=4))
-        _channel = channel-1;
+ReplaySystem::~ReplaySystem() = default;
 
-    if (_sensor->connected())
-        _sensor->set_mode(infrared_sensor::mode_ir_remote);
+std::unique_ptr<file_ostream> ReplaySystem::OpenForWrite(const std::string &path) const {
+    auto found = _rec->paths.find(path);
+    return std::make_unique<ostream>(*_rec, found != _rec->paths.end() ? &found->second : nullptr, path);
 }
 
-//-----------------------------------------------------------------------------
-remote_control::~remote_control() {
-    if (_owns_sensor)
-        delete _sensor;
+std::unique_ptr<file_istream> ReplaySystem::OpenForRead(const std::string &path) const {
+    auto found = _rec->paths.find(path);
+    return std::make_unique<istream>(*_rec, found != _rec->paths.end() ? &found->second : nullptr);
 }
 
-//-----------------------------------------------------------------------------
-bool remote_control::process() {
-    int value = _sensor->value(_channel);
-    if (value != _value) {
-        on_value_changed(value);
-        _value = value;
-        return true;
+void ReplaySystem::System(const char *command) const {
+    std::lock_guard<std::mutex> lock(_rec->mutex);
+    ++_rec->result.system_calls;
+    if (_rec->system_calls.empty()) {
+        _rec->mismatch(std::string("unexpected System('") + command + "')");
+        return;
     }
 
-    return false;
+    if (_rec->system_calls.front() != command)
+        _rec->mismatch(std::string("System('") + command + "'), recorded '" + _rec->system_calls.front() + "'");
+    _rec->system_calls.pop_front();
 }
 
-//-----------------------------------------------------------------------------
-void remote_control::on_value_changed(int value) {
-    int new_state = 0;
+void ReplaySystem::ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const {
+    std::vector<std::string> names;
+    {
+        // Every recorded listing is served once, the last one from then on.
+        std::lock_guard<std::mutex> lock(_rec->mutex);
+        auto found = _rec->listings.find(dir);
+        if (found == _rec->listings.end() || found->second.empty())
+            return;
+
+        names = found->second.front();
+        if (found->second.size() > 1)
+            found->second.pop_front();
+    }
 
-    switch (value) {
-        case 1:
-            new_state = red_up;
-            break;
-        case 2:
-            new_state = red_down;
-            break;
-        case 3:
-            new_state = blue_up;
-            break;
-        case  4:
-            new_state = blue_down;
-            break;
-        case 5:
-            new_state = red_up | blue_up;
+    for (auto &name : names) {
+        if (!fileFound(name))
             break;
-        case 6:
-            new_state = red_up | blue_down;
+    }
+}
+
+const std::string &ReplaySystem::get_sys_root() const {
+    return _rec->sys_root;
+}
+
+ReplaySystem::report ReplaySystem::result() const {
+    std::lock_guard<std::mutex> lock(_rec->mutex);
+    return _rec->result;
+}
+
+std::uint64_t ReplaySystem::unreplayed() const {
+    std::lock_guard<std::mutex> lock(_rec->mutex);
+    std::uint64_t n = _rec->system_calls.size();
+    for (auto &p : _rec->paths)
+        n += p.second.writes.size();
+    return n;
+}
+
+std::chrono::nanoseconds ReplaySystem::recorded_duration() const {
+    return _rec->duration;
+}
+
+//-----------------------------------------------------------------------------
+// device::stream_table
+//-----------------------------------------------------------------------------
+device::stream_table& device::stream_table::operator=(const stream_table &) noexcept {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _entries.clear();
+    return *this;
+}
+
+// Must be called with _mutex held.
+device::stream_table::entry& device::stream_table::find(const device &d, const std::string &name) const {
+    if (_generation != d.generation()) {
+        _entries.clear();
+        _generation = d.generation();
+    }
+
+    ++_tick;
+
+    auto it = _entries.find(name);
+    if (it != _entries.end()) {
+        ++_stats.hits;
+        it->second.last_use = _tick;
+        return it->second;
+    }
+
+    ++_stats.misses;
+    if (_entries.size() >= FSTREAM_CACHE_SIZE) {
+        _entries.erase(std::min_element(_entries.begin(), _entries.end(),
+                [](const auto &a, const auto &b) { return a.second.last_use < b.second.last_use; }));
+        ++_stats.evictions;
+    }
+
+    auto &e = _entries[name];
+    e.path = d._path + name;
+    e.last_use = _tick;
+    return e;
+}
+
+// The lock is held until f returns, a stream is never touched outside of it.
+template <typename F>
+auto device::stream_table::with_input(const device &d, const std::string &name, F &&f) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &e = find(d, name);
+    if (!e.in)
+        e.in = d._system.OpenForRead(e.path);
+    return f(*e.in, e.path);
+}
+
+template <typename F>
+auto device::stream_table::with_output(const device &d, const std::string &name, F &&f) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    auto &e = find(d, name);
+    if (!e.out)
+        e.out = d._system.OpenForWrite(e.path);
+    return f(*e.out, e.path);
+}
+
+device::stream_cache_stats device::stream_table::stats() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    return _stats;
+}
+
+//-----------------------------------------------------------------------------
+bin_format parse_bin_format(std::string_view name) noexcept {
+    static constexpr std::pair<std::string_view, bin_format> formats[] = {
+        {"u8",     bin_format::u8},
+        {"s8",     bin_format::s8},
+        {"u16",    bin_format::u16},
+        {"s16",    bin_format::s16},
+        {"s16_be", bin_format::s16_be},
+        {"s32",    bin_format::s32},
+        {"float",  bin_format::float32}
+    };
+
+    for (auto &f : formats) {
+        if (f.first == name)
+            return f.second;
+    }
+    return bin_format::unknown;
+}
+
+std::size_t bin_format_size(bin_format format) noexcept {
+    switch (format) {
+        case bin_format::u8:
+        case bin_format::s8:
+            return 1;
+        case bin_format::u16:
+        case bin_format::s16:
+        case bin_format::s16_be:
+            return 2;
+        case bin_format::s32:
+        case bin_format::float32:
+            return 4;
+        case bin_format::unknown:
             break;
-        case 7:
-            new_state = red_down |  blue_up;
+    }
+    return 0;
+}
+
+template <typename T>
+gsl::span<T> decode_bin_data(bin_format format, gsl::span<const char> raw, gsl::span<T> out) noexcept {
+    const std::size_t n = bin_data_count(format, raw, out);
+    const char *src = raw.data();
+    T *dst = out.data();
+
+    switch (format) {
+        case bin_format::u8:      convert_bin_data<uint8_t>(src, dst, n); break;
+        case bin_format::s8:      convert_bin_data<int8_t>(src, dst, n); break;
+        case bin_format::u16:     convert_bin_data<uint16_t>(src, dst, n); break;
+        case bin_format::s16:     convert_bin_data<int16_t>(src, dst, n); break;
+        case bin_format::s32:     convert_bin_data<int32_t>(src, dst, n); break;
+        case bin_format::float32: convert_bin_data<float>(src, dst, n); break;
+        case bin_format::s16_be:
+            for (std::size_t i = 0; i != n; ++i)
+                dst[i] = static_cast<T>(load_s16_be(src + 2 * i));
             break;
-        case 8:
-            new_state = red_down | blue_down;
+        case bin_format::unknown:
             break;
-        case 9:
-            new_state = beacon;
+    }
+
+    return out.first(n);
+}
+
+gsl::span<float> decode_bin_data(bin_format format, gsl::span<const char> raw, gsl::span<float> out,
+        float scale) noexcept
+{
+    const std::size_t n = bin_data_count(format, raw, out);
+    const char *src = raw.data();
+    float *dst = out.data();
+
+    switch (format) {
+        case bin_format::u8:      convert_bin_data<uint8_t>(src, dst, n, scale); break;
+        case bin_format::s8:      convert_bin_data<int8_t>(src, dst, n, scale); break;
+        case bin_format::u16:     convert_bin_data<uint16_t>(src, dst, n, scale); break;
+        case bin_format::s16:     convert_bin_data<int16_t>(src, dst, n, scale); break;
+        case bin_format::s32:     convert_bin_data<int32_t>(src, dst, n, scale); break;
+        case bin_format::float32: convert_bin_data<float>(src, dst, n, scale); break;
+        case bin_format::s16_be:
+            for (std::size_t i = 0; i != n; ++i)
+                dst[i] = static_cast<float>(load_s16_be(src + 2 * i)) * scale;
             break;
-        case 10:
-            new_state = red_up | red_down;
+        case bin_format::unknown:
             break;
-        case 11:
-            new_state = blue_up | blue_down;
+    }
+
+    return out.first(n);
+}
+
+template gsl::span<int8_t>   decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int8_t>) noexcept;
+template gsl::span<uint8_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<uint8_t>) noexcept;
+template gsl::span<int16_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int16_t>) noexcept;
+template gsl::span<uint16_t> decode_bin_data(bin_format, gsl::span<const char>, gsl::span<uint16_t>) noexcept;
+template gsl::span<int32_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int32_t>) noexcept;
+template gsl::span<float>    decode_bin_data(bin_format, gsl::span<const char>, gsl::span<float>) noexcept;
+template gsl::span<double>   decode_bin_data(bin_format, gsl::span<const char>, gsl::span<double>) noexcept;
+
+//-----------------------------------------------------------------------------
+bool device::connect(
+        const std::string &dir,
+        const std::string &pattern,
+        const std::map<std::string, std::set<std::string>> &match
+        ) noexcept
+{
+    using namespace std;
+
+    // Whether the device is still there. Without a device_watcher nothing
+    // else notices an unplug, so read the cached attribute back once.
+    auto still_there = [&](const device_registry::entry &candidate) {
+        const char *name = !candidate.address.empty() ? "address"
+                         : !candidate.driver_name.empty() ? "driver_name" : nullptr;
+        if (!name)
+            return true;
+
+        const string path = candidate.path + name;
+        auto is = _system.OpenForRead(path);
+        auto value = try_read_string_attr(*is, path);
+        return value && value.value() == (candidate.address.empty() ? candidate.driver_name : candidate.address);
+    };
+
+    // Tries the devices the registry knows about. Address and driver name
+    // were matched by the registry already, anything else is read here.
+    auto try_candidates = [&](const vector<device_registry::entry> &candidates) {
+        for (auto &candidate : candidates) {
+            if (!still_there(candidate)) {
+                _system.registry().device_removed(dir, candidate.name);
+                continue;
+            }
+
+            // Fold in the hotplug events seen so far, generation() must
+            // never go back to a value handles may have seen.
+            _generation = generation() + 1;
+            _path = candidate.path;
+            _hotplug = candidate.epoch;
+            _hotplug_base = _hotplug ? _hotplug->load(std::memory_order_acquire) : 0;
+
+            bool bMatch = true;
+            for (auto &m : match) {
+                const auto &name    = m.first;
+                const auto &matches = m.second;
+                if (name == "address" || name == "driver_name")
+                    continue;
+
+                if (!matches.empty() && !matches.begin()->empty()) {
+                    auto value = try_get_attr_string(name);
+                    if (!value || matches.find(value.value()) == matches.end()) {
+                        bMatch = false;
+                        break;
+                    }
+                }
+            }
+
+            if (bMatch) {
+                // The registry read these already.
+                lock_guard<mutex> lock(_constants.mutex);
+                _constants.sync(generation());
+                if (!candidate.address.empty())
+                    _constants.strings.emplace("address", candidate.address);
+                if (!candidate.driver_name.empty())
+                    _constants.strings.emplace("driver_name", candidate.driver_name);
+                return true;
+            }
+
+            _path.clear();
+        }
+        return false;
+    };
+
+    try {
+        auto &registry = _system.registry();
+        if (try_candidates(registry.find(dir, pattern, match)))
+            return true;
+
+        // Maybe the device was plugged in after the last scan.
+        if (registry.refresh(dir) && try_candidates(registry.find(dir, pattern, match)))
+            return true;
+    } catch (...) { }
+
+    _path.clear();
+    _hotplug.reset();
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+int device::device_index() const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    // The trailing digits of the path, cheap enough to not need a cache.
+    int index = 0;
+    int f = 1;
+    for (auto it=_path.rbegin(); it!=_path.rend(); ++it) {
+        if(*it =='/')
+            continue;
+        if ((*it < '0') || (*it > '9'))
             break;
+
+        index += (*it -'0') * f;
+        f *= 10;
     }
 
-    if (((new_state & red_up) != (_state & red_up)) &&
-            static_cast<bool>(on_red_up))
-        on_red_up(new_state & red_up);
+    return index;
+}
 
-    if (((new_state & red_down) != (_state & red_down)) &&
-            static_cast<bool>(on_red_down))
-        on_red_down(new_state & red_down);
+//-----------------------------------------------------------------------------
+device::constant_cache::constant_cache(const constant_cache &other) {
+    std::lock_guard<std::mutex> lock(other.mutex);
+    generation = other.generation;
+    ints = other.ints;
+    strings = other.strings;
+    sets = other.sets;
+}
 
-    if (((new_state & blue_up) != (_state & blue_up)) &&
-            static_cast<bool>(on_blue_up))
-        on_blue_up(new_state & blue_up);
+//-----------------------------------------------------------------------------
+device::shadow_cache::shadow_cache(const shadow_cache &other) {
+    std::lock_guard<std::mutex> lock(other.mutex);
+    enabled = other.enabled.load();
+    generation = other.generation;
+    values = other.values;
+}
 
-    if (((new_state & blue_down) != (_state & blue_down)) &&
-            static_cast<bool>(on_blue_down))
-        on_blue_down(new_state & blue_down);
+template <typename F>
+std::error_code device::write_through(std::string_view name, std::string_view text, F &&write) {
+    using namespace std;
 
-    if (((new_state & beacon) != (_state & beacon)) &&
-            static_cast<bool>(on_beacon))
-        on_beacon(new_state & beacon);
+    // Writing these has an effect even if the value is unchanged.
+    const bool volatile_attr = name == "command" || name == "position" || name == "set_device";
 
-    if ((new_state != _state) &&
-            static_cast<bool>(on_state_change))
-        on_state_change(new_state);
+    if (!_shadow.enabled.load(memory_order_relaxed))
+        return write();
 
-    _state = new_state;
+    {
+        lock_guard<mutex> lock(_shadow.mutex);
+        if (_shadow.generation != generation()) {
+            _shadow.values.clear();
+            _shadow.generation = generation();
+        }
+
+        if (!volatile_attr) {
+            auto found = _shadow.values.find(name);
+            if (found != _shadow.values.end() && found->second == text) {
+                ++_shadow.elided;
+                return {};
+            }
+        }
+    }
+
+    const error_code ec = write();
+
+    lock_guard<mutex> lock(_shadow.mutex);
+    auto found = _shadow.values.find(name);
+    if (ec) {
+        // The attribute may or may not hold the new value now.
+        if (found != _shadow.values.end())
+            _shadow.values.erase(found);
+        return ec;
+    }
+
+    if (volatile_attr) {
+        // A reset puts every attribute back to its default.
+        if (name == "command" && text == "reset")
+            _shadow.values.clear();
+        return {};
+    }
+
+    if (found == _shadow.values.end())
+        _shadow.values.emplace(name, text);
+    else
+        found->second.assign(text);
+    return {};
+}
+
+void device::set_shadow_writes(bool on) {
+    std::lock_guard<std::mutex> lock(_shadow.mutex);
+    _shadow.enabled.store(on);
+    _shadow.values.clear();
+}
+
+bool device::shadow_writes() const {
+    return _shadow.enabled.load();
+}
+
+void device::forget_writes() {
+    std::lock_guard<std::mutex> lock(_shadow.mutex);
+    _shadow.values.clear();
+}
+
+std::uint64_t device::elided_writes() const {
+    std::lock_guard<std::mutex> lock(_shadow.mutex);
+    return _shadow.elided;
 }
 
 //-----------------------------------------------------------------------------
-lego_port::lego_port(address_type address, const ISystem& system) : device{system} {
-    connect({{ "address", { address } }});
+outcome::result<int> device::try_get_attr_int(const std::string &name) const {
+    if (_path.empty())
+        return std::make_error_code(std::errc::function_not_supported);
+
+    return _streams.with_input(*this, name, [](file_istream &is, const std::string &path) {
+        return try_read_int_attr(is, path);
+    });
+}
+
+int device::get_attr_int(const std::string &name) const {
+    return value_or_throw(try_get_attr_int(name), _path, name);
 }
 
 //-----------------------------------------------------------------------------
-bool lego_port::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
+outcome::result<void> device::try_set_attr_int(const std::string &name, int value) {
+    using namespace std;
+
+    if (_path.empty())
+        return make_error_code(errc::function_not_supported);
+
+    char buf[16];
+    const auto r = to_chars(buf, buf + sizeof(buf), value);
+    const error_code ec = write_through(name, string_view(buf, static_cast<size_t>(r.ptr - buf)), [&] {
+        return _streams.with_output(*this, name, [value](file_ostream &os, const string &path) {
+            return write_attr(os, path, value);
+        });
+    });
+    if (ec)
+        return ec;
+    return outcome::success();
+}
+
+void device::set_attr_int(const std::string &name, int value) {
+    value_or_throw(try_set_attr_int(name, value), _path, name);
+}
+
+//-----------------------------------------------------------------------------
+outcome::result<std::string> device::try_get_attr_string(const std::string &name) const {
+    if (_path.empty())
+        return std::make_error_code(std::errc::function_not_supported);
+
+    return _streams.with_input(*this, name, [](file_istream &is, const std::string &path) {
+        return try_read_string_attr(is, path);
+    });
+}
+
+std::string device::get_attr_string(const std::string &name) const {
+    return value_or_throw(try_get_attr_string(name), _path, name);
+}
+
+//-----------------------------------------------------------------------------
+outcome::result<void> device::try_set_attr_string(const std::string &name, const std::string &value) {
+    using namespace std;
+
+    if (_path.empty())
+        return make_error_code(errc::function_not_supported);
+
+    const error_code ec = write_through(name, value, [&] {
+        return _streams.with_output(*this, name, [&value](file_ostream &os, const string &path) {
+            return write_attr(os, path, string_view{value});
+        });
+    });
+    if (ec)
+        return ec;
+    return outcome::success();
+}
+
+void device::set_attr_string(const std::string &name, const std::string &value) {
+    value_or_throw(try_set_attr_string(name, value), _path, name);
+}
+
+//-----------------------------------------------------------------------------
+outcome::result<std::string> device::try_get_attr_line(const std::string &name) const {
+    if (_path.empty())
+        return std::make_error_code(std::errc::function_not_supported);
+
+    return _streams.with_input(*this, name, [](file_istream &is, const std::string &path) {
+        return try_read_line_attr(is, path);
+    });
+}
+
+std::string device::get_attr_line(const std::string &name) const {
+    return value_or_throw(try_get_attr_line(name), _path, name);
+}
+
+//-----------------------------------------------------------------------------
+device::stream_cache_stats device::cache_stats() const {
+    return _streams.stats();
+}
+
+//-----------------------------------------------------------------------------
+bool device::watch(const std::string &name, const std::function<bool(const std::string&)> &pred,
+        std::chrono::milliseconds timeout) const
 {
-    std::string _strClassDir { _system.get_sys_root() + "/lego-port/" };
-    static const std::string _strPattern  { "port" };
+    using namespace std;
+    using namespace std::chrono;
 
-    try {
-        return device::connect(_strClassDir, _strPattern, match);
-    } catch (...) { }
+    constexpr milliseconds min_interval{1};
+    constexpr milliseconds max_interval{10};
 
-    _path.clear();
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
 
-    return false;
+    // A file of its own: the stream table must not stay locked while blocked.
+    const string path = _path + name;
+    auto is = _system.OpenForPoll(path);
+
+    const bool forever = timeout.count() < 0;
+    const auto deadline = steady_clock::now() + (forever ? milliseconds{0} : timeout);
+    auto interval = min_interval;
+    string last;
+
+    for (;;) {
+        // Reading from the start also re-arms the POLLPRI notification.
+        string value = read_line_attr(*is, path);
+        if (pred(value))
+            return true;
+
+        if (value != last) {
+            interval = min_interval;
+            last = std::move(value);
+        }
+
+        auto wait = interval;
+        if (!forever) {
+            const auto now = steady_clock::now();
+            if (now >= deadline)
+                return false;
+            wait = min(wait, duration_cast<milliseconds>(deadline - now) + milliseconds{1});
+        }
+
+        const int fd = is->native_handle();
+        if (fd >= 0) {
+            pollfd p{fd, POLLPRI, 0};
+            if (poll(&p, 1, static_cast<int>(wait.count())) > 0 && (p.revents & (POLLPRI | POLLERR)))
+                continue;
+        } else {
+            this_thread::sleep_for(wait);
+        }
+
+        interval = min(interval * 2, max_interval);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void device::constant_cache::sync(unsigned current) {
+    if (generation != current) {
+        ints.clear();
+        strings.clear();
+        sets.clear();
+        generation = current;
+    }
+}
+
+int device::get_attr_const_int(const char *name) const {
+    std::lock_guard<std::mutex> lock(_constants.mutex);
+    _constants.sync(generation());
+    auto found = _constants.ints.find(name);
+    if (found == _constants.ints.end())
+        found = _constants.ints.emplace(name, get_attr_int(name)).first;
+    return found->second;
+}
+
+std::string device::get_attr_const_string(const char *name) const {
+    std::lock_guard<std::mutex> lock(_constants.mutex);
+    _constants.sync(generation());
+    auto found = _constants.strings.find(name);
+    if (found == _constants.strings.end())
+        found = _constants.strings.emplace(name, get_attr_string(name)).first;
+    return found->second;
+}
+
+mode_set device::get_attr_const_set(const char *name) const {
+    std::lock_guard<std::mutex> lock(_constants.mutex);
+    _constants.sync(generation());
+    auto found = _constants.sets.find(name);
+    if (found == _constants.sets.end())
+        found = _constants.sets.emplace(name, get_attr_set(name)).first;
+    return found->second;
+}
+
+//-----------------------------------------------------------------------------
+mode_set device::get_attr_set(
+        const std::string &name, std::string *pCur) const
+{
+    return parse_mode_set(get_attr_line(name), pCur);
+}
+
+//-----------------------------------------------------------------------------
+std::string device::get_attr_from_set(const std::string &name) const {
+    using namespace std;
+
+    string s = get_attr_line(name);
+
+    size_t pos, last_pos = 0;
+    string t;
+    do {
+        pos = s.find(' ', last_pos);
+
+        if (pos != string::npos) {
+            t = s.substr(last_pos, pos-last_pos);
+            last_pos = pos+1;
+        } else {
+            t = s.substr(last_pos);
+        }
+
+        if (!t.empty()) {
+            if (*t.begin()=='[') {
+                return t.substr(1, t.length()-2);
+            }
+        }
+    } while (pos!=string::npos);
+
+    return { "none" };
+}
+
+//-----------------------------------------------------------------------------
+// device::attribute
+//-----------------------------------------------------------------------------
+// The handle's lock is held while calling these.
+template <typename T>
+std::error_code device::attribute<T>::bind(const device &d) const {
+    if (d._path.empty())
+        return std::make_error_code(std::errc::function_not_supported);
+
+    if (_generation != d.generation()) {
+        _in.reset();
+        _out.reset();
+        _path = d._path + _name;
+        _generation = d.generation();
+    }
+    return {};
+}
+
+template <typename T>
+file_istream& device::attribute<T>::input(const device &d) const {
+    if (!_in)
+        _in = d._system.OpenForRead(_path);
+    return *_in;
+}
+
+template <typename T>
+file_ostream& device::attribute<T>::output(const device &d) const {
+    if (!_out)
+        _out = d._system.OpenForWrite(_path);
+    return *_out;
+}
+
+template <typename T>
+outcome::result<T> device::attribute<T>::try_get(const device &d) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto ec = bind(d))
+        return ec;
+
+    auto &is = input(d);
+    if constexpr (std::is_same_v<T, int>) {
+        return try_read_int_attr(is, _path);
+    } else if constexpr (std::is_same_v<T, std::string>) {
+        return try_read_string_attr(is, _path);
+    } else {
+        auto line = try_read_line_attr(is, _path);
+        if (!line)
+            return line.error();
+        return parse_mode_set(line.value(), nullptr);
+    }
+}
+
+template <typename T>
+outcome::result<void> device::attribute<T>::try_set(device &d, value_arg value) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto ec = bind(d))
+        return ec;
+
+    auto write = [&] { return write_attr(output(d), _path, value); };
+
+    std::error_code ec;
+    if constexpr (std::is_same_v<T, int>) {
+        char buf[16];
+        const auto r = std::to_chars(buf, buf + sizeof(buf), value);
+        ec = d.write_through(_name, std::string_view(buf, static_cast<std::size_t>(r.ptr - buf)), write);
+    } else {
+        ec = d.write_through(_name, value, write);
+    }
+    if (ec)
+        return ec;
+    return outcome::success();
+}
+
+template <typename T>
+outcome::result<std::size_t> device::attribute<T>::try_read(const device &d, char *buf, std::size_t size) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    if (const auto ec = bind(d))
+        return ec;
+
+    return try_read_raw_attr(input(d), _path, buf, size);
+}
+
+template <typename T>
+T device::attribute<T>::get(const device &d) const {
+    return value_or_throw(try_get(d), d._path, _name);
+}
+
+template <typename T>
+void device::attribute<T>::set(device &d, value_arg value) {
+    value_or_throw(try_set(d, value), d._path, _name);
+}
+
+template <typename T>
+std::size_t device::attribute<T>::read(const device &d, char *buf, std::size_t size) const {
+    return value_or_throw(try_read(d, buf, size), d._path, _name);
+}
+
+template <typename T>
+void device::attribute<T>::close() const noexcept {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _in.reset();
+    _out.reset();
+}
+
+template class device::attribute<int>;
+template class device::attribute<std::string>;
+template class device::attribute<mode_set>;
+
+//-----------------------------------------------------------------------------
+constexpr char sensor::ev3_touch[];
+constexpr char sensor::ev3_color[];
+constexpr char sensor::ev3_ultrasonic[];
+constexpr char sensor::ev3_gyro[];
+constexpr char sensor::ev3_infrared[];
+constexpr char sensor::nxt_touch[];
+constexpr char sensor::nxt_light[];
+constexpr char sensor::nxt_sound[];
+constexpr char sensor::nxt_ultrasonic[];
+constexpr char sensor::nxt_i2c_sensor[];
+constexpr char sensor::nxt_analog[];
+
+//-----------------------------------------------------------------------------
+sensor::sensor(address_type address, const ISystem& system) : device{system} {
+    connect({{ "address", { address }}});
+}
+
+//-----------------------------------------------------------------------------
+sensor::sensor(address_type address, const std::set<sensor_type> &types, const ISystem& system) : device{system} {
+    connect({{ "address", { address }}, { "driver_name", types }});
+}
+
+//-----------------------------------------------------------------------------
+bool sensor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
+{
+    std::string _strClassDir { _system.get_sys_root() + "/lego-sensor/" };
+    static const std::string _strPattern  { "sensor" };
+
+    try {
+        if (device::connect(_strClassDir, _strPattern, match)) {
+            return true;
+        }
+    } catch (...) { }
+
+    _path.clear();
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+std::string sensor::type_name() const {
+    auto type = driver_name();
+    if (type.empty()) {
+        static const std::string s("<none>");
+        return s;
+    }
+
+    static const std::map<sensor_type, const std::string> lookup_table {
+        { ev3_touch,       "EV3 touch" },
+        { ev3_color,       "EV3 color" },
+        { ev3_ultrasonic,  "EV3 ultrasonic" },
+        { ev3_gyro,        "EV3 gyro" },
+        { ev3_infrared,    "EV3 infrared" },
+        { nxt_touch,       "NXT touch" },
+        { nxt_light,       "NXT light" },
+        { nxt_sound,       "NXT sound" },
+        { nxt_ultrasonic,  "NXT ultrasonic" },
+        { nxt_i2c_sensor,  "I2C sensor" }
+        };
+
+    auto s = lookup_table.find(type);
+    if (s != lookup_table.end())
+        return s->second;
+
+    return type;
+}
+
+//-----------------------------------------------------------------------------
+std::string sensor::mode() const {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    try {
+        auto m = _attr.mode.get(*this);
+        if (_mode_generation != generation() || m != _mode)
+            _mode_info_valid = false;
+
+        _mode = std::move(m);
+        _mode_generation = generation();
+        return _mode;
+    } catch (...) {
+        forget_mode();
+        throw;
+    }
+}
+
+//-----------------------------------------------------------------------------
+sensor& sensor::set_mode(std::string v) {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    if (_mode_generation == generation() && !_mode.empty() && _mode == v)
+        return *this;
+
+    forget_mode();
+    _attr.mode.set(*this, v);
+
+    _mode = std::move(v);
+    _mode_generation = generation();
+    return *this;
+}
+
+//-----------------------------------------------------------------------------
+outcome::result<int> sensor::try_value(unsigned index) const {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    auto info = try_mode_info();
+    if (!info)
+        return info.error();
+
+    if (index >= std::size(_attr.value) || static_cast<int>(index) >= info.value()->num_values)
+        return std::make_error_code(std::errc::invalid_argument);
+
+    auto r = _attr.value[index].try_get(*this);
+    if (!r) {
+        // The sensor may have been unplugged or reset, make the next
+        // set_mode() write again.
+        forget_mode();
+    }
+    return r;
+}
+
+int sensor::value(unsigned index) const {
+    auto r = try_value(index);
+    if (!r && r.error() == std::errc::invalid_argument)
+        throw std::invalid_argument("index");
+    return value_or_throw(std::move(r), _path);
+}
+
+//-----------------------------------------------------------------------------
+float sensor::float_value(unsigned index) const {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    const int raw = value(index);
+    return raw * mode_info().scale;
+}
+
+//-----------------------------------------------------------------------------
+int sensor::value_snapshot::at(unsigned index) const {
+    if (index >= count)
+        throw std::invalid_argument("index");
+    return value[index];
+}
+
+//-----------------------------------------------------------------------------
+sensor::value_snapshot sensor::values() const {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    value_snapshot result;
+
+    try {
+        const auto &info = mode_info();
+        result.count = static_cast<unsigned>(std::clamp(info.num_values, 0, static_cast<int>(max_values)));
+
+        // Floats do not map onto the integer value<N> attributes.
+        const std::size_t value_size = bin_format_size(info.format);
+        if (value_size != 0 && info.format != bin_format::float32 && result.count != 0) {
+            char buf[max_values * 4];
+            const std::size_t wanted = result.count * value_size;
+            if (_attr.bin_data.read(*this, buf, wanted) >= wanted) {
+                decode_bin_data<int>(info.format, {buf, wanted}, result.value);
+                return result;
+            }
+        }
+
+        for (unsigned i = 0; i != result.count; ++i)
+            result.value[i] = _attr.value[i].get(*this);
+    } catch (...) {
+        forget_mode();
+        throw;
+    }
+
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+outcome::result<const sensor::mode_metadata*> sensor::try_mode_info() const {
+    std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+    if (_mode_info_valid && _mode_info_generation == generation())
+        return &_mode_info;
+
+    static constexpr float scale_table[] = {
+        1e-0f, 1e-1f, 1e-2f, 1e-3f, 1e-4f, 1e-5f, 1e-6f, 1e-7f, 1e-8f, 1e-9f
+    };
+
+    auto num_values      = _attr.num_values.try_get(*this);
+    auto decimals        = _attr.decimals.try_get(*this);
+    auto bin_data_format = _attr.bin_data_format.try_get(*this);
+    auto units           = _attr.units.try_get(*this);
+    if (!num_values || !decimals || !bin_data_format || !units) {
+        forget_mode();
+        return !num_values ? num_values.error() : !decimals ? decimals.error()
+             : !bin_data_format ? bin_data_format.error() : units.error();
+    }
+
+    mode_metadata info;
+    info.num_values      = num_values.value();
+    info.decimals        = decimals.value();
+    info.bin_data_format = std::move(bin_data_format).value();
+    info.format          = parse_bin_format(info.bin_data_format);
+    info.units           = std::move(units).value();
+
+    if (info.decimals >= 0 && info.decimals < static_cast<int>(std::size(scale_table)))
+        info.scale = scale_table[info.decimals];
+    else
+        info.scale = powf(10, static_cast<float>(-info.decimals));
+
+    _mode_info = std::move(info);
+
+    // The size of bin_data depends on the mode, too.
+    _bin_data.clear();
+    _mode_info_generation = generation();
+    _mode_info_valid = true;
+    return &_mode_info;
+}
+
+const sensor::mode_metadata& sensor::mode_info() const {
+    return *value_or_throw(try_mode_info(), _path);
+}
+
+//-----------------------------------------------------------------------------
+const std::vector<char>& sensor::bin_data() const {
+    using namespace std;
+
+    if (_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    lock_guard<recursive_mutex> lock(_mode_mutex);
+    const auto &info = mode_info();
+    if (_bin_data.empty()) {
+        const std::size_t value_size = std::max<std::size_t>(bin_format_size(info.format), 1);
+        _bin_data.resize(static_cast<std::size_t>(std::max(info.num_values, 0)) * value_size);
+    }
+
+    try {
+        _attr.bin_data.read(*this, _bin_data.data(), _bin_data.size());
+    } catch (...) {
+        forget_mode();
+        throw;
+    }
+    return _bin_data;
+}
+
+//-----------------------------------------------------------------------------
+template <typename T>
+gsl::span<T> sensor::bin_values(gsl::span<T> out) const {
+    using namespace std;
+
+    lock_guard<recursive_mutex> lock(_mode_mutex);
+    try {
+        const auto &info = mode_info();
+        const size_t value_size = bin_format_size(info.format);
+        if (value_size == 0)
+            throw system_error(make_error_code(errc::not_supported), "bin_data_format " + info.bin_data_format);
+
+        const size_t count = min(static_cast<size_t>(max(info.num_values, 0)), out.size());
+
+        // Same type as the data: read straight into the caller's buffer.
+        if (info.format == native_bin_format<T>()) {
+            const size_t n = _attr.bin_data.read(*this, reinterpret_cast<char*>(out.data()), count * value_size);
+            return out.first(n / value_size);
+        }
+
+        char buf[max_values * 4];
+        const size_t n = _attr.bin_data.read(*this, buf, min(count * value_size, sizeof(buf)));
+        return decode_bin_data<T>(info.format, {buf, n}, out.first(count));
+    } catch (...) {
+        forget_mode();
+        throw;
+    }
+}
+
+template gsl::span<int8_t>   sensor::bin_values(gsl::span<int8_t>) const;
+template gsl::span<uint8_t>  sensor::bin_values(gsl::span<uint8_t>) const;
+template gsl::span<int16_t>  sensor::bin_values(gsl::span<int16_t>) const;
+template gsl::span<uint16_t> sensor::bin_values(gsl::span<uint16_t>) const;
+template gsl::span<int32_t>  sensor::bin_values(gsl::span<int32_t>) const;
+template gsl::span<float>    sensor::bin_values(gsl::span<float>) const;
+template gsl::span<double>   sensor::bin_values(gsl::span<double>) const;
+
+//-----------------------------------------------------------------------------
+i2c_sensor::i2c_sensor(address_type address, const std::set<sensor_type> &types, const ISystem& system)
+    : sensor(address, types, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char touch_sensor::mode_touch[];
+
+touch_sensor::touch_sensor(address_type address, const ISystem& system)
+    : sensor(address, { ev3_touch, nxt_touch }, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char color_sensor::mode_col_reflect[];
+constexpr char color_sensor::mode_col_ambient[];
+constexpr char color_sensor::mode_col_color[];
+constexpr char color_sensor::mode_ref_raw[];
+constexpr char color_sensor::mode_rgb_raw[];
+constexpr char color_sensor::color_nocolor[];
+constexpr char color_sensor::color_black[];
+constexpr char color_sensor::color_blue[];
+constexpr char color_sensor::color_green[];
+constexpr char color_sensor::color_yellow[];
+constexpr char color_sensor::color_red[];
+constexpr char color_sensor::color_white[];
+constexpr char color_sensor::color_brown[];
+
+color_sensor::color_sensor(address_type address, const ISystem& system)
+    : sensor(address, { ev3_color }, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char ultrasonic_sensor::mode_us_dist_cm[];
+constexpr char ultrasonic_sensor::mode_us_dist_in[];
+constexpr char ultrasonic_sensor::mode_us_listen[];
+constexpr char ultrasonic_sensor::mode_us_si_cm[];
+constexpr char ultrasonic_sensor::mode_us_si_in[];
+
+ultrasonic_sensor::ultrasonic_sensor(address_type address, const ISystem& system)
+    : sensor(address, { ev3_ultrasonic, nxt_ultrasonic }, system)
+{ }
+
+ultrasonic_sensor::ultrasonic_sensor(address_type address, const std::set<sensor_type>& sensorTypes, const ISystem& system)
+    : sensor(address, sensorTypes, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char gyro_sensor::mode_gyro_ang[];
+constexpr char gyro_sensor::mode_gyro_rate[];
+constexpr char gyro_sensor::mode_gyro_fas[];
+constexpr char gyro_sensor::mode_gyro_g_a[];
+constexpr char gyro_sensor::mode_gyro_cal[];
+
+gyro_sensor::gyro_sensor(address_type address, const ISystem& system)
+    : sensor(address, { ev3_gyro }, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char infrared_sensor::mode_ir_prox[];
+constexpr char infrared_sensor::mode_ir_seek[];
+constexpr char infrared_sensor::mode_ir_remote[];
+constexpr char infrared_sensor::mode_ir_rem_a[];
+constexpr char infrared_sensor::mode_ir_cal[];
+
+infrared_sensor::infrared_sensor(address_type address, const ISystem& system)
+    : sensor(address, { ev3_infrared }, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char sound_sensor::mode_db[];
+constexpr char sound_sensor::mode_dba[];
+
+sound_sensor::sound_sensor(address_type address, const ISystem& system)
+    : sensor(address, { nxt_sound, nxt_analog }, system)
+{
+    if (connected() && driver_name() == nxt_analog) {
+        lego_port port(address);
+
+        if (port.connected()) {
+            port.set_set_device(nxt_sound);
+
+            if (port.status() != nxt_sound) {
+                // Failed to load lego-nxt-sound friver. Wrong port?
+                _path.clear();
+            }
+        } else {
+            _path.clear();
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+constexpr char light_sensor::mode_reflect[];
+constexpr char light_sensor::mode_ambient[];
+
+light_sensor::light_sensor(address_type address, const ISystem& system)
+    : sensor(address, { nxt_light }, system)
+{ }
+
+//-----------------------------------------------------------------------------
+constexpr char motor::motor_large[];
+constexpr char motor::motor_medium[];
+constexpr char motor::motor_nxt[];
+constexpr char motor::command_run_forever[];
+constexpr char motor::command_run_to_abs_pos[];
+constexpr char motor::command_run_to_rel_pos[];
+constexpr char motor::command_run_timed[];
+constexpr char motor::command_run_direct[];
+constexpr char motor::command_stop[];
+constexpr char motor::command_reset[];
+constexpr char motor::encoder_polarity_normal[];
+constexpr char motor::encoder_polarity_inversed[];
+constexpr char motor::polarity_normal[];
+constexpr char motor::polarity_inversed[];
+constexpr char motor::state_running[];
+constexpr char motor::state_ramping[];
+constexpr char motor::state_holding[];
+constexpr char motor::state_overloaded[];
+constexpr char motor::state_stalled[];
+constexpr char motor::stop_action_coast[];
+constexpr char motor::stop_action_brake[];
+constexpr char motor::stop_action_hold[];
+
+//-----------------------------------------------------------------------------
+motor::motor(address_type address, const ISystem& system) : device{system} {
+    connect({{ "address", { address } }});
+}
+
+//-----------------------------------------------------------------------------
+motor::motor(address_type address, const motor_type &t, const ISystem& system) : device{system} {
+    connect({{ "address", { address } }, { "driver_name", { t }}});
+}
+
+//-----------------------------------------------------------------------------
+bool motor::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
+{
+    std::string _strClassDir { _system.get_sys_root() + "/tacho-motor/" };
+    static const std::string _strPattern  { "motor" };
+
+    try {
+        return device::connect(_strClassDir, _strPattern, match);
+    } catch (...) { }
+
+    _path.clear();
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+uint8_t motor::flags_from_state(std::string_view state) noexcept {
+    return parse_state_flags(state.data(), state.size());
+}
+
+uint8_t motor::state_flags() const {
+    char buf[64];
+    const auto n = _attr.state.read(*this, buf, sizeof(buf));
+    return parse_state_flags(buf, n);
+}
+
+outcome::result<uint8_t> motor::try_state_flags() const {
+    char buf[64];
+    const auto n = _attr.state.try_read(*this, buf, sizeof(buf));
+    if (!n)
+        return n.error();
+    return parse_state_flags(buf, n.value());
+}
+
+//-----------------------------------------------------------------------------
+bool motor::wait_until(const std::function<bool(const mode_set&)> &pred,
+        std::chrono::milliseconds timeout) const
+{
+    return watch("state", [&pred](const std::string &s) { return pred(parse_mode_set(s, nullptr)); }, timeout);
+}
+
+bool motor::wait_until(const std::string &flag, std::chrono::milliseconds timeout) const {
+    return wait_until([&flag](const mode_set &state) { return state.count(flag) != 0; }, timeout);
+}
+
+bool motor::wait_while(const std::string &flag, std::chrono::milliseconds timeout) const {
+    return wait_until([&flag](const mode_set &state) { return state.count(flag) == 0; }, timeout);
+}
+
+//-----------------------------------------------------------------------------
+medium_motor::medium_motor(address_type address, const ISystem& system)
+    : motor(address, motor_medium, system)
+{ }
+
+//-----------------------------------------------------------------------------
+large_motor::large_motor(address_type address, const ISystem& system)
+    : motor(address, motor_large, system)
+{ }
+
+//-----------------------------------------------------------------------------
+nxt_motor::nxt_motor(address_type address, const ISystem& system)
+    : motor(address, motor_nxt, system)
+{ }
+
+//-----------------------------------------------------------------------------
+motor::transaction& motor_group::add(motor &m) {
+    _members.push_back({&m, m.configure()});
+    return _members.back().setpoints;
+}
+
+std::chrono::nanoseconds motor_group::fire(void (motor::*command)()) {
+    using namespace std;
+    using namespace std::chrono;
+
+    for (auto &member : _members)
+        member.setpoints.apply();
+
+    vector<steady_clock::time_point> done(_members.size());
+
+    if (_dispatch == dispatch::parallel && _members.size() > 1) {
+        atomic<bool> go{false};
+        bool cancelled = true; // until every thread is running
+        vector<exception_ptr> errors(_members.size());
+        vector<thread> threads;
+
+        auto start = [&](size_t i) {
+            try {
+                (_members[i].m->*command)();
+            } catch (...) {
+                errors[i] = current_exception();
+            }
+            done[i] = steady_clock::now();
+        };
+
+        {
+            // Releases and joins the threads started so far, also when
+            // starting the next one throws. Then they fire nothing.
+            struct release_and_join {
+                atomic<bool> &go;
+                vector<thread> &threads;
+                ~release_and_join() {
+                    go.store(true, memory_order_release);
+                    for (auto &t : threads)
+                        t.join();
+                }
+            } guard{go, threads};
+
+            threads.reserve(_members.size() - 1);
+            for (size_t i = 1; i < _members.size(); ++i) {
+                threads.emplace_back([&, i] {
+                    while (!go.load(memory_order_acquire))
+                        this_thread::yield();
+                    if (!cancelled)
+                        start(i);
+                });
+            }
+
+            cancelled = false;
+            go.store(true, memory_order_release);
+            start(0);
+        }
+
+        for (auto &e : errors)
+            if (e)
+                rethrow_exception(e);
+    } else {
+        for (size_t i = 0; i < _members.size(); ++i) {
+            (_members[i].m->*command)();
+            done[i] = steady_clock::now();
+        }
+    }
+
+    nanoseconds skew{0};
+    if (!done.empty()) {
+        const auto [first, last] = minmax_element(done.begin(), done.end());
+        skew = duration_cast<nanoseconds>(*last - *first);
+    }
+
+    ++_stats.count;
+    _stats.last = skew;
+    _stats.max = max(_stats.max, skew);
+    _stats.total += skew;
+
+    return skew;
+}
+
+//-----------------------------------------------------------------------------
+dc_motor::dc_motor(address_type address, const ISystem& system) : device{system} {
+    std::string _strClassDir { _system.get_sys_root() + "/dc-motor/" };
+    static const std::string _strPattern  { "motor" };
+
+    connect(_strClassDir, _strPattern, {{ "address", { address }}});
+}
+
+constexpr char dc_motor::command_run_forever[];
+constexpr char dc_motor::command_run_timed[];
+constexpr char dc_motor::command_run_direct[];
+constexpr char dc_motor::command_stop[];
+constexpr char dc_motor::polarity_normal[];
+constexpr char dc_motor::polarity_inversed[];
+constexpr char dc_motor::stop_action_coast[];
+constexpr char dc_motor::stop_action_brake[];
+
+//-----------------------------------------------------------------------------
+std::chrono::nanoseconds motor::transaction::commit(std::string_view command) {
+    using namespace std::chrono;
+
+    const auto start = steady_clock::now();
+    auto &a = _motor._attr;
+
+    if (_polarity)      a.polarity.set(_motor, *_polarity);
+    if (_stop_action)   a.stop_action.set(_motor, *_stop_action);
+    if (_ramp_up_sp)    a.ramp_up_sp.set(_motor, *_ramp_up_sp);
+    if (_ramp_down_sp)  a.ramp_down_sp.set(_motor, *_ramp_down_sp);
+    if (_time_sp)       a.time_sp.set(_motor, *_time_sp);
+    if (_duty_cycle_sp) a.duty_cycle_sp.set(_motor, *_duty_cycle_sp);
+    if (_speed_sp)      a.speed_sp.set(_motor, *_speed_sp);
+    if (_position_sp)   a.position_sp.set(_motor, *_position_sp);
+    if (!command.empty())
+        a.command.set(_motor, command);
+
+    _polarity.reset();
+    _stop_action.reset();
+    _ramp_up_sp.reset();
+    _ramp_down_sp.reset();
+    _time_sp.reset();
+    _duty_cycle_sp.reset();
+    _speed_sp.reset();
+    _position_sp.reset();
+
+    return duration_cast<nanoseconds>(steady_clock::now() - start);
+}
+
+//-----------------------------------------------------------------------------
+uint8_t dc_motor::state_flags() const {
+    char buf[64];
+    const auto n = _state.read(*this, buf, sizeof(buf));
+    return parse_state_flags(buf, n);
+}
+
+//-----------------------------------------------------------------------------
+servo_motor::servo_motor(address_type address, const ISystem& system) : device{system} {
+    std::string _strClassDir { _system.get_sys_root() + "/servo-motor/" };
+    static const std::string _strPattern  { "motor" };
+
+    connect(_strClassDir, _strPattern, {{ "address", { address }}});
+}
+
+constexpr char servo_motor::command_run[];
+constexpr char servo_motor::command_float[];
+constexpr char servo_motor::polarity_normal[];
+constexpr char servo_motor::polarity_inversed[];
+
+//-----------------------------------------------------------------------------
+led::led(std::string name, const ISystem& system) : device{system} {
+    std::string _strClassDir { _system.get_sys_root() + "/leds/" };
+    connect(_strClassDir, name, std::map<std::string, std::set<std::string>>());
+}
+
+//-----------------------------------------------------------------------------
+void led::flash(unsigned on_ms, unsigned off_ms) {
+    static const mode_type timer("timer");
+    set_trigger(timer);
+    if (on_ms) {
+        // A workaround for ev3dev/ev3dev#225.
+        // It takes some time for delay_{on,off} sysfs attributes to appear after
+        // led trigger has been set to "timer".
+        for (int i = 0; ; ++i) {
+            std::this_thread::sleep_for(std::chrono::milliseconds(100));
+            try {
+                set_delay_on (on_ms );
+                set_delay_off(off_ms);
+                break;
+            } catch(...) {
+                if (i >= 5) throw;
+            }
+        }
+    }
+}
+
+//-----------------------------------------------------------------------------
+#if defined(EV3DEV_PLATFORM_BRICKPI)
+
+led led::blue_led1{"brickpi:led1:blue:ev3dev"};
+led led::blue_led2{"brickpi:led2:blue:ev3dev"};
+
+std::vector<led*> led::led1{ &led::blue_led1 };
+std::vector<led*> led::led2{ &led::blue_led2 };
+
+std::vector<float> led::black{ static_cast<float>(0) };
+std::vector<float> led::blue{ static_cast<float>(1) };
+
+//-----------------------------------------------------------------------------
+void led::all_off() {
+
+    blue_led1.off();
+    blue_led2.off();
+
+}
+
+#elif defined(EV3DEV_PLATFORM_BRICKPI3)
+led led::amber_led1{"brickpi3:amber:ev3dev"};
+
+std::vector<led*> led::led1{ &led::amber_led1 };
+
+std::vector<float> led::black{ static_cast<float>(0) };
+std::vector<float> led::blue{ static_cast<float>(1) };
+
+//-----------------------------------------------------------------------------
+void led::all_off() {
+
+    amber_led1.off();
+
+}
+#elif defined(EV3DEV_PLATFORM_PISTORMS)
+
+led led::red_left{"pistorms:BB:red:ev3dev"};
+led led::red_right{"pistorms:BA:red:ev3dev"};
+led led::green_left{"pistorms:BB:green:ev3dev"};
+led led::green_right{"pistorms:BA:green:ev3dev"};
+led led::blue_left{"pistorms:BB:blue:ev3dev"};
+led led::blue_right{"pistorms:BA:blue:ev3dev"};
+
+std::vector<led*> led::left{ &led::red_left, &led::green_left, &led::blue_left };
+std::vector<led*> led::right{ &led::red_right, &led::green_right, &led::blue_right };
+
+std::vector<float> led::black{ static_cast<float>(0), static_cast<float>(0), static_cast<float>(0) };
+std::vector<float> led::red{ static_cast<float>(1), static_cast<float>(0), static_cast<float>(0) };
+std::vector<float> led::green{ static_cast<float>(0), static_cast<float>(1), static_cast<float>(0) };
+std::vector<float> led::blue{ static_cast<float>(0), static_cast<float>(0), static_cast<float>(1) };
+std::vector<float> led::yellow{ static_cast<float>(1), static_cast<float>(1), static_cast<float>(0) };
+std::vector<float> led::purple{ static_cast<float>(1), static_cast<float>(0), static_cast<float>(1) };
+std::vector<float> led::cyan{ static_cast<float>(0), static_cast<float>(1), static_cast<float>(1) };
+std::vector<float> led::white{ static_cast<float>(1), static_cast<float>(1), static_cast<float>(1) };
+std::vector<float> led::orange{ static_cast<float>(1), static_cast<float>(0.5), static_cast<float>(0) };
+
+//-----------------------------------------------------------------------------
+void led::all_off() {
+
+    red_left.off();
+    red_right.off();
+    green_left.off();
+    green_right.off();
+    blue_left.off();
+    blue_right.off();
+
+}
+
+#else
+
+led led::red_left{"led0:red:brick-status"};
+led led::red_right{"led1:red:brick-status"};
+led led::green_left{"led0:green:brick-status"};
+led led::green_right{"led1:green:brick-status"};
+
+std::vector<led*> led::left{ &led::red_left, &led::green_left };
+std::vector<led*> led::right{ &led::red_right, &led::green_right };
+
+std::vector<float> led::black{ static_cast<float>(0), static_cast<float>(0) };
+std::vector<float> led::red{ static_cast<float>(1), static_cast<float>(0) };
+std::vector<float> led::green{ static_cast<float>(0), static_cast<float>(1) };
+std::vector<float> led::amber{ static_cast<float>(1), static_cast<float>(1) };
+std::vector<float> led::orange{ static_cast<float>(1), static_cast<float>(0.5) };
+std::vector<float> led::yellow{ static_cast<float>(0.1), static_cast<float>(1) };
+
+//-----------------------------------------------------------------------------
+void led::all_off() {
+
+    red_left.off();
+    red_right.off();
+    green_left.off();
+    green_right.off();
+
+}
+
+#endif
+
+//-----------------------------------------------------------------------------
+void led::set_color(const std::vector<led*> &group, const std::vector<float> &color) {
+    const size_t n = std::min(group.size(), color.size());
+    for(size_t i = 0; i < n; ++i)
+        group[i]->set_brightness_pct(color[i]);
+}
+
+//-----------------------------------------------------------------------------
+power_supply power_supply::battery { "" };
+
+//-----------------------------------------------------------------------------
+power_supply::power_supply(std::string name, const ISystem& system) : device{system} {
+    if (name.empty())
+        name = "lego-ev3-battery";
+
+    connect(_system.get_sys_root() + "/power_supply", name, std::map<std::string, std::set<std::string>>());
+}
+
+//-----------------------------------------------------------------------------
+button::file_descriptor::file_descriptor(const char *path, int flags)
+    : _fd(open(path, flags))
+{ }
+
+button::file_descriptor::~file_descriptor() {
+    if (_fd != -1) close(_fd);
+}
+
+//-----------------------------------------------------------------------------
+button::button(int bit)
+    :
+       _bit(bit),
+      _buf((KEY_CNT + bits_per_long - 1) / bits_per_long),
+      _fd( new file_descriptor("/dev/input/by-path/platform-gpio_keys-event", O_RDONLY) )
+{ }
+
+//-----------------------------------------------------------------------------
+bool button::pressed() const {
+#ifndef NO_LINUX_HEADERS
+    if (ioctl(*_fd, EVIOCGKEY(_buf.size()), _buf.data()) < 0) {
+        // handle error
+    }
+#endif
+    return (_buf[_bit / bits_per_long] & 1 << (_bit % bits_per_long));
+}
+
+//-----------------------------------------------------------------------------
+bool button::process() {
+    bool new_state = pressed();
+
+    if (new_state != _state) {
+        _state = new_state;
+        if (onclick) onclick(new_state);
+        return true;
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+#ifndef NO_LINUX_HEADERS
+button button::back (KEY_BACKSPACE);
+button button::left (KEY_LEFT);
+button button::right(KEY_RIGHT);
+button button::up   (KEY_UP);
+button button::down (KEY_DOWN);
+button button::enter(KEY_ENTER);
+#endif
+
+//-----------------------------------------------------------------------------
+bool button::process_all() {
+    std::array<bool, 6> changed{{
+        back. process(),
+            left. process(),
+            right.process(),
+            up.   process(),
+            down. process(),
+            enter.process()
+    }};
+    return std::any_of(changed.begin(), changed.end(), [](bool c){ return c; });
+}
+
+//-----------------------------------------------------------------------------
+void sound::beep(const std::string &args, bool bSynchronous, const ISystem& system) {
+    std::ostringstream cmd;
+    cmd << "/usr/bin/beep " << args;
+    if (!bSynchronous) cmd << " &";
+    system.System(cmd.str().c_str());
+}
+
+//-----------------------------------------------------------------------------
+void sound::tone(
+        const std::vector< std::vector<float> > &sequence,
+        bool bSynchronous,
+        const ISystem& system)
+{
+    std::ostringstream args;
+    bool first = true;
+
+    for(auto v : sequence) {
+        if (first) {
+            first = false;
+        } else {
+            args << " -n";
+        }
+
+        if (v.size() > 0) {
+            args << " -f " << v[0];
+        } else {
+            continue;
+        }
+
+        if (v.size() > 1) {
+            args << " -l " << v[1];
+        } else {
+            continue;
+        }
+
+        if (v.size() > 2) {
+            args << " -D " << v[2];
+        } else {
+            continue;
+        }
+    }
+
+    beep(args.str(), bSynchronous, system);
+}
+
+//-----------------------------------------------------------------------------
+void sound::tone(float frequency, float ms, bool bSynchronous, const ISystem& system) {
+    tone({{frequency, ms, 0.0f}}, bSynchronous, system);
+}
+
+//-----------------------------------------------------------------------------
+void sound::play(const std::string &soundfile, bool bSynchronous, const ISystem& system) {
+    std::ostringstream cmd;
+    cmd << "/usr/bin/aplay -q " << soundfile;
+
+    if (!bSynchronous) cmd << " &";
+
+    system.System(cmd.str().c_str());
+}
+
+//-----------------------------------------------------------------------------
+void sound::speak(const std::string &text, bool bSynchronous, const ISystem& system) {
+    std::ostringstream cmd;
+
+    cmd << "/usr/bin/espeak -a 200 --stdout \"" << text << "\""
+        << " | /usr/bin/aplay -q";
+
+    if (!bSynchronous) cmd << " &";
+
+    system.System(cmd.str().c_str());
+}
+
+//-----------------------------------------------------------------------------
+lcd::lcd() :
+    _fb(nullptr), _fbsize(0), _llength(0), _xres(0), _yres(0), _bpp(0)
+{
+    init();
+}
+
+//-----------------------------------------------------------------------------
+lcd::~lcd() {
+    deinit();
+}
+
+//-----------------------------------------------------------------------------
+void lcd::fill(unsigned char pixel) {
+    if (_fb && _fbsize) {
+        memset(_fb, pixel, _fbsize);
+    }
+}
+
+//-----------------------------------------------------------------------------
+void lcd::init() {
+    using namespace std;
+
+#ifdef _LINUX_FB_H
+    int fbf = open("/dev/fb0", O_RDWR);
+    if (fbf < 0)
+        return;
+
+    fb_fix_screeninfo i;
+    if (ioctl(fbf, FBIOGET_FSCREENINFO, &i) < 0)
+        return;
+
+    _fbsize  = i.smem_len;
+    _llength = i.line_length;
+
+    _fb = (unsigned char*)mmap(NULL, _fbsize, PROT_READ|PROT_WRITE, MAP_SHARED, fbf, 0);
+    if (_fb == nullptr)
+        return;
+
+    fb_var_screeninfo v;
+
+    if (ioctl(fbf, FBIOGET_VSCREENINFO, &v) < 0)
+        return;
+
+    _xres = v.xres;
+    _yres = v.yres;
+    _bpp  = v.bits_per_pixel;
+#endif
+}
+
+//-----------------------------------------------------------------------------
+void lcd::deinit() {
+    if (_fb) {
+        munmap(_fb, 0);
+    }
+
+    _fbsize = 0;
+}
+
+//-----------------------------------------------------------------------------
+remote_control::remote_control(unsigned channel)
+    : _sensor(new infrared_sensor), _owns_sensor(true)
+{
+    if ((channel >= 1) && (channel <=4))
+        _channel = channel-1;
+
+    if (_sensor->connected())
+        _sensor->set_mode(infrared_sensor::mode_ir_remote);
+}
+
+//-----------------------------------------------------------------------------
+remote_control::remote_control(infrared_sensor &ir, unsigned channel)
+    : _sensor(&ir), _owns_sensor(false)
+{
+    if ((channel >= 1) && (channel <=4))
+        _channel = channel-1;
+
+    if (_sensor->connected())
+        _sensor->set_mode(infrared_sensor::mode_ir_remote);
+}
+
+//-----------------------------------------------------------------------------
+remote_control::~remote_control() {
+    if (_owns_sensor)
+        delete _sensor;
+}
+
+//-----------------------------------------------------------------------------
+bool remote_control::process() {
+    int value = _sensor->value(_channel);
+    if (value != _value) {
+        on_value_changed(value);
+        _value = value;
+        return true;
+    }
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+void remote_control::on_value_changed(int value) {
+    int new_state = 0;
+
+    switch (value) {
+        case 1:
+            new_state = red_up;
+            break;
+        case 2:
+            new_state = red_down;
+            break;
+        case 3:
+            new_state = blue_up;
+            break;
+        case  4:
+            new_state = blue_down;
+            break;
+        case 5:
+            new_state = red_up | blue_up;
+            break;
+        case 6:
+            new_state = red_up | blue_down;
+            break;
+        case 7:
+            new_state = red_down |  blue_up;
+            break;
+        case 8:
+            new_state = red_down | blue_down;
+            break;
+        case 9:
+            new_state = beacon;
+            break;
+        case 10:
+            new_state = red_up | red_down;
+            break;
+        case 11:
+            new_state = blue_up | blue_down;
+            break;
+    }
+
+    if (((new_state & red_up) != (_state & red_up)) &&
+            static_cast<bool>(on_red_up))
+        on_red_up(new_state & red_up);
+
+    if (((new_state & red_down) != (_state & red_down)) &&
+            static_cast<bool>(on_red_down))
+        on_red_down(new_state & red_down);
+
+    if (((new_state & blue_up) != (_state & blue_up)) &&
+            static_cast<bool>(on_blue_up))
+        on_blue_up(new_state & blue_up);
+
+    if (((new_state & blue_down) != (_state & blue_down)) &&
+            static_cast<bool>(on_blue_down))
+        on_blue_down(new_state & blue_down);
+
+    if (((new_state & beacon) != (_state & beacon)) &&
+            static_cast<bool>(on_beacon))
+        on_beacon(new_state & beacon);
+
+    if ((new_state != _state) &&
+            static_cast<bool>(on_state_change))
+        on_state_change(new_state);
+
+    _state = new_state;
+}
+
+//-----------------------------------------------------------------------------
+lego_port::lego_port(address_type address, const ISystem& system) : device{system} {
+    connect({{ "address", { address } }});
+}
+
+//-----------------------------------------------------------------------------
+bool lego_port::connect(const std::map<std::string, std::set<std::string>> &match) noexcept
+{
+    std::string _strClassDir { _system.get_sys_root() + "/lego-port/" };
+    static const std::string _strPattern  { "port" };
+
+    try {
+        return device::connect(_strClassDir, _strPattern, match);
+    } catch (...) { }
+
+    _path.clear();
+
+    return false;
+}
+
+//-----------------------------------------------------------------------------
+// read_batch
+//-----------------------------------------------------------------------------
+// The submission and completion rings of an io_uring, set up with the raw
+// syscalls so there is no dependency on liburing.
+struct read_batch::ring {
+#ifdef EV3DEV_IO_URING
+    static constexpr unsigned entries = 64;
+
+    ~ring() {
+        if (sqes != MAP_FAILED)
+            munmap(sqes, sqes_size);
+        if (cq_ptr != MAP_FAILED && cq_ptr != sq_ptr)
+            munmap(cq_ptr, cq_size);
+        if (sq_ptr != MAP_FAILED)
+            munmap(sq_ptr, sq_size);
+        if (fd >= 0)
+            ::close(fd);
+    }
+
+    // Returns false if the kernel does not let us have a ring.
+    bool open() {
+        io_uring_params p{};
+        fd = static_cast<int>(syscall(__NR_io_uring_setup, entries, &p));
+        if (fd < 0)
+            return false;
+
+        sq_size = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+        cq_size = p.cq_off.cqes + p.cq_entries * sizeof(io_uring_cqe);
+        bool single_mmap = false;
+#  ifdef IORING_FEAT_SINGLE_MMAP
+        single_mmap = (p.features & IORING_FEAT_SINGLE_MMAP) != 0;
+#  endif
+        if (single_mmap)
+            sq_size = cq_size = std::max(sq_size, cq_size);
+
+        sq_ptr = mmap(nullptr, sq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQ_RING);
+        if (sq_ptr == MAP_FAILED)
+            return false;
+
+        cq_ptr = single_mmap ? sq_ptr :
+            mmap(nullptr, cq_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_CQ_RING);
+        if (cq_ptr == MAP_FAILED)
+            return false;
+
+        sqes_size = p.sq_entries * sizeof(io_uring_sqe);
+        sqes = mmap(nullptr, sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd, IORING_OFF_SQES);
+        if (sqes == MAP_FAILED)
+            return false;
+
+        auto *sq = static_cast<char*>(sq_ptr);
+        auto *cq = static_cast<char*>(cq_ptr);
+        sq_tail  = reinterpret_cast<unsigned*>(sq + p.sq_off.tail);
+        sq_mask  = *reinterpret_cast<unsigned*>(sq + p.sq_off.ring_mask);
+        sq_array = reinterpret_cast<unsigned*>(sq + p.sq_off.array);
+        cq_head  = reinterpret_cast<unsigned*>(cq + p.cq_off.head);
+        cq_tail  = reinterpret_cast<unsigned*>(cq + p.cq_off.tail);
+        cq_mask  = *reinterpret_cast<unsigned*>(cq + p.cq_off.ring_mask);
+        cqes     = reinterpret_cast<io_uring_cqe*>(cq + p.cq_off.cqes);
+        return true;
+    }
+
+    // Waits for `outstanding` submitted reads to complete and drops their
+    // completions. Gives up if the kernel refuses to wait.
+    void drain(unsigned outstanding) {
+        while (outstanding > 0) {
+            const auto n = syscall(__NR_io_uring_enter, fd, 0, outstanding, IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n < 0 && errno != EINTR)
+                return;
+
+            unsigned head = *cq_head;
+            const unsigned tail = __atomic_load_n(cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail && outstanding > 0; ++head)
+                --outstanding;
+            __atomic_store_n(cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+
+    int fd = -1;
+    void *sq_ptr = MAP_FAILED;
+    void *cq_ptr = MAP_FAILED;
+    void *sqes = MAP_FAILED;
+    std::size_t sq_size = 0;
+    std::size_t cq_size = 0;
+    std::size_t sqes_size = 0;
+
+    unsigned *sq_tail = nullptr;
+    unsigned sq_mask = 0;
+    unsigned *sq_array = nullptr;
+    unsigned *cq_head = nullptr;
+    unsigned *cq_tail = nullptr;
+    unsigned cq_mask = 0;
+    io_uring_cqe *cqes = nullptr;
+
+    std::vector<iovec> iov;
+#endif
+};
+
+read_batch::read_batch(const ISystem& system, backend preferred)
+    : _system(system)
+    , _backend(preferred)
+{
+    if (_backend == backend::automatic || _backend == backend::io_uring) {
+        const bool want_ring = _backend == backend::io_uring;
+        _backend = backend::pread;
+#ifdef EV3DEV_IO_URING
+        if (want_ring) {
+            auto r = std::make_unique<ring>();
+            if (r->open()) {
+                _ring = std::move(r);
+                _backend = backend::io_uring;
+            }
+        }
+#else
+        (void)want_ring;
+#endif
+    }
+}
+
+read_batch::~read_batch() = default;
+
+std::size_t read_batch::add(const std::string &device_path, const char *name) {
+    using namespace std;
+
+    if (device_path.empty())
+        throw system_error(make_error_code(errc::function_not_supported), "no device connected");
+
+    slot &s = _slots.emplace_back();
+    s.path = device_path + name;
+    s.in = _system.OpenForRead(s.path);
+    s.in->prepare(s.path);
+    if (!s.in->is_open()) {
+        _slots.pop_back();
+        throw system_error(make_error_code(errc::no_such_device), device_path + name);
+    }
+
+    // One file without a descriptor and the whole batch goes through streams.
+    s.fd = s.in->native_handle();
+    if (s.fd < 0) {
+        _backend = backend::stream;
+        _ring.reset();
+    }
+
+    return _slots.size() - 1;
+}
+
+std::size_t read_batch::submit() {
+    switch (_backend) {
+    case backend::io_uring: submit_io_uring(); break;
+    case backend::stream:   submit_stream();   break;
+    default:                submit_pread();    break;
+    }
+
+    return static_cast<std::size_t>(std::count_if(_slots.begin(), _slots.end(),
+            [](const slot &s) { return s.error != 0; }));
+}
+
+void read_batch::submit_io_uring() {
+#ifdef EV3DEV_IO_URING
+    using namespace std;
+
+    ring &r = *_ring;
+    auto *sqes = static_cast<io_uring_sqe*>(r.sqes);
+
+    r.iov.resize(_slots.size());
+    for (size_t i = 0; i < _slots.size(); ++i)
+        r.iov[i] = iovec{_slots[i].buf.data(), max_value_size};
+
+    for (size_t first = 0; first < _slots.size(); first += ring::entries) {
+        const auto count = static_cast<unsigned>(min<size_t>(ring::entries, _slots.size() - first));
+
+        unsigned tail = *r.sq_tail;
+        for (unsigned i = 0; i < count; ++i, ++tail) {
+            const unsigned index = tail & r.sq_mask;
+            io_uring_sqe &sqe = sqes[index];
+            memset(&sqe, 0, sizeof(sqe));
+            sqe.opcode = IORING_OP_READV;
+            sqe.fd = _slots[first + i].fd;
+            sqe.addr = reinterpret_cast<uintptr_t>(&r.iov[first + i]);
+            sqe.len = 1;
+            sqe.user_data = first + i;
+            r.sq_array[index] = index;
+        }
+        __atomic_store_n(r.sq_tail, tail, __ATOMIC_RELEASE);
+
+        unsigned submitted = 0, completed = 0;
+        while (completed < count) {
+            const auto n = syscall(__NR_io_uring_enter, r.fd, count - submitted, count - completed,
+                    IORING_ENTER_GETEVENTS, nullptr, 0);
+            if (n < 0) {
+                if (errno == EINTR)
+                    continue;
+
+                // The reads already submitted still write into the slots,
+                // and the queue may hold entries the kernel never took. Wait
+                // for the former, then leave the ring for pread.
+                const error_code ec(errno, std::system_category());
+                r.drain(submitted - completed);
+                _ring.reset();
+                _backend = backend::pread;
+                throw system_error(ec, "io_uring_enter");
+            }
+            submitted += static_cast<unsigned>(n);
+
+            unsigned head = *r.cq_head;
+            const unsigned cq_tail = __atomic_load_n(r.cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != cq_tail; ++head, ++completed) {
+                const io_uring_cqe &cqe = r.cqes[head & r.cq_mask];
+                slot &s = _slots[cqe.user_data];
+                if (cqe.res < 0) {
+                    s.error = -cqe.res;
+                    s.length = 0;
+                } else {
+                    s.error = 0;
+                    s.length = static_cast<size_t>(cqe.res);
+                }
+            }
+            __atomic_store_n(r.cq_head, head, __ATOMIC_RELEASE);
+        }
+    }
+#endif
+}
+
+void read_batch::submit_pread() {
+    using namespace std;
+
+    for (auto &s : _slots) {
+        const auto n = pread_attr(s.fd, s.buf.data(), s.buf.size());
+        s.error = n < 0 ? errno : 0;
+        s.length = n < 0 ? 0 : static_cast<size_t>(n);
+    }
+}
+
+void read_batch::submit_stream() {
+    for (auto &s : _slots) {
+        const auto n = try_read_raw_attr(*s.in, s.path, s.buf.data(), s.buf.size());
+        s.error = n ? 0 : n.error().value();
+        s.length = n ? n.value() : 0;
+    }
+}
+
+std::string_view read_batch::text(std::size_t index) const {
+    const auto &s = _slots.at(index);
+    if (s.error)
+        throw std::system_error(std::error_code(s.error, std::system_category()), s.path);
+    std::string_view result(s.buf.data(), s.length);
+    while (!result.empty() && (result.back() == '\n' || result.back() == '\0'))
+        result.remove_suffix(1);
+    return result;
+}
+
+std::error_code read_batch::error(std::size_t index) const {
+    const auto &s = _slots.at(index);
+    return s.error ? std::error_code(s.error, std::system_category()) : std::error_code{};
+}
+
+int read_batch::value(std::size_t index) const {
+    using namespace std;
+
+    const auto t = text(index);
+    int result = 0;
+    if (!parse_int(t.data(), t.data() + t.size(), result))
+        throw system_error(make_error_code(errc::invalid_argument), _slots[index].path);
+    return result;
+}
+
+//-----------------------------------------------------------------------------
+// sensor_sampler
+//-----------------------------------------------------------------------------
+sensor_sampler::sensor_sampler(std::chrono::microseconds period, const ISystem& system)
+    : _batch(system)
+    , _period(period.count())
+{ }
+
+sensor_sampler::~sensor_sampler() {
+    stop();
+}
+
+std::size_t sensor_sampler::add(const std::string &device_path, const char *name, std::size_t capacity) {
+    using namespace std;
+
+    if (running())
+        throw system_error(make_error_code(errc::operation_in_progress), "sampler is running");
+
+    const string path = device_path + name;
+    auto found = _slots.find(path);
+    if (found == _slots.end())
+        found = _slots.emplace(path, _batch.add(device_path, name)).first;
+
+    _channels.emplace_back(found->second, capacity);
+    return _channels.size() - 1;
+}
+
+void sensor_sampler::start() {
+    if (running())
+        return;
+
+    _stop = false;
+    _thread = std::thread([this] { loop(); });
+}
+
+void sensor_sampler::stop() {
+    if (!running())
+        return;
+
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop = true;
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+void sensor_sampler::loop() {
+    using namespace std;
+    using namespace std::chrono;
+
+    auto next = steady_clock::now();
+
+    unique_lock<mutex> lock(_mutex);
+    while (!_stop) {
+        lock.unlock();
+
+        bool failed = false;
+        try {
+            _batch.submit();
+            const auto now = steady_clock::now();
+            for (auto &c : _channels) {
+                int value;
+                try {
+                    value = _batch.value(c.slot);
+                } catch (...) {
+                    c.failed.fetch_add(1, memory_order_relaxed);
+                    failed = true;
+                    continue;
+                }
+                if (!c.ring.push(sample{now, value}))
+                    c.dropped.fetch_add(1, memory_order_relaxed);
+            }
+        } catch (...) {
+            for (auto &c : _channels)
+                c.failed.fetch_add(1, memory_order_relaxed);
+            failed = true;
+        }
+        if (failed)
+            _errors.fetch_add(1, memory_order_relaxed);
+        _ticks.fetch_add(1, memory_order_relaxed);
+
+        next += microseconds{_period.load(memory_order_relaxed)};
+        const auto now = steady_clock::now();
+        if (next < now)
+            next = now;
+
+        lock.lock();
+        _wake.wait_until(lock, next, [this] { return _stop; });
+    }
+}
+
+//-----------------------------------------------------------------------------
+// device_snapshot
+//-----------------------------------------------------------------------------
+std::size_t device_snapshot::track(const motor &m, unsigned what) {
+    using namespace std;
+
+    if (_motors.size() == max_motors)
+        throw system_error(make_error_code(errc::no_buffer_space), "too many motors in snapshot");
+
+    motor_slots slots;
+    if (what & read_position)
+        slots.position = _batch.add(m, "position");
+    if (what & read_speed)
+        slots.speed = _batch.add(m, "speed");
+    if (what & read_state)
+        slots.state = _batch.add(m, "state");
+
+    _motors.push_back(slots);
+    return _motors.size() - 1;
+}
+
+std::size_t device_snapshot::track(const sensor &s) {
+    using namespace std;
+
+    if (_sensors.size() == max_sensors)
+        throw system_error(make_error_code(errc::no_buffer_space), "too many sensors in snapshot");
+
+    const unsigned count = min(static_cast<unsigned>(s.num_values()), sensor::max_values);
+
+    sensor_slots slots{_batch.size(), count};
+    char name[] = "value0";
+    for (unsigned i = 0; i < count; ++i) {
+        name[5] = static_cast<char>('0' + i);
+        _batch.add(s, name);
+    }
+
+    _sensors.push_back(slots);
+    return _sensors.size() - 1;
+}
+
+std::size_t device_snapshot::update() {
+    _batch.submit();
+
+    // Starts from the last data, so what fails to read keeps its old value.
+    data d = _published.load();
+    d.time = std::chrono::steady_clock::now();
+
+    std::size_t failures = 0;
+    const auto read = [&](auto &field, auto get) {
+        try {
+            field = get();
+        } catch (const std::system_error &) {
+            ++failures;
+        }
+    };
+
+    for (std::size_t i = 0; i < _motors.size(); ++i) {
+        const auto &slots = _motors[i];
+        auto &entry = d.motors[i];
+        if (slots.position != none)
+            read(entry.position, [&] { return _batch.value(slots.position); });
+        if (slots.speed != none)
+            read(entry.speed, [&] { return _batch.value(slots.speed); });
+        if (slots.state != none) {
+            read(entry.flags, [&] {
+                const auto text = _batch.text(slots.state);
+                return parse_state_flags(text.data(), text.size());
+            });
+        }
+    }
+
+    for (std::size_t i = 0; i < _sensors.size(); ++i) {
+        const auto &slots = _sensors[i];
+        auto &entry = d.sensors[i];
+        entry.count = slots.count;
+        for (unsigned v = 0; v < slots.count; ++v)
+            read(entry.value[v], [&] { return _batch.value(slots.first + v); });
+    }
+
+    _published.store(d);
+    return failures;
+}
+
+//-----------------------------------------------------------------------------
+io_worker::io_worker(error_handler on_error)
+    : _on_error(std::move(on_error))
+    , _thread([this] { loop(); })
+{ }
+
+io_worker::~io_worker() {
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _stop.store(true);
+    }
+    _wake.notify_one();
+    _thread.join();
+}
+
+void io_worker::push(node *n) noexcept {
+    _pending.fetch_add(1);
+
+    n->next.store(nullptr, std::memory_order_relaxed);
+    node *prev = _head.exchange(n, std::memory_order_acq_rel);
+    prev->next.store(n, std::memory_order_release);
+
+    if (_sleeping.load()) {
+        std::lock_guard<std::mutex> lock(_mutex);
+        _wake.notify_one();
+    }
+}
+
+// Only called from the worker thread. Returns nullptr if the queue is empty
+// or a push is halfway done.
+io_worker::node* io_worker::pop() noexcept {
+    using namespace std;
+
+    node *tail = _tail;
+    node *next = tail->next.load(memory_order_acquire);
+
+    if (tail == &_stub) {
+        if (!next)
+            return nullptr;
+        _tail = next;
+        tail = next;
+        next = next->next.load(memory_order_acquire);
+    }
+
+    if (next) {
+        _tail = next;
+        return tail;
+    }
+
+    if (tail != _head.load(memory_order_acquire))
+        return nullptr;
+
+    // tail is the last node, put the stub behind it so it can be taken.
+    _stub.next.store(nullptr, memory_order_relaxed);
+    node *prev = _head.exchange(&_stub, memory_order_acq_rel);
+    prev->next.store(&_stub, memory_order_release);
+
+    next = tail->next.load(memory_order_acquire);
+    if (next) {
+        _tail = next;
+        return tail;
+    }
+
+    return nullptr;
+}
+
+void io_worker::loop() {
+    using namespace std;
+
+    for (;;) {
+        if (node *n = pop()) {
+            try {
+                n->run();
+            } catch (...) {
+                _errors.fetch_add(1, memory_order_relaxed);
+                if (_on_error)
+                    _on_error(current_exception());
+            }
+            delete n;
+            _pending.fetch_sub(1);
+            continue;
+        }
+
+        if (_pending.load() != 0) {
+            // A producer is between taking its place and linking its node.
+            this_thread::yield();
+            continue;
+        }
+
+        unique_lock<mutex> lock(_mutex);
+        if (_stop.load())
+            break;
+
+        _sleeping.store(true);
+        _wake.wait(lock, [this] { return _pending.load() != 0 || _stop.load(); });
+        _sleeping.store(false);
+    }
+}
+
+//-----------------------------------------------------------------------------
+// SimSystem
+//-----------------------------------------------------------------------------
+namespace {
+
+constexpr std::chrono::nanoseconds sim_step = std::chrono::milliseconds{1};
+
+double sim_seconds(std::chrono::nanoseconds t) {
+    return std::chrono::duration<double>(t).count();
+}
+
+// Parses a written value the way sysfs does, a trailing newline is fine.
+bool sim_parse(std::string_view text, int &value) {
+    while (!text.empty() && text.back() == '\n')
+        text.remove_suffix(1);
+    return !text.empty() && parse_int(text.data(), text.data() + text.size(), value);
+}
+
+// Reads `text` into `value` if it is in [lo, hi], see sim_parse().
+int sim_set(std::string_view text, int lo, int hi, int &value) {
+    int v = 0;
+    if (!sim_parse(text, v) || v < lo || v > hi)
+        return EINVAL;
+    value = v;
+    return 0;
+}
+
+} // namespace
+
+struct SimSystem::sim_motor {
+    enum class run { idle, forever, timed, to_pos, direct };
+
+    sim_motor(const motor_config &c, std::size_t index)
+        : config(c), name("motor" + std::to_string(index)) {
+        max_speed = config.max_speed != 0 ? config.max_speed
+                  : config.driver_name == motor::motor_medium ? 1560 : 1050;
+    }
+
+    double sign() const { return inversed ? -1.0 : 1.0; }
+
+    // Acceleration limit in counts/s^2 for a ramp of `ms` milliseconds from
+    // zero to full speed, or the spin-up limit without a ramp.
+    double accel(int ms) const {
+        const double t = ms > 0 ? ms / 1000.0 : sim_seconds(config.spin_up_time);
+        return t > 0 ? max_speed / t : HUGE_VAL;
+    }
+
+    void stop() {
+        if (stop_action == motor::stop_action_hold) {
+            holding = true;
+            hold_x = x;
+            v = 0;
+        }
+        mode = run::idle;
+        target_v = 0;
+        stalled = false;
+        ramping = false;
+    }
+
+    void step(double dt) {
+        double accel_up = accel(0), accel_down = accel_up;
+        switch (mode) {
+            case run::idle:
+                if (holding) {
+                    x = hold_x;
+                    v = 0;
+                    return;
+                }
+                target_v = 0;
+                accel_down = max_speed / sim_seconds(stop_action == motor::stop_action_brake
+                        ? config.brake_time : config.coast_time);
+                break;
+
+            case run::direct:
+                target_v = sign() * duty_cycle_sp * max_speed / 100.0;
+                break;
+
+            case run::timed:
+                run_time += dt;
+                if (run_time * 1000 >= time_sp) {
+                    stop();
+                    return step(dt);
+                }
+                [[fallthrough]];
+            case run::forever:
+                accel_up = accel(ramp_up_sp);
+                accel_down = accel(ramp_down_sp);
+                break;
+
+            case run::to_pos: {
+                // Brake in time to stop on the target.
+                const double d = target_x - x;
+                accel_up = accel(ramp_up_sp);
+                accel_down = accel(ramp_down_sp);
+                const double cap = std::min(run_speed, std::sqrt(2 * accel_down * std::abs(d)));
+                target_v = d < 0 ? -cap : cap;
+                if (std::abs(d) < 0.5 || std::abs(d) <= std::abs(v) * dt) {
+                    x = target_x;
+                    v = 0;
+                    stop();
+                    return;
+                }
+                break;
+            }
+        }
+
+        const bool speeding_up = std::abs(target_v) > std::abs(v) && target_v * v >= 0;
+        const double dv = (speeding_up ? accel_up : accel_down) * dt;
+        ramping = mode != run::idle && mode != run::direct && std::abs(target_v - v) > dv
+                && (speeding_up ? ramp_up_sp : ramp_down_sp) > 0;
+        v = std::abs(target_v - v) <= dv ? target_v : v + (target_v > v ? dv : -dv);
+        x += v * dt;
+
+        bool blocked = false;
+        if (config.min_position && x <= *config.min_position) {
+            x = *config.min_position;
+            blocked = target_v < 0;
+            v = std::max(v, 0.0);
+        }
+        if (config.max_position && x >= *config.max_position) {
+            x = *config.max_position;
+            blocked = target_v > 0;
+            v = std::min(v, 0.0);
+        }
+        stalled = mode != run::idle && blocked;
+    }
+
+    int command(std::string_view c) {
+        holding = false;
+        if (c == motor::command_run_forever) {
+            mode = run::forever;
+            target_v = sign() * speed_sp;
+        } else if (c == motor::command_run_timed) {
+            mode = run::timed;
+            target_v = sign() * speed_sp;
+            run_time = 0;
+        } else if (c == motor::command_run_to_abs_pos || c == motor::command_run_to_rel_pos) {
+            target_x = (c == motor::command_run_to_abs_pos ? zero : x) + sign() * position_sp;
+            run_speed = std::abs(speed_sp);
+            mode = run::to_pos;
+        } else if (c == motor::command_run_direct) {
+            mode = run::direct;
+        } else if (c == motor::command_stop) {
+            stop();
+        } else if (c == motor::command_reset) {
+            mode = run::idle;
+            stalled = ramping = false;
+            zero = x;
+            speed_sp = position_sp = duty_cycle_sp = time_sp = ramp_up_sp = ramp_down_sp = 0;
+            inversed = false;
+            stop_action = motor::stop_action_coast;
+        } else {
+            return EINVAL;
+        }
+        return 0;
+    }
+
+    int read(std::string_view attr, std::string &text) const {
+        const auto number = [&](double value) {
+            text = std::to_string(std::lround(value));
+            return 0;
+        };
+
+        if (attr == "address")
+            text = config.address;
+        else if (attr == "driver_name")
+            text = config.driver_name;
+        else if (attr == "commands")
+            text = "run-forever run-to-abs-pos run-to-rel-pos run-timed run-direct stop reset";
+        else if (attr == "count_per_rot")
+            return number(config.count_per_rot);
+        else if (attr == "duty_cycle")
+            return number(mode == run::direct ? duty_cycle_sp : mode == run::idle ? 0
+                    : std::clamp(100 * sign() * target_v / max_speed, -100.0, 100.0));
+        else if (attr == "duty_cycle_sp")
+            return number(duty_cycle_sp);
+        else if (attr == "max_speed")
+            return number(max_speed);
+        else if (attr == "polarity")
+            text = inversed ? motor::polarity_inversed : motor::polarity_normal;
+        else if (attr == "position")
+            return number(sign() * (x - zero));
+        else if (attr == "position_sp")
+            return number(position_sp);
+        else if (attr == "ramp_down_sp")
+            return number(ramp_down_sp);
+        else if (attr == "ramp_up_sp")
+            return number(ramp_up_sp);
+        else if (attr == "speed")
+            return number(sign() * v);
+        else if (attr == "speed_sp")
+            return number(speed_sp);
+        else if (attr == "state") {
+            text.clear();
+            for (auto [set, flag] : {std::make_pair(mode != run::idle, "running"), std::make_pair(ramping, "ramping"),
+                    std::make_pair(holding, "holding"), std::make_pair(stalled, "stalled")}) {
+                if (set)
+                    text.append(text.empty() ? "" : " ").append(flag);
+            }
+        } else if (attr == "stop_action")
+            text = stop_action;
+        else if (attr == "stop_actions")
+            text = "coast brake hold";
+        else if (attr == "time_sp")
+            return number(time_sp);
+        else
+            return attr == "command" ? EPERM : ENOENT;
+        return 0;
+    }
+
+    int write(std::string_view attr, std::optional<std::string_view> value) {
+        static constexpr std::string_view writable[] = {"command", "duty_cycle_sp", "polarity", "position",
+            "position_sp", "ramp_down_sp", "ramp_up_sp", "speed_sp", "stop_action", "time_sp"};
+        if (std::find(std::begin(writable), std::end(writable), attr) == std::end(writable))
+            return ENOENT;
+        if (!value)
+            return 0;
+
+        auto text = *value;
+        while (!text.empty() && text.back() == '\n')
+            text.remove_suffix(1);
+
+        constexpr int int_max = std::numeric_limits<int>::max();
+        if (attr == "command")
+            return command(text);
+        if (attr == "duty_cycle_sp")
+            return sim_set(text, -100, 100, duty_cycle_sp);
+        if (attr == "position_sp")
+            return sim_set(text, -int_max, int_max, position_sp);
+        if (attr == "ramp_down_sp")
+            return sim_set(text, 0, 60000, ramp_down_sp);
+        if (attr == "ramp_up_sp")
+            return sim_set(text, 0, 60000, ramp_up_sp);
+        if (attr == "speed_sp")
+            return sim_set(text, -max_speed, max_speed, speed_sp);
+        if (attr == "time_sp")
+            return sim_set(text, 0, int_max, time_sp);
+        if (attr == "position") {
+            int p = 0;
+            if (sim_set(text, -int_max, int_max, p) != 0)
+                return EINVAL;
+            zero = x - sign() * p;
+            return 0;
+        }
+        if (attr == "polarity") {
+            if (text != motor::polarity_normal && text != motor::polarity_inversed)
+                return EINVAL;
+            inversed = text == motor::polarity_inversed;
+            return 0;
+        }
+
+        if (text != motor::stop_action_coast && text != motor::stop_action_brake && text != motor::stop_action_hold)
+            return EINVAL;
+        stop_action = std::string(text);
+        return 0;
+    }
+
+    motor_config config;
+    std::string name;
+    int max_speed = 0;
+
+    int speed_sp = 0, position_sp = 0, duty_cycle_sp = 0, time_sp = 0, ramp_up_sp = 0, ramp_down_sp = 0;
+    bool inversed = false;
+    std::string stop_action = motor::stop_action_coast;
+
+    // The shaft, in counts and counts/s. position reads as x - zero, times
+    // -1 with inversed polarity.
+    run mode = run::idle;
+    double x = 0, v = 0, zero = 0;
+    double target_v = 0, target_x = 0, run_speed = 0, run_time = 0, hold_x = 0;
+    bool holding = false, stalled = false, ramping = false;
+};
+
+struct SimSystem::sim_sensor {
+    sim_sensor(const std::string &address_, const std::string &driver, std::size_t index)
+        : name("sensor" + std::to_string(index)), address(address_), driver_name(driver) {
+        if (driver == sensor::ev3_touch)
+            modes = {touch_sensor::mode_touch};
+        else if (driver == sensor::ev3_color)
+            modes = {color_sensor::mode_col_reflect, color_sensor::mode_col_ambient, color_sensor::mode_col_color,
+                     color_sensor::mode_ref_raw, color_sensor::mode_rgb_raw};
+        else if (driver == sensor::ev3_gyro)
+            modes = {gyro_sensor::mode_gyro_ang, gyro_sensor::mode_gyro_rate, gyro_sensor::mode_gyro_fas,
+                     gyro_sensor::mode_gyro_g_a};
+        else
+            throw std::invalid_argument("no simulation for sensor driver " + driver);
+        mode = modes.front();
+    }
+
+    struct mode_data {
+        std::vector<int> values;
+        const char *units;
+        const char *format;
+    };
+
+    mode_data current() const {
+        const int a = static_cast<int>(std::lround(angle));
+        const int r = static_cast<int>(std::lround(rate));
+        if (mode == touch_sensor::mode_touch)
+            return {{pressed ? 1 : 0}, "", "u8"};
+        if (mode == color_sensor::mode_col_reflect)
+            return {{color.reflected}, "pct", "s8"};
+        if (mode == color_sensor::mode_col_ambient)
+            return {{color.ambient}, "pct", "s8"};
+        if (mode == color_sensor::mode_col_color)
+            return {{color.color}, "col", "s8"};
+        if (mode == color_sensor::mode_ref_raw)
+            return {{color.reflected * 1020 / 100, color.ambient * 1020 / 100}, "", "s16"};
+        if (mode == color_sensor::mode_rgb_raw)
+            return {{color.red, color.green, color.blue}, "", "s16"};
+        if (mode == gyro_sensor::mode_gyro_ang)
+            return {{a}, "deg", "s16"};
+        if (mode == gyro_sensor::mode_gyro_g_a)
+            return {{a, r}, "", "s16"};
+        return {{r}, mode == gyro_sensor::mode_gyro_rate ? "d/s" : "", "s16"};
+    }
+
+    int read(std::string_view attr, std::string &text) const {
+        const auto data = current();
+        if (attr == "address")
+            text = address;
+        else if (attr == "driver_name")
+            text = driver_name;
+        else if (attr == "mode")
+            text = mode;
+        else if (attr == "modes") {
+            text.clear();
+            for (auto &m : modes)
+                text.append(text.empty() ? "" : " ").append(m);
+        } else if (attr == "num_values")
+            text = std::to_string(data.values.size());
+        else if (attr == "decimals")
+            text = "0";
+        else if (attr == "units")
+            text = data.units;
+        else if (attr == "bin_data_format")
+            text = data.format;
+        else if (attr == "bin_data") {
+            // Little endian, like the EV3.
+            const std::size_t size = data.format[1] == '8' ? 1 : 2;
+            text.clear();
+            for (int value : data.values) {
+                for (std::size_t i = 0; i < size; ++i)
+                    text.push_back(static_cast<char>((static_cast<unsigned>(value) >> (8 * i)) & 0xff));
+            }
+            return 0;
+        } else if (attr.size() == 6 && attr.substr(0, 5) == "value" && attr[5] >= '0' && attr[5] <= '7') {
+            const auto index = static_cast<std::size_t>(attr[5] - '0');
+            text = std::to_string(index < data.values.size() ? data.values[index] : 0);
+        } else
+            return ENOENT;
+
+        text.push_back('\n');
+        return 0;
+    }
+
+    int write(std::string_view attr, std::optional<std::string_view> value) {
+        if (attr != "mode")
+            return ENOENT;
+        if (!value)
+            return 0;
+
+        auto text = *value;
+        while (!text.empty() && text.back() == '\n')
+            text.remove_suffix(1);
+        if (std::find(modes.begin(), modes.end(), text) == modes.end())
+            return EINVAL;
+
+        mode = std::string(text);
+        // Like the real gyro, the angle counts from when the mode was set.
+        if (mode == gyro_sensor::mode_gyro_ang || mode == gyro_sensor::mode_gyro_g_a)
+            angle = 0;
+        return 0;
+    }
+
+    std::string name;
+    std::string address;
+    std::string driver_name;
+    std::vector<std::string> modes;
+    std::string mode;
+
+    bool pressed = false;
+    color_reading color;
+    double rate = 0;
+    double angle = 0;
+};
+
+class SimSystem::istream : public file_istream {
+    public:
+        istream(const SimSystem &sim, std::string path) : _sim(sim), _path(std::move(path)) {}
+
+        bool is_open() const override { return _open; }
+        void close() override { _open = false; }
+        void clear() override { _stream.clear(); }
+        void prepare(const std::string &) override {
+            // Like sysfs, every read sees the value of the moment.
+            std::string text;
+            int error = 0;
+            {
+                std::lock_guard<std::mutex> lock(_sim._mutex);
+                _sim.sync();
+                error = _sim.read(_path, text);
+            }
+            _open = error != ENOENT;
+            _stream.str(std::move(text));
+            _stream.clear();
+            if (error != 0)
+                _stream.setstate(std::ios::failbit);
+        }
+
+        std::istream& get() override { return _stream; }
+        const std::istream& get() const override { return _stream; }
+
+    private:
+        const SimSystem &_sim;
+        std::string _path;
+        bool _open = false;
+        std::istringstream _stream;
+};
+
+class SimSystem::ostream : public file_ostream {
+    public:
+        ostream(const SimSystem &sim, std::string path) : _sim(sim), _path(std::move(path)) {}
+
+        bool is_open() const override { return _open; }
+        void close() override { _open = false; }
+        void clear() override {}
+        void prepare(const std::string &) override {
+            std::lock_guard<std::mutex> lock(_sim._mutex);
+            _open = _sim.write(_path, std::nullopt) == 0;
+        }
+
+        std::ostream& get() override { return _discard; }
+        const std::ostream& get() const override { return _discard; }
+
+        bool write_int(int value) override { return apply(int_text(value)); }
+        bool write_string(std::string_view value) override { return apply(value); }
+
+    private:
+        bool apply(std::string_view text) {
+            int error = 0;
+            {
+                std::lock_guard<std::mutex> lock(_sim._mutex);
+                _sim.sync();
+                error = _sim.write(_path, text);
+            }
+            errno = error;
+            return error == 0;
+        }
+
+        const SimSystem &_sim;
+        std::string _path;
+        bool _open = false;
+        std::ostringstream _discard;
+};
+
+SimSystem::SimSystem(std::string sys_root) : _sys_root(std::move(sys_root)) {}
+
+SimSystem::~SimSystem() = default;
+
+std::unique_ptr<file_ostream> SimSystem::OpenForWrite(const std::string &path) const {
+    return std::make_unique<ostream>(*this, path);
+}
+
+std::unique_ptr<file_istream> SimSystem::OpenForRead(const std::string &path) const {
+    return std::make_unique<istream>(*this, path);
+}
+
+void SimSystem::System(const char *) const {}
+
+void SimSystem::ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const {
+    std::string_view d = dir;
+    while (!d.empty() && d.back() == '/')
+        d.remove_suffix(1);
+    if (d.substr(0, _sys_root.size()) != _sys_root)
+        return;
+    d.remove_prefix(_sys_root.size());
+
+    std::vector<std::string> names;
+    {
+        std::lock_guard<std::mutex> lock(_mutex);
+        if (d == "/tacho-motor") {
+            for (auto &m : _motors)
+                names.push_back(m->name);
+        } else if (d == "/lego-sensor") {
+            for (auto &s : _sensors)
+                names.push_back(s->name);
+        }
+    }
+
+    for (auto &name : names) {
+        if (!fileFound(name))
+            break;
+    }
+}
+
+std::size_t SimSystem::add_motor(const motor_config &config) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _motors.push_back(std::make_unique<sim_motor>(config, _motors.size()));
+    return _motors.size() - 1;
+}
+
+std::size_t SimSystem::add_sensor(const std::string &address, const std::string &driver_name) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sensors.push_back(std::make_unique<sim_sensor>(address, driver_name, _sensors.size()));
+    return _sensors.size() - 1;
+}
+
+void SimSystem::advance(std::chrono::nanoseconds time) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync();
+    run_for(time);
+}
+
+void SimSystem::follow_clock(double scale) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync();
+    _scale = scale;
+    _last_sync = std::chrono::steady_clock::now();
+}
+
+std::chrono::nanoseconds SimSystem::now() const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync();
+    return _now + _pending;
+}
+
+double SimSystem::shaft_position(std::size_t motor) const {
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync();
+    return _motors.at(motor)->x;
+}
+
+void SimSystem::set_touch(std::size_t sensor, bool pressed) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sensors.at(sensor)->pressed = pressed;
+}
+
+void SimSystem::set_color(std::size_t sensor, const color_reading &reading) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    _sensors.at(sensor)->color = reading;
+}
+
+void SimSystem::set_gyro_rate(std::size_t sensor, double degrees_per_second) {
+    std::lock_guard<std::mutex> lock(_mutex);
+    sync();
+    _sensors.at(sensor)->rate = degrees_per_second;
+}
+
+void SimSystem::sync() const {
+    if (_scale <= 0)
+        return;
+
+    const auto now = std::chrono::steady_clock::now();
+    run_for(std::chrono::duration_cast<std::chrono::nanoseconds>((now - _last_sync) * _scale));
+    _last_sync = now;
+}
+
+void SimSystem::run_for(std::chrono::nanoseconds time) const {
+    const double dt = sim_seconds(sim_step);
+    for (_pending += time; _pending >= sim_step; _pending -= sim_step) {
+        for (auto &m : _motors)
+            m->step(dt);
+        for (auto &s : _sensors)
+            s->angle += s->rate * dt;
+        _now += sim_step;
+    }
+}
+
+std::pair<SimSystem::sim_motor*, SimSystem::sim_sensor*> SimSystem::find(std::string_view path,
+        std::string_view &attribute) const {
+    // <sys root>/<class>/<device>/<attribute>
+    if (path.substr(0, _sys_root.size()) != _sys_root)
+        return {};
+    path.remove_prefix(_sys_root.size());
+
+    const auto slash = path.rfind('/');
+    if (slash == std::string_view::npos)
+        return {};
+    attribute = path.substr(slash + 1);
+    path = path.substr(0, slash);
+
+    const auto named = [&](auto &devices, std::string_view prefix) -> decltype(devices.front().get()) {
+        if (path.substr(0, prefix.size()) != prefix)
+            return nullptr;
+        const auto name = path.substr(prefix.size());
+        for (auto &d : devices) {
+            if (d->name == name)
+                return d.get();
+        }
+        return nullptr;
+    };
+    return {named(_motors, "/tacho-motor/"), named(_sensors, "/lego-sensor/")};
+}
+
+int SimSystem::read(const std::string &path, std::string &text) const {
+    std::string_view attribute;
+    const auto [m, s] = find(path, attribute);
+    if (m) {
+        const int error = m->read(attribute, text);
+        if (error == 0)
+            text.push_back('\n');
+        return error;
+    }
+    return s ? s->read(attribute, text) : ENOENT;
+}
+
+int SimSystem::write(const std::string &path, std::optional<std::string_view> value) const {
+    std::string_view attribute;
+    const auto [m, s] = find(path, attribute);
+    return m ? m->write(attribute, value) : s ? s->write(attribute, value) : ENOENT;
 }
 
 } // namespace ev3dev
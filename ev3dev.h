@@ -26,7 +26,9 @@
 
 #pragma once
 
+#include <array>
 #include <map>
+#include <deque>
 #include <set>
 #include <string>
 #include <tuple>
@@ -34,13 +36,33 @@
 #include <algorithm>
 #include <functional>
 #include <memory>
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <mutex>
+#include <shared_mutex>
+#include <condition_variable>
+#include <future>
+#include <exception>
+#include <unordered_map>
+#include <cstdint>
 #include <ostream>
 #include <istream>
 #include <cstring>
 #include <string_view>
+#include <optional>
+#include <type_traits>
+#include <system_error>
+
+#include <gsl/span>
+#include <outcome/outcome.hpp>
 
 namespace ev3dev {
 
+// Return type of the try_ accessors: the value or a std::error_code. Errors
+// carry no message, producing one never allocates.
+namespace outcome = OUTCOME_V2_NAMESPACE;
+
 //-----------------------------------------------------------------------------
 typedef std::string         device_type;
 typedef std::string         mode_type;
@@ -103,6 +125,21 @@ class file_istream {
         virtual std::istream& get() = 0;
         virtual const std::istream& get() const = 0;
 
+        // Read the whole attribute value in one go. The default implementations
+        // go through the stream returned by get(), backends that have direct
+        // access to the file may override them to bypass iostreams entirely.
+        virtual bool read_int(int &value) { return static_cast<bool>(get() >> value); }
+        virtual bool read_string(std::string &value) { return static_cast<bool>(get() >> value); }
+        virtual bool read_line(std::string &value) { return static_cast<bool>(std::getline(get(), value)); }
+        virtual std::size_t read(char *buf, std::size_t size) {
+            get().read(buf, static_cast<std::streamsize>(size));
+            return static_cast<std::size_t>(get().gcount());
+        }
+
+        // The file descriptor to poll() for POLLPRI, or -1 if the backend has
+        // none. Only valid after prepare().
+        virtual int native_handle() const noexcept { return -1; }
+
         virtual ~file_istream() = default;
 };
 
@@ -116,6 +153,10 @@ public:
     virtual std::ostream& get() = 0;
     virtual const std::ostream& get() const = 0;
 
+    // Write the whole attribute value in one go. See file_istream::read_int().
+    virtual bool write_int(int value) { return static_cast<bool>(get() << value); }
+    virtual bool write_string(std::string_view value) { return static_cast<bool>(get() << value); }
+
     virtual ~file_ostream() = default;
 };
 
@@ -129,27 +170,129 @@ public:
     constexpr auto c_str() const noexcept { return data(); }
 };
 
+class device_registry;
+
 class ISystem
 {
 public:
+    ISystem();
+    ISystem(const ISystem&) noexcept;
+    ISystem& operator=(const ISystem&) noexcept { return *this; }
+
     virtual std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const = 0;
     virtual std::unique_ptr<file_istream> OpenForRead(const std::string &path) const = 0;
+    // Opens `path` for device::watch(), which blocks in poll() on the
+    // stream's native_handle(). Same as OpenForRead() unless the backend's
+    // read streams have no descriptor but it can provide one.
+    virtual std::unique_ptr<file_istream> OpenForPoll(const std::string &path) const;
     virtual void System(const char *command) const = 0;
 
     virtual void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const = 0;
 
     virtual const std::string& get_sys_root() const = 0;
 
-    virtual ~ISystem() = default;
+    // The devices found on this system, shared by every device object created
+    // on it. Copies of a system get their own registry.
+    device_registry& registry() const;
+
+    virtual ~ISystem();
+
+private:
+    mutable std::once_flag _registry_once;
+    mutable std::unique_ptr<device_registry> _registry;
+};
+
+//-----------------------------------------------------------------------------
+// Every device class directory (tacho-motor, lego-sensor, ...) is listed once,
+// and the `address` and `driver_name` of each device in it are read once, on
+// first use. device::connect() then matches against the cached values and
+// looks up an address in O(1), so constructing many devices does not re-read
+// the same files over and over.
+//
+// A connect() checks the device it picks is still there, and drops it from
+// the registry if not. A connect() that finds nothing lists the directory
+// again and reads the devices that are new, so a device plugged in later is
+// still found; misses in a row do that at most every refresh_interval. Call
+// rescan() to drop everything explicitly. A device_watcher keeps the
+// registry up to date incrementally.
+class device_registry {
+    public:
+        struct entry {
+            std::string name;        // e.g. "motor0"
+            std::string path;        // class directory + name + '/'
+            std::string address;     // empty if the device has none
+            std::string driver_name; // empty if the device has none
+
+            // Bumped whenever the device is removed or added again. Connected
+            // devices hold on to it and drop their open files when it moves.
+            std::shared_ptr<std::atomic<unsigned>> epoch;
+        };
+
+        explicit device_registry(const ISystem &system) : _system(system) {}
+
+        device_registry(const device_registry&) = delete;
+        device_registry& operator=(const device_registry&) = delete;
+
+        // The devices in class directory `dir` whose name starts with `pattern`
+        // and whose cached attributes agree with `match`, in directory order.
+        // Attributes other than address and driver_name are not checked.
+        std::vector<entry> find(
+                const std::string &dir,
+                const std::string &pattern,
+                const std::map<std::string, std::set<std::string>> &match);
+
+        // Drops the cached scan of `dir`, or of every directory. The next
+        // find() lists the directory again.
+        void rescan(const std::string &dir);
+        void rescan();
+
+        // Lists `dir` again, reading only the devices not known yet, unless
+        // that was done less than refresh_interval ago. Returns whether it
+        // listed the directory.
+        static constexpr std::chrono::milliseconds refresh_interval{20};
+        bool refresh(const std::string &dir);
+
+        // Incremental updates for a single device `name` in class directory
+        // `dir`, see device_watcher. Directories not scanned yet are ignored.
+        void device_added(const std::string &dir, const std::string &name);
+        void device_removed(const std::string &dir, const std::string &name);
+
+        // Number of directory scans done so far.
+        unsigned scans() const;
+
+    private:
+        struct class_dir {
+            std::vector<entry> entries;
+            std::unordered_map<std::string, std::vector<std::size_t>> by_address;
+            std::unordered_map<std::string, std::vector<std::size_t>> by_driver;
+            bool stale = false;
+            std::chrono::steady_clock::time_point refreshed;
+
+            void reindex();
+        };
+
+        const class_dir& scan(const std::string &dir);
+        entry read_entry(const std::string &dir, const std::string &name);
+
+        const ISystem &_system;
+        mutable std::mutex _mutex;
+        std::map<std::string, class_dir> _dirs;
+        // Epochs of every device seen so far, by path, so a device object
+        // keeps getting notified across rescans and replugs.
+        std::map<std::string, std::shared_ptr<std::atomic<unsigned>>> _epochs;
+        unsigned _scans = 0;
 };
 
 class RealSystem : public ISystem
 {
 public:
     RealSystem();
+    explicit RealSystem(std::string sys_root);
 
     std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
     std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+    // A raw descriptor, ifstreams have none to poll.
+    std::unique_ptr<file_istream> OpenForPoll(const std::string &path) const override;
     void System(const char *command) const override;
     void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const override;
     const std::string &get_sys_root() const override;
@@ -158,11 +301,277 @@ private:
     std::string _sys_root;
 };
 
+// Same as RealSystem, but keeps every attribute open as a raw file descriptor.
+// Reads are a single pread() at offset 0 followed by std::from_chars(), writes
+// are a single pwrite(). No iostream or locale machinery is involved, which
+// matters a lot on the 300 MHz ARM9 of the EV3.
+class FdSystem : public RealSystem
+{
+public:
+    using RealSystem::RealSystem;
+
+    std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+};
+
+// Wraps another system and measures the attribute I/O made through it. For
+// every path it counts opens, reads and writes, the bytes moved and the
+// failures, and keeps a latency histogram of each. Opening a path that was
+// opened before (the stream table evicted it, the device reconnected or a
+// stale handle was retried) also counts as a reopen, i.e. a cache miss.
+//
+//     ev3dev::InstrumentedSystem sys{ev3dev::default_system};
+//     ev3dev::large_motor m{ev3dev::OUTPUT_A, sys};
+//     ...
+//     sys.dump(std::cout);
+//
+// An access costs two clock reads and a few relaxed atomic increments more.
+// Reads and writes take no lock. Opens look up the path's counters under a
+// shared lock, only the first open of a path takes it exclusively. The time
+// a read spends rewinding the file is part of the read, the time of the
+// first prepare() part of the open.
+class InstrumentedSystem : public ISystem
+{
+public:
+    enum class op { open_read, open_write, read, write };
+    static constexpr std::size_t op_count = 4;
+
+    // Bucket i counts the operations that took [2^i, 2^(i+1)) ns, the first
+    // and last buckets also take everything below and above.
+    static constexpr std::size_t histogram_buckets = 32;
+
+    struct op_stats {
+        std::uint64_t count = 0;
+        std::uint64_t errors = 0;
+        std::uint64_t bytes = 0;
+        std::chrono::nanoseconds total{0};
+        std::chrono::nanoseconds max{0};
+        std::array<std::uint64_t, histogram_buckets> histogram{};
+
+        // Upper bound of the bucket that holds the p-th fraction of the
+        // operations, for 0 < p <= 1.
+        std::chrono::nanoseconds percentile(double p) const noexcept;
+    };
+
+    struct path_stats {
+        std::string path;
+        std::array<op_stats, op_count> ops;
+        std::uint64_t reopens = 0;
+
+        const op_stats& operator[](op o) const noexcept { return ops[static_cast<std::size_t>(o)]; }
+        std::chrono::nanoseconds total() const noexcept;
+    };
+
+    enum class format { text, json };
+
+    explicit InstrumentedSystem(const ISystem &inner);
+    // Writes the file requested by dump_at_exit().
+    ~InstrumentedSystem() override;
+
+    std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForPoll(const std::string &path) const override;
+    void System(const char *command) const override { _inner.System(command); }
+    void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const override {
+        _inner.ListFiles(dir, fileFound);
+    }
+    const std::string &get_sys_root() const override { return _inner.get_sys_root(); }
+
+    // The numbers so far, the path with the most time spent first.
+    std::vector<path_stats> stats() const;
+    void reset();
+
+    void dump(std::ostream &os, format f = format::text) const;
+    void dump_at_exit(std::string file, format f = format::text);
+
+private:
+    struct counters;
+    class istream;
+    class ostream;
+
+    counters& counters_for(const std::string &path) const;
+    std::unique_ptr<file_istream> open_read(const std::string &path, bool for_poll) const;
+
+    const ISystem &_inner;
+    // Exclusive only to add a path.
+    mutable std::shared_mutex _mutex;
+    // Never shrinks, open streams point into it.
+    mutable std::map<std::string, std::unique_ptr<counters>, std::less<>> _paths;
+    std::string _dump_file;
+    format _dump_format = format::text;
+};
+
+// Records the attribute I/O made through another system into a compact
+// binary file: every open, read and write with its result, every System()
+// call and every directory listing, each with a monotonic timestamp. A
+// ReplaySystem plays the file back without hardware:
+//
+//     // On the brick.
+//     ev3dev::RecordingSystem sys{ev3dev::default_system, "session.ev3rec"};
+//
+//     // On a dev box, wrapped in an InstrumentedSystem to count the I/O.
+//     ev3dev::ReplaySystem sys{"session.ev3rec"};
+//
+// The file is written as it goes and completed on destruction.
+class RecordingSystem : public ISystem
+{
+public:
+    RecordingSystem(const ISystem &inner, const std::string &file);
+    ~RecordingSystem() override;
+
+    std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForPoll(const std::string &path) const override;
+    void System(const char *command) const override;
+    void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const override;
+    const std::string &get_sys_root() const override { return _inner.get_sys_root(); }
+
+    // Number of events recorded so far.
+    std::uint64_t events() const;
+    // Writes out the buffered events.
+    void flush();
+
+private:
+    struct log;
+    class istream;
+    class ostream;
+
+    const ISystem &_inner;
+    std::unique_ptr<log> _log;
+};
+
+// Plays back a file written by RecordingSystem at full speed. Reads return
+// the recorded results, writes and System() calls are compared with the
+// recorded ones. Each path is replayed in its own recorded order, so the
+// interleaving of threads or devices need not match the recording. A read
+// past the end of the recording fails, like an unplugged device.
+class ReplaySystem : public ISystem
+{
+public:
+    explicit ReplaySystem(const std::string &file);
+    ~ReplaySystem() override;
+
+    std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
+    std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+    void System(const char *command) const override;
+    void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const override;
+    const std::string &get_sys_root() const override;
+
+    struct report {
+        std::uint64_t reads = 0;
+        std::uint64_t writes = 0;
+        std::uint64_t system_calls = 0;
+        // Reads that the recording had no result for.
+        std::uint64_t missing_reads = 0;
+        // Writes and System() calls that differ from the recording, or that
+        // the recording does not have.
+        std::uint64_t mismatches = 0;
+        // Descriptions of the first few mismatches.
+        std::vector<std::string> details;
+
+        bool ok() const noexcept { return missing_reads == 0 && mismatches == 0; }
+    };
+
+    report result() const;
+    // Recorded writes and System() calls that were not replayed.
+    std::uint64_t unreplayed() const;
+    // Time between the first and the last recorded event.
+    std::chrono::nanoseconds recorded_duration() const;
+
+private:
+    struct recording;
+    class istream;
+    class ostream;
+
+    std::unique_ptr<recording> _rec;
+};
+
 extern RealSystem default_system;
 
+//-----------------------------------------------------------------------------
+// Watches the device class directories for devices being plugged in and
+// unplugged. Every change updates the registry of the system, makes
+// connected device objects for that device drop their open files (so the
+// next access fails right away or, after a replug, reopens) and is passed on
+// to the subscribers.
+//
+// By default the watcher listens to the kernel's uevent netlink broadcasts,
+// which is what works on the brick: sysfs itself raises no inotify events.
+// The inotify source works on any other file system, pass it to watch a
+// fake sysfs tree.
+//
+// Nothing happens behind your back: call dispatch() from your own loop
+// (native_handle() can go into a poll set), or start() a background thread.
+class device_watcher {
+    public:
+        enum class source { inotify, uevent };
+
+        struct event {
+            enum kind_type { added, removed };
+
+            kind_type   kind;
+            std::string class_dir; // e.g. "<sys root>/tacho-motor/"
+            std::string name;      // e.g. "motor0"
+        };
+
+        using callback = std::function<void(const event&)>;
+
+        explicit device_watcher(const ISystem &system = default_system, source src = source::uevent);
+        ~device_watcher();
+
+        device_watcher(const device_watcher&) = delete;
+        device_watcher& operator=(const device_watcher&) = delete;
+
+        // Returns an id for unsubscribe(). Callbacks run on the thread that
+        // dispatches.
+        unsigned subscribe(callback cb);
+        void unsubscribe(unsigned id);
+
+        // Handles the pending events, waiting up to `timeout` for the first
+        // one. Returns the number of device events handled.
+        unsigned dispatch(std::chrono::milliseconds timeout = std::chrono::milliseconds{0});
+
+        // Runs dispatch() on a background thread until stop().
+        void start();
+        void stop();
+
+        int native_handle() const noexcept { return _fd; }
+
+    private:
+        void handle(const event &e);
+        unsigned read_inotify();
+        unsigned read_uevent();
+
+        const ISystem &_system;
+        source _source;
+        int _fd = -1;
+        int _wake_fd = -1;
+        std::map<int, std::string> _watches; // inotify watch -> class directory
+
+        std::mutex _subscribers_mutex;
+        std::vector<std::pair<unsigned, callback>> _subscribers;
+        unsigned _next_id = 1;
+
+        std::atomic<bool> _stop{false};
+        std::thread _thread;
+};
+
 
 //-----------------------------------------------------------------------------
 // Generic device class.
+//
+// Threads: device objects share no locks with each other, so threads that
+// work on different devices (a motor control loop and a sensor loop, say)
+// run in parallel on as many cores as there are. The only shared state is
+// the ISystem's device registry, which connect() locks briefly.
+//
+// One device may be used from several threads as well. Every attribute
+// handle has a lock of its own, so reading `position` and `speed` of one
+// motor from two threads does not contend. The by-name accessors share the
+// device's stream table lock, the constant and shadow write caches have one
+// each, and a sensor serializes everything that depends on its mode. What
+// needs exclusive access: connect() and assignment, and the buffer returned
+// by sensor::bin_data(), which every call refills.
 //-----------------------------------------------------------------------------
 class device {
     public:
@@ -174,8 +583,12 @@ class device {
 
         inline bool connected() const { return !_path.empty(); }
 
+        // Directory of the connected device, ends with '/'. Empty if not connected.
+        const std::string& path() const noexcept { return _path; }
+
         int         device_index() const;
 
+        // These throw std::system_error naming the attribute's path.
         int         get_attr_int   (const std::string &name) const;
         void        set_attr_int   (const std::string &name,
                 int value);
@@ -184,17 +597,264 @@ class device {
                 const std::string &value);
 
         std::string get_attr_line  (const std::string &name) const;
+
+        // The same without exceptions. Errors are errc::function_not_supported
+        // when no device is connected, errc::no_such_device when the attribute
+        // cannot be read, or the errno of a failed write.
+        outcome::result<int>         try_get_attr_int   (const std::string &name) const;
+        outcome::result<void>        try_set_attr_int   (const std::string &name,
+                int value);
+        outcome::result<std::string> try_get_attr_string(const std::string &name) const;
+        outcome::result<void>        try_set_attr_string(const std::string &name,
+                const std::string &value);
+        outcome::result<std::string> try_get_attr_line  (const std::string &name) const;
         mode_set    get_attr_set   (const std::string &name,
                 std::string *pCur = nullptr) const;
 
         std::string get_attr_from_set(const std::string &name) const;
 
+        // For attributes that cannot change while the device stays connected
+        // (driver_name, commands, max_speed, ...): read on first use and kept
+        // in memory until the next connect(). address and driver_name come
+        // for free from the registry. Values are copied out of the cache under
+        // its lock, so they stay valid whatever other threads do.
+        int                get_attr_const_int   (const char *name) const;
+        std::string        get_attr_const_string(const char *name) const;
+        mode_set           get_attr_const_set   (const char *name) const;
+
+        // Re-reads attribute `name` and calls `pred` with its first line until
+        // `pred` returns true or `timeout` passes (a negative timeout waits
+        // forever). Returns whether `pred` was satisfied.
+        //
+        // Between reads the thread blocks in poll() for POLLPRI, which the
+        // kernel raises on sysfs_notify(), so attributes like a motor's
+        // `state` wake it up within microseconds. Attributes that are never
+        // notified are re-read at an interval that starts at 1 ms after every
+        // change and doubles up to 10 ms while nothing happens. The file is
+        // opened with ISystem::OpenForPoll(), backends that give it no file
+        // descriptor only use the interval.
+        bool watch(const std::string &name, const std::function<bool(const std::string&)> &pred,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds{-1}) const;
+
+        // Counters of the stream table behind the by-name accessors above.
+        struct stream_cache_stats {
+            std::uint64_t hits = 0;
+            std::uint64_t misses = 0;
+            std::uint64_t evictions = 0;
+        };
+
+        stream_cache_stats cache_stats() const;
+
+        // Shadow writes: while on, the device remembers the last value written
+        // successfully to each attribute and drops writes of the same value,
+        // like a stop_action or speed_sp set again before every move. Off by
+        // default because the kernel can change some attributes on its own
+        // (an LED trigger changes `brightness`); call forget_writes() after
+        // such a change. Writes to `command`, `position` and `set_device`
+        // always go through. A reconnect, a `reset` command or a failed write
+        // forgets the remembered values.
+        void set_shadow_writes(bool on);
+        bool shadow_writes() const;
+        void forget_writes();
+
+        // Number of writes dropped by shadow writes.
+        std::uint64_t elided_writes() const;
+
+        // A pre-resolved handle to one attribute of a device. The full path is
+        // built and the file is opened on first use after connect(), after that
+        // every access goes straight to the open file: no string building and
+        // no cache lookup, only the handle's own lock, which no other handle
+        // shares. A reconnect rebinds the handle. Copies are unbound, they
+        // never share the open file with the original.
+        //
+        // T is one of int, std::string (a single word) or mode_set.
+        template <typename T>
+        class attribute {
+            public:
+                using value_arg = std::conditional_t<std::is_same_v<T, int>, int, std::string_view>;
+
+                explicit attribute(const char *name) noexcept : _name(name) {}
+                attribute(const attribute &other) noexcept : _name(other._name) {}
+                attribute& operator=(const attribute &other) noexcept {
+                    if (this != &other) {
+                        std::lock_guard<std::mutex> lock(_mutex);
+                        _name = other._name;
+                        _generation = 0;
+                        _in.reset();
+                        _out.reset();
+                    }
+                    return *this;
+                }
+
+                const char* name() const noexcept { return _name; }
+
+                T    get(const device &d) const;
+                void set(device &d, value_arg value);
+
+                // Raw read of the attribute contents, returns the number of bytes read.
+                std::size_t read(const device &d, char *buf, std::size_t size) const;
+
+                // Exception-free variants of the above, see try_get_attr_int().
+                outcome::result<T>           try_get(const device &d) const;
+                outcome::result<void>        try_set(device &d, value_arg value);
+                outcome::result<std::size_t> try_read(const device &d, char *buf, std::size_t size) const;
+
+                // Drops the open files, the next access reopens them.
+                void close() const noexcept;
+
+            private:
+                std::error_code bind(const device &d) const;
+                file_istream& input(const device &d) const;
+                file_ostream& output(const device &d) const;
+
+                const char *_name;
+                // Held for every access, so one handle is never used by two
+                // threads at once while different handles never contend.
+                mutable std::mutex _mutex;
+                mutable unsigned _generation = 0;
+                mutable std::string _path;
+                mutable std::unique_ptr<file_istream> _in;
+                mutable std::unique_ptr<file_ostream> _out;
+        };
+
     protected:
+        // A mutex that leaves the class holding it copyable, a copy gets a
+        // lock of its own.
+        template <typename Mutex>
+        struct copyable_mutex : Mutex {
+            copyable_mutex() = default;
+            copyable_mutex(const copyable_mutex &) noexcept {}
+            copyable_mutex& operator=(const copyable_mutex &) noexcept { return *this; }
+        };
+
+        // _generation plus hotplug events seen for the connected device.
+        unsigned generation() const noexcept {
+            return _generation + (_hotplug ? _hotplug->load(std::memory_order_acquire) - _hotplug_base : 0);
+        }
+
+        // Open files of the by-name accessors, keyed by attribute name. Every
+        // device owns its table and lock, so threads working on different
+        // devices never contend. A table holds at most FSTREAM_CACHE_SIZE
+        // entries (default 32, enough for every attribute of a tacho motor),
+        // the least recently used one is closed to make room. Copies start out
+        // empty.
+        class stream_table {
+            public:
+                stream_table() = default;
+                stream_table(const stream_table &) noexcept {}
+                stream_table& operator=(const stream_table &) noexcept;
+
+                template <typename F>
+                auto with_input(const device &d, const std::string &name, F &&f) const;
+                template <typename F>
+                auto with_output(const device &d, const std::string &name, F &&f) const;
+
+                stream_cache_stats stats() const;
+
+            private:
+                struct entry {
+                    std::string path;
+                    std::unique_ptr<file_istream> in;
+                    std::unique_ptr<file_ostream> out;
+                    std::uint64_t last_use = 0;
+                };
+
+                entry& find(const device &d, const std::string &name) const;
+
+                mutable std::mutex _mutex;
+                mutable std::unordered_map<std::string, entry> _entries;
+                mutable unsigned _generation = 0;
+                mutable std::uint64_t _tick = 0;
+                mutable stream_cache_stats _stats;
+        };
+
+        // Values of the get_attr_const_* attributes for one connection.
+        struct constant_cache {
+            constant_cache() = default;
+            constant_cache(const constant_cache &other);
+
+            mutable std::mutex mutex;
+            unsigned generation = 0;
+            std::map<std::string, int, std::less<>>         ints;
+            std::map<std::string, std::string, std::less<>> strings;
+            std::map<std::string, mode_set, std::less<>>    sets;
+
+            // Empties the cache if it belongs to another connection.
+            void sync(unsigned current);
+        };
+
+        // Last written value of every attribute, see set_shadow_writes().
+        struct shadow_cache {
+            shadow_cache() = default;
+            shadow_cache(const shadow_cache &other);
+
+            mutable std::mutex mutex;
+            std::atomic<bool> enabled{false};
+            unsigned generation = 0;
+            std::uint64_t elided = 0;
+            std::map<std::string, std::string, std::less<>> values;
+        };
+
+        // Calls `write` unless shadow writes are on and `text` is the last
+        // value written to `name`. Returns the error code of `write`.
+        template <typename F>
+        std::error_code write_through(std::string_view name, std::string_view text, F &&write);
+
         std::string _path;
-        mutable int _device_index = -1;
+        mutable constant_cache _constants;
+        shadow_cache _shadow;
+        // Bumped whenever _path changes in connect(), tells attribute handles
+        // and the stream table to drop their open files.
+        unsigned _generation = 0;
+        std::shared_ptr<const std::atomic<unsigned>> _hotplug;
+        unsigned _hotplug_base = 0;
+        stream_table _streams;
         const ISystem& _system;
 };
 
+extern template class device::attribute<int>;
+extern template class device::attribute<std::string>;
+extern template class device::attribute<mode_set>;
+
+//-----------------------------------------------------------------------------
+// The value formats of sensor::bin_data, see sensor::bin_data_format().
+enum class bin_format {
+    unknown,
+    u8,
+    s8,
+    u16,
+    s16,
+    s16_be,
+    s32,
+    float32
+};
+
+bin_format  parse_bin_format(std::string_view name) noexcept;
+
+// Size of one value in bytes, 0 for bin_format::unknown.
+std::size_t bin_format_size(bin_format format) noexcept;
+
+// Decodes values of `format` from `raw` into `out`, as many as both spans
+// hold, and returns the decoded prefix of `out`. `raw` may hold many samples
+// back to back, e.g. a log of bin_data reads. Multi-byte values are in host
+// byte order except for s16_be.
+template <typename T>
+gsl::span<T> decode_bin_data(bin_format format, gsl::span<const char> raw, gsl::span<T> out) noexcept;
+
+// Like decode_bin_data<float>(), but also multiplies every value by `scale`
+// (sensor::float_value() uses 10^-decimals). The loops are kept simple so the
+// compiler vectorizes them, use this to convert large logs.
+gsl::span<float> decode_bin_data(bin_format format, gsl::span<const char> raw, gsl::span<float> out,
+        float scale) noexcept;
+
+extern template gsl::span<int8_t>   decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int8_t>) noexcept;
+extern template gsl::span<uint8_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<uint8_t>) noexcept;
+extern template gsl::span<int16_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int16_t>) noexcept;
+extern template gsl::span<uint16_t> decode_bin_data(bin_format, gsl::span<const char>, gsl::span<uint16_t>) noexcept;
+extern template gsl::span<int32_t>  decode_bin_data(bin_format, gsl::span<const char>, gsl::span<int32_t>) noexcept;
+extern template gsl::span<float>    decode_bin_data(bin_format, gsl::span<const char>, gsl::span<float>) noexcept;
+extern template gsl::span<double>   decode_bin_data(bin_format, gsl::span<const char>, gsl::span<double>) noexcept;
+
 //-----------------------------------------------------------------------------
 // The sensor class provides a uniform interface for using most of the
 // sensors available for the EV3. The various underlying device drivers will
@@ -232,17 +892,54 @@ class sensor : protected device {
         sensor(address_type, const std::set<sensor_type>&, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
         using device::device_index;
 
         // Returns the value or values measured by the sensor. Check `num_values` to
         // see how many values there are. Values with index >= num_values will return
         // an error. The values are fixed point numbers, so check `decimals` to see
         // if you need to divide to get the actual value.
+        //
+        // `num_values`, `decimals`, `bin_data_format` and `units` only change with
+        // the mode, so they are read once per mode and cached until the next
+        // set_mode() that actually switches modes. A sample then costs a single
+        // read of `value<N>`.
         int   value(unsigned index=0) const;
 
+        // value() without exceptions, see device::try_get_attr_int(). An index
+        // beyond num_values() gives errc::invalid_argument.
+        outcome::result<int> try_value(unsigned index=0) const;
+
         // The value converted to float using `decimals`.
         float float_value(unsigned index=0) const;
 
+        // All values of the current mode, read together.
+        static constexpr unsigned max_values = 8;
+
+        struct value_snapshot {
+            std::array<int, max_values> value{};
+            unsigned count = 0;
+
+            unsigned size() const noexcept { return count; }
+            const int* begin() const noexcept { return value.data(); }
+            const int* end() const noexcept { return value.data() + count; }
+            int operator[](unsigned index) const noexcept { return value[index]; }
+
+            // Throws std::invalid_argument for index >= count, like value().
+            int at(unsigned index) const;
+        };
+
+        // Returns all `value<N>` of the current mode as one coherent sample.
+        // When `bin_data_format` is an integer format this is a single read
+        // of `bin_data`, otherwise each `value<N>` is read in turn.
+        value_snapshot values() const;
+
         // Human-readable name of the connected sensor.
         std::string type_name() const;
 
@@ -257,7 +954,10 @@ class sensor : protected device {
         //    - `s16_be`: Signed 16-bit integer, big endian
         //    - `s32`: Signed 32-bit integer (int)
         //    - `float`: IEEE 754 32-bit floating point (float)
-        std::string bin_data_format() const { return get_attr_string("bin_data_format"); };
+        std::string bin_data_format() const {
+            std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+            return mode_info().bin_data_format;
+        }
 
         // Bin Data: read-only
         // Returns the unscaled raw values in the `value<N>` attributes as raw byte
@@ -271,68 +971,147 @@ class sensor : protected device {
         // individual sensor documentation to determine how to interpret the data.
         template <class T>
             void bin_data(T *buf) const {
+                std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
                 bin_data(); // fills _bin_data
                 std::copy_n(_bin_data.data(), _bin_data.size(), reinterpret_cast<char*>(buf));
             }
 
+        // Bin Data: read-only
+        // Reads `bin_data` and decodes up to `out.size()` values of the current
+        // mode into `out`, returns the decoded values. When T is exactly the
+        // format's type (e.g. int16_t for `s16`) the data is read straight into
+        // `out` without a copy. Throws for formats other than the ones listed
+        // in bin_data_format().
+        template <typename T>
+        gsl::span<T> bin_values(gsl::span<T> out) const;
+
         // Address: read-only
         // Returns the name of the port that the sensor is connected to, e.g. `ev3:in1`.
         // I2C sensors also include the I2C address (decimal), e.g. `ev3:in1:i2c8`.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_const_string("address"); }
 
         // Command: write-only
         // Sends a command to the sensor.
         sensor& set_command(std::string v) {
-            set_attr_string("command", v);
+            _attr.command.set(*this, v);
             return *this;
         }
 
         // Commands: read-only
         // Returns a list of the valid commands for the sensor.
         // Returns -EOPNOTSUPP if no commands are supported.
-        mode_set commands() const { return get_attr_set("commands"); }
+        mode_set commands() const { return get_attr_const_set("commands"); }
 
         // Decimals: read-only
         // Returns the number of decimal places for the values in the `value<N>`
         // attributes of the current mode.
-        int decimals() const { return get_attr_int("decimals"); }
+        int decimals() const {
+            std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+            return mode_info().decimals;
+        }
 
         // Driver Name: read-only
         // Returns the name of the sensor device/driver. See the list of [supported
         // sensors] for a complete list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_const_string("driver_name"); }
 
         // Mode: read/write
         // Returns the current mode. Writing one of the values returned by `modes`
         // sets the sensor to that mode.
-        std::string mode() const { return get_attr_string("mode"); }
-        sensor& set_mode(std::string v) {
-            set_attr_string("mode", v);
-            return *this;
-        }
+        //
+        // The sensor remembers the last mode it wrote or read, and set_mode()
+        // skips the write when the mode is unchanged. The remembered mode is
+        // dropped on reconnect and on any failed read or write. Call mode() to
+        // pick up a mode changed from outside this object.
+        std::string mode() const;
+        sensor& set_mode(std::string v);
 
         // Modes: read-only
         // Returns a list of the valid modes for the sensor.
-        mode_set modes() const { return get_attr_set("modes"); }
+        mode_set modes() const { return get_attr_const_set("modes"); }
 
         // Num Values: read-only
         // Returns the number of `value<N>` attributes that will return a valid value
         // for the current mode.
-        int num_values() const { return get_attr_int("num_values"); }
+        int num_values() const {
+            std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+            return mode_info().num_values;
+        }
 
         // Units: read-only
         // Returns the units of the measured value for the current mode. May return
         // empty string
-        std::string units() const { return get_attr_string("units"); }
+        std::string units() const {
+            std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+            return mode_info().units;
+        }
 
     protected:
         sensor(const ISystem& system) : device{system} {}
 
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
 
+        // Handles for the attributes read on every sample.
+        struct attributes {
+            attribute<std::string> bin_data{"bin_data"};
+            attribute<std::string> bin_data_format{"bin_data_format"};
+            attribute<std::string> command{"command"};
+            attribute<int>         decimals{"decimals"};
+            attribute<std::string> mode{"mode"};
+            attribute<int>         num_values{"num_values"};
+            attribute<std::string> units{"units"};
+            attribute<int>         value[8] = {
+                attribute<int>{"value0"}, attribute<int>{"value1"},
+                attribute<int>{"value2"}, attribute<int>{"value3"},
+                attribute<int>{"value4"}, attribute<int>{"value5"},
+                attribute<int>{"value6"}, attribute<int>{"value7"}
+            };
+        };
+
+        attributes _attr;
+
+        // The attributes that depend on the current mode.
+        struct mode_metadata {
+            int         num_values = 0;
+            int         decimals = 0;
+            float       scale = 1.0f; // 10^-decimals
+            bin_format  format = bin_format::unknown;
+            std::string bin_data_format;
+            std::string units;
+        };
+
+        // Reads the metadata on first use after a mode change or reconnect.
+        // Hold _mode_mutex while using the result.
+        const mode_metadata& mode_info() const;
+        outcome::result<const mode_metadata*> try_mode_info() const;
+
+        // The last mode written or read, valid while _mode_generation matches
+        // generation(). The metadata follows the same rule. _mode_mutex guards
+        // both and _bin_data, it is recursive because the public accessors
+        // build on each other.
+        void forget_mode() const noexcept {
+            std::lock_guard<std::recursive_mutex> lock(_mode_mutex);
+            _mode.clear();
+            _mode_info_valid = false;
+        }
+        mutable copyable_mutex<std::recursive_mutex> _mode_mutex;
+        mutable std::string _mode;
+        mutable unsigned _mode_generation = 0;
+        mutable mode_metadata _mode_info;
+        mutable unsigned _mode_info_generation = 0;
+        mutable bool _mode_info_valid = false;
+
         mutable std::vector<char> _bin_data;
 };
 
+extern template gsl::span<int8_t>   sensor::bin_values(gsl::span<int8_t>) const;
+extern template gsl::span<uint8_t>  sensor::bin_values(gsl::span<uint8_t>) const;
+extern template gsl::span<int16_t>  sensor::bin_values(gsl::span<int16_t>) const;
+extern template gsl::span<uint16_t> sensor::bin_values(gsl::span<uint16_t>) const;
+extern template gsl::span<int32_t>  sensor::bin_values(gsl::span<int32_t>) const;
+extern template gsl::span<float>    sensor::bin_values(gsl::span<float>) const;
+extern template gsl::span<double>   sensor::bin_values(gsl::span<double>) const;
+
 //-----------------------------------------------------------------------------
 // A generic interface to control I2C-type EV3 sensors.
 //-----------------------------------------------------------------------------
@@ -346,7 +1125,7 @@ class i2c_sensor : public sensor {
         // FW Version: read-only
         // Returns the firmware version of the sensor if available. Currently only
         // I2C/NXT sensors support this.
-        std::string fw_version() const { return get_attr_string("fw_version"); }
+        std::string fw_version() const { return get_attr_const_string("fw_version"); }
 
         // Poll MS: read/write
         // Returns the polling period of the sensor in milliseconds. Writing sets the
@@ -457,7 +1236,8 @@ class color_sensor : public sensor {
         // Red, green, and blue components of the detected color, in the range 0-1020.
         std::tuple<int, int, int> raw(bool do_set_mode = true) {
             if (do_set_mode) set_mode(mode_rgb_raw);
-            return std::make_tuple( value(0), value(1), value(2) );
+            const auto v = values();
+            return std::make_tuple( v.at(0), v.at(1), v.at(2) );
         }
 
         // Red component of the detected color, in the range 0-1020.
@@ -568,7 +1348,8 @@ class gyro_sensor : public sensor {
         // Angle (degrees) and Rotational Speed (degrees/second).
         std::tuple<int, int> rate_and_angle(bool do_set_mode = true) {
             if (do_set_mode) set_mode(mode_gyro_g_a);
-            return std::make_tuple( value(0), value(1) );
+            const auto v = values();
+            return std::make_tuple( v.at(0), v.at(1) );
         }
 };
 
@@ -685,6 +1466,13 @@ class motor : protected device {
         static constexpr char motor_nxt[] = "lego-nxt-motor";
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
         using device::device_index;
 
         // Run the motor until another command is sent.
@@ -746,6 +1534,13 @@ class motor : protected device {
         // The motor is not turning when it should be.
         static constexpr char state_stalled[] = "stalled";
 
+        // The states above as bits of state_flags().
+        static constexpr uint8_t flag_running    = 0x01;
+        static constexpr uint8_t flag_ramping    = 0x02;
+        static constexpr uint8_t flag_holding    = 0x04;
+        static constexpr uint8_t flag_overloaded = 0x08;
+        static constexpr uint8_t flag_stalled    = 0x10;
+
         // Power will be removed from the motor and it will freely coast to a stop.
         static constexpr char stop_action_coast[] = "coast";
 
@@ -762,13 +1557,13 @@ class motor : protected device {
 
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_const_string("address"); }
 
         // Command: write-only
         // Sends a command to the motor controller. See `commands` for a list of
         // possible values.
         motor& set_command(std::string v) {
-            set_attr_string("command", v);
+            _attr.command.set(*this, v);
             return *this;
         }
 
@@ -792,36 +1587,36 @@ class motor : protected device {
         //   action specified by `stop_action`.
         // - `reset` will reset all of the motor parameter attributes to their default value.
         //   This will also have the effect of stopping the motor.
-        mode_set commands() const { return get_attr_set("commands"); }
+        mode_set commands() const { return get_attr_const_set("commands"); }
 
         // Count Per Rot: read-only
         // Returns the number of tacho counts in one rotation of the motor. Tacho counts
         // are used by the position and speed attributes, so you can use this value
         // to convert rotations or degrees to tacho counts. (rotation motors only)
-        int count_per_rot() const { return get_attr_int("count_per_rot"); }
+        int count_per_rot() const { return get_attr_const_int("count_per_rot"); }
 
         // Count Per M: read-only
         // Returns the number of tacho counts in one meter of travel of the motor. Tacho
         // counts are used by the position and speed attributes, so you can use this
         // value to convert from distance to tacho counts. (linear motors only)
-        int count_per_m() const { return get_attr_int("count_per_m"); }
+        int count_per_m() const { return get_attr_const_int("count_per_m"); }
 
         // Driver Name: read-only
         // Returns the name of the driver that provides this tacho motor device.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_const_string("driver_name"); }
 
         // Duty Cycle: read-only
         // Returns the current duty cycle of the motor. Units are percent. Values
         // are -100 to 100.
-        int duty_cycle() const { return get_attr_int("duty_cycle"); }
+        int duty_cycle() const { return _attr.duty_cycle.get(*this); }
 
         // Duty Cycle SP: read/write
         // Writing sets the duty cycle setpoint. Reading returns the current value.
         // Units are in percent. Valid values are -100 to 100. A negative value causes
         // the motor to rotate in reverse.
-        int duty_cycle_sp() const { return get_attr_int("duty_cycle_sp"); }
+        int duty_cycle_sp() const { return _attr.duty_cycle_sp.get(*this); }
         motor& set_duty_cycle_sp(int v) {
-            set_attr_int("duty_cycle_sp", v);
+            _attr.duty_cycle_sp.set(*this, v);
             return *this;
         }
 
@@ -829,16 +1624,16 @@ class motor : protected device {
         // Returns the number of tacho counts in the full travel of the motor. When
         // combined with the `count_per_m` atribute, you can use this value to
         // calculate the maximum travel distance of the motor. (linear motors only)
-        int full_travel_count() const { return get_attr_int("full_travel_count"); }
+        int full_travel_count() const { return get_attr_const_int("full_travel_count"); }
 
         // Polarity: read/write
         // Sets the polarity of the motor. With `normal` polarity, a positive duty
         // cycle will cause the motor to rotate clockwise. With `inversed` polarity,
         // a positive duty cycle will cause the motor to rotate counter-clockwise.
         // Valid values are `normal` and `inversed`.
-        std::string polarity() const { return get_attr_string("polarity"); }
+        std::string polarity() const { return _attr.polarity.get(*this); }
         motor& set_polarity(std::string v) {
-            set_attr_string("polarity", v);
+            _attr.polarity.set(*this, v);
             return *this;
         }
 
@@ -847,33 +1642,33 @@ class motor : protected device {
         // encoder. When the motor rotates clockwise, the position will increase.
         // Likewise, rotating counter-clockwise causes the position to decrease.
         // Writing will set the position to that value.
-        int position() const { return get_attr_int("position"); }
+        int position() const { return _attr.position.get(*this); }
         motor& set_position(int v) {
-            set_attr_int("position", v);
+            _attr.position.set(*this, v);
             return *this;
         }
 
         // Position P: read/write
         // The proportional constant for the position PID.
-        int position_p() const { return get_attr_int("hold_pid/Kp"); }
+        int position_p() const { return _attr.position_p.get(*this); }
         motor& set_position_p(int v) {
-            set_attr_int("hold_pid/Kp", v);
+            _attr.position_p.set(*this, v);
             return *this;
         }
 
         // Position I: read/write
         // The integral constant for the position PID.
-        int position_i() const { return get_attr_int("hold_pid/Ki"); }
+        int position_i() const { return _attr.position_i.get(*this); }
         motor& set_position_i(int v) {
-            set_attr_int("hold_pid/Ki", v);
+            _attr.position_i.set(*this, v);
             return *this;
         }
 
         // Position D: read/write
         // The derivative constant for the position PID.
-        int position_d() const { return get_attr_int("hold_pid/Kd"); }
+        int position_d() const { return _attr.position_d.get(*this); }
         motor& set_position_d(int v) {
-            set_attr_int("hold_pid/Kd", v);
+            _attr.position_d.set(*this, v);
             return *this;
         }
 
@@ -882,9 +1677,9 @@ class motor : protected device {
         // commands. Reading returns the current value. Units are in tacho counts. You
         // can use the value returned by `counts_per_rot` to convert tacho counts to/from
         // rotations or degrees.
-        int position_sp() const { return get_attr_int("position_sp"); }
+        int position_sp() const { return _attr.position_sp.get(*this); }
         motor& set_position_sp(int v) {
-            set_attr_int("position_sp", v);
+            _attr.position_sp.set(*this, v);
             return *this;
         }
 
@@ -892,13 +1687,13 @@ class motor : protected device {
         // Returns the maximum value that is accepted by the `speed_sp` attribute. This
         // may be slightly different than the maximum speed that a particular motor can
         // reach - it's the maximum theoretical speed.
-        int max_speed() const { return get_attr_int("max_speed"); }
+        int max_speed() const { return get_attr_const_int("max_speed"); }
 
         // Speed: read-only
         // Returns the current motor speed in tacho counts per second. Note, this is
         // not necessarily degrees (although it is for LEGO motors). Use the `count_per_rot`
         // attribute to convert this value to RPM or deg/sec.
-        int speed() const { return get_attr_int("speed"); }
+        int speed() const { return _attr.speed.get(*this); }
 
         // Speed SP: read/write
         // Writing sets the target speed in tacho counts per second used for all `run-*`
@@ -907,9 +1702,9 @@ class motor : protected device {
         // commands where the sign is ignored. Use the `count_per_rot` attribute to convert
         // RPM or deg/sec to tacho counts per second. Use the `count_per_m` attribute to
         // convert m/s to tacho counts per second.
-        int speed_sp() const { return get_attr_int("speed_sp"); }
+        int speed_sp() const { return _attr.speed_sp.get(*this); }
         motor& set_speed_sp(int v) {
-            set_attr_int("speed_sp", v);
+            _attr.speed_sp.set(*this, v);
             return *this;
         }
 
@@ -919,9 +1714,9 @@ class motor : protected device {
         // motor speed will increase from 0 to 100% of `max_speed` over the span of this
         // setpoint. The actual ramp time is the ratio of the difference between the
         // `speed_sp` and the current `speed` and max_speed multiplied by `ramp_up_sp`.
-        int ramp_up_sp() const { return get_attr_int("ramp_up_sp"); }
+        int ramp_up_sp() const { return _attr.ramp_up_sp.get(*this); }
         motor& set_ramp_up_sp(int v) {
-            set_attr_int("ramp_up_sp", v);
+            _attr.ramp_up_sp.set(*this, v);
             return *this;
         }
 
@@ -931,49 +1726,69 @@ class motor : protected device {
         // motor speed will decrease from 0 to 100% of `max_speed` over the span of this
         // setpoint. The actual ramp time is the ratio of the difference between the
         // `speed_sp` and the current `speed` and max_speed multiplied by `ramp_down_sp`.
-        int ramp_down_sp() const { return get_attr_int("ramp_down_sp"); }
+        int ramp_down_sp() const { return _attr.ramp_down_sp.get(*this); }
         motor& set_ramp_down_sp(int v) {
-            set_attr_int("ramp_down_sp", v);
+            _attr.ramp_down_sp.set(*this, v);
             return *this;
         }
 
         // Speed P: read/write
         // The proportional constant for the speed regulation PID.
-        int speed_p() const { return get_attr_int("speed_pid/Kp"); }
+        int speed_p() const { return _attr.speed_p.get(*this); }
         motor& set_speed_p(int v) {
-            set_attr_int("speed_pid/Kp", v);
+            _attr.speed_p.set(*this, v);
             return *this;
         }
 
         // Speed I: read/write
         // The integral constant for the speed regulation PID.
-        int speed_i() const { return get_attr_int("speed_pid/Ki"); }
+        int speed_i() const { return _attr.speed_i.get(*this); }
         motor& set_speed_i(int v) {
-            set_attr_int("speed_pid/Ki", v);
+            _attr.speed_i.set(*this, v);
             return *this;
         }
 
         // Speed D: read/write
         // The derivative constant for the speed regulation PID.
-        int speed_d() const { return get_attr_int("speed_pid/Kd"); }
+        int speed_d() const { return _attr.speed_d.get(*this); }
         motor& set_speed_d(int v) {
-            set_attr_int("speed_pid/Kd", v);
+            _attr.speed_d.set(*this, v);
             return *this;
         }
 
         // State: read-only
         // Reading returns a list of state flags. Possible flags are
         // `running`, `ramping`, `holding`, `overloaded` and `stalled`.
-        mode_set state() const { return get_attr_set("state"); }
+        mode_set state() const { return _attr.state.get(*this); }
+
+        // The same as state(), as a bitmask of the flag_* constants. Does not
+        // allocate, use this in control loops.
+        uint8_t state_flags() const;
+        bool is_running() const { return (state_flags() & flag_running) != 0; }
+        bool is_stalled() const { return (state_flags() & flag_stalled) != 0; }
+        // The same for a `state` text read elsewhere, e.g. by a read_batch.
+        static uint8_t flags_from_state(std::string_view state) noexcept;
+
+        // Block until `pred(state())` is true, or until the `state` flag is set
+        // (wait_until) or cleared (wait_while), or `timeout` passes. A negative
+        // timeout waits forever. Return whether the condition was met. The
+        // driver notifies `state` changes, so this wakes up right away instead
+        // of sleeping in a polling loop, see device::watch().
+        bool wait_until(const std::function<bool(const mode_set&)> &pred,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds{-1}) const;
+        bool wait_until(const std::string &flag,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds{-1}) const;
+        bool wait_while(const std::string &flag,
+                std::chrono::milliseconds timeout = std::chrono::milliseconds{-1}) const;
 
         // Stop Action: read/write
         // Reading returns the current stop action. Writing sets the stop action.
         // The value determines the motors behavior when `command` is set to `stop`.
         // Also, it determines the motors behavior when a run command completes. See
         // `stop_actions` for a list of possible values.
-        std::string stop_action() const { return get_attr_string("stop_action"); }
+        std::string stop_action() const { return _attr.stop_action.get(*this); }
         motor& set_stop_action(std::string v) {
-            set_attr_string("stop_action", v);
+            _attr.stop_action.set(*this, v);
             return *this;
         }
 
@@ -988,52 +1803,139 @@ class motor : protected device {
         // power from the motor. Instead it actively tries to hold the motor at the current
         // position. If an external force tries to turn the motor, the motor will 'push
         // back' to maintain its position.
-        mode_set stop_actions() const { return get_attr_set("stop_actions"); }
+        mode_set stop_actions() const { return get_attr_const_set("stop_actions"); }
 
         // Time SP: read/write
         // Writing specifies the amount of time the motor will run when using the
         // `run-timed` command. Reading returns the current value. Units are in
         // milliseconds.
-        int time_sp() const { return get_attr_int("time_sp"); }
+        int time_sp() const { return _attr.time_sp.get(*this); }
         motor& set_time_sp(int v) {
-            set_attr_int("time_sp", v);
+            _attr.time_sp.set(*this, v);
             return *this;
         }
 
         // Run the motor until another command is sent.
-        void run_forever() { set_command("run-forever"); }
+        void run_forever() { _attr.command.set(*this, command_run_forever); }
 
         // Run to an absolute position specified by `position_sp` and then
         // stop using the action specified in `stop_action`.
-        void run_to_abs_pos() { set_command("run-to-abs-pos"); }
+        void run_to_abs_pos() { _attr.command.set(*this, command_run_to_abs_pos); }
 
         // Run to a position relative to the current `position` value.
         // The new position will be current `position` + `position_sp`.
         // When the new position is reached, the motor will stop using
         // the action specified by `stop_action`.
-        void run_to_rel_pos() { set_command("run-to-rel-pos"); }
+        void run_to_rel_pos() { _attr.command.set(*this, command_run_to_rel_pos); }
 
         // Run the motor for the amount of time specified in `time_sp`
         // and then stop the motor using the action specified by `stop_action`.
-        void run_timed() { set_command("run-timed"); }
+        void run_timed() { _attr.command.set(*this, command_run_timed); }
 
         // Run the motor at the duty cycle specified by `duty_cycle_sp`.
         // Unlike other run commands, changing `duty_cycle_sp` while running *will*
         // take effect immediately.
-        void run_direct() { set_command("run-direct"); }
+        void run_direct() { _attr.command.set(*this, command_run_direct); }
 
         // Stop any of the run commands before they are complete using the
         // action specified by `stop_action`.
-        void stop() { set_command("stop"); }
+        void stop() { _attr.command.set(*this, command_stop); }
 
         // Reset all of the motor parameter attributes to their default value.
         // This will also have the effect of stopping the motor.
-        void reset() { set_command("reset"); }
+        void reset() { _attr.command.set(*this, command_reset); }
+
+        // Exception-free variants of the accessors a control loop calls every
+        // tick, see device::try_get_attr_int().
+        outcome::result<int> try_position() const { return _attr.position.try_get(*this); }
+        outcome::result<int> try_speed() const { return _attr.speed.try_get(*this); }
+        outcome::result<int> try_duty_cycle() const { return _attr.duty_cycle.try_get(*this); }
+        outcome::result<uint8_t> try_state_flags() const;
+
+        outcome::result<void> try_set_position_sp(int v) { return _attr.position_sp.try_set(*this, v); }
+        outcome::result<void> try_set_speed_sp(int v) { return _attr.speed_sp.try_set(*this, v); }
+        outcome::result<void> try_set_duty_cycle_sp(int v) { return _attr.duty_cycle_sp.try_set(*this, v); }
+        // One of the command_* values.
+        outcome::result<void> try_command(std::string_view v) { return _attr.command.try_set(*this, v); }
+
+        // Setpoints collected by configure() and written together:
+        //
+        //     m.configure().stop_action("hold").speed_sp(500).position_sp(90).run_to_abs_pos();
+        //
+        // The setpoints are written through the attribute handles in a fixed
+        // order (the order of the setters below) and the command goes last.
+        // The finishing calls return how long the writes took. A failed write
+        // throws and leaves the remaining setpoints unwritten. Afterwards the
+        // transaction is empty and can be filled again.
+        class transaction {
+            public:
+                explicit transaction(motor &m) noexcept : _motor(m) {}
+
+                transaction& polarity(std::string_view v)     { _polarity = v; return *this; }
+                transaction& stop_action(std::string_view v)  { _stop_action = v; return *this; }
+                transaction& ramp_up_sp(int v)                { _ramp_up_sp = v; return *this; }
+                transaction& ramp_down_sp(int v)              { _ramp_down_sp = v; return *this; }
+                transaction& time_sp(int v)                   { _time_sp = v; return *this; }
+                transaction& duty_cycle_sp(int v)             { _duty_cycle_sp = v; return *this; }
+                transaction& speed_sp(int v)                  { _speed_sp = v; return *this; }
+                transaction& position_sp(int v)               { _position_sp = v; return *this; }
+
+                // Writes the setpoints without a command.
+                std::chrono::nanoseconds apply() { return commit({}); }
+
+                std::chrono::nanoseconds run_forever()    { return commit(command_run_forever); }
+                std::chrono::nanoseconds run_to_abs_pos() { return commit(command_run_to_abs_pos); }
+                std::chrono::nanoseconds run_to_rel_pos() { return commit(command_run_to_rel_pos); }
+                std::chrono::nanoseconds run_timed()      { return commit(command_run_timed); }
+                std::chrono::nanoseconds run_direct()     { return commit(command_run_direct); }
+                std::chrono::nanoseconds stop()           { return commit(command_stop); }
+
+                // Writes the setpoints, then `command` unless it is empty.
+                std::chrono::nanoseconds commit(std::string_view command);
+
+            private:
+                motor &_motor;
+                std::optional<std::string> _polarity;
+                std::optional<std::string> _stop_action;
+                std::optional<int> _ramp_up_sp;
+                std::optional<int> _ramp_down_sp;
+                std::optional<int> _time_sp;
+                std::optional<int> _duty_cycle_sp;
+                std::optional<int> _speed_sp;
+                std::optional<int> _position_sp;
+        };
+
+        transaction configure() noexcept { return transaction{*this}; }
 
     protected:
         motor(const ISystem& system) : device{system} {}
 
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
+
+        // Handles for the attributes used in control loops.
+        struct attributes {
+            attribute<std::string> command{"command"};
+            attribute<int>         duty_cycle{"duty_cycle"};
+            attribute<int>         duty_cycle_sp{"duty_cycle_sp"};
+            attribute<std::string> polarity{"polarity"};
+            attribute<int>         position{"position"};
+            attribute<int>         position_p{"hold_pid/Kp"};
+            attribute<int>         position_i{"hold_pid/Ki"};
+            attribute<int>         position_d{"hold_pid/Kd"};
+            attribute<int>         position_sp{"position_sp"};
+            attribute<int>         speed{"speed"};
+            attribute<int>         speed_sp{"speed_sp"};
+            attribute<int>         ramp_up_sp{"ramp_up_sp"};
+            attribute<int>         ramp_down_sp{"ramp_down_sp"};
+            attribute<int>         speed_p{"speed_pid/Kp"};
+            attribute<int>         speed_i{"speed_pid/Ki"};
+            attribute<int>         speed_d{"speed_pid/Kd"};
+            attribute<mode_set>    state{"state"};
+            attribute<std::string> stop_action{"stop_action"};
+            attribute<int>         time_sp{"time_sp"};
+        };
+
+        attributes _attr;
 };
 
 //-----------------------------------------------------------------------------
@@ -1060,6 +1962,70 @@ class nxt_motor : public motor {
         nxt_motor(address_type address = OUTPUT_AUTO, const ISystem& system = default_system);
 };
 
+//-----------------------------------------------------------------------------
+// Starts several tacho motors together, e.g. the axes of an XY move:
+//
+//     motor_group g;
+//     g.add(x).speed_sp(300).position_sp(1000);
+//     g.add(y).speed_sp(150).position_sp(500);
+//     g.run_to_abs_pos();
+//
+// All setpoints of all members are written first, then the commands go out
+// back to back, so the start of one motor does not wait for the setpoints of
+// the next. The commands are written from the calling thread through the
+// pre-opened attribute handles, or with dispatch::parallel from one thread
+// per member released at the same moment, which only helps on multi-core
+// platforms like the BrickPi3 or PiStorms. The finishing calls return the
+// skew: the time between the first and the last command write completing.
+//
+// Members are referenced, not copied, they must outlive the group.
+//-----------------------------------------------------------------------------
+class motor_group {
+    public:
+        enum class dispatch { sequential, parallel };
+
+        explicit motor_group(dispatch how = dispatch::sequential) noexcept : _dispatch(how) {}
+
+        // Adds a motor and returns the transaction that collects its
+        // setpoints. The reference stays valid for the life of the group.
+        motor::transaction& add(motor &m);
+
+        std::size_t size() const noexcept { return _members.size(); }
+
+        // Drops all members but keeps the stats, so one group can start a
+        // different set of motors every time.
+        void clear() noexcept { _members.clear(); }
+
+        std::chrono::nanoseconds run_forever()    { return fire(&motor::run_forever); }
+        std::chrono::nanoseconds run_to_abs_pos() { return fire(&motor::run_to_abs_pos); }
+        std::chrono::nanoseconds run_to_rel_pos() { return fire(&motor::run_to_rel_pos); }
+        std::chrono::nanoseconds run_timed()      { return fire(&motor::run_timed); }
+        std::chrono::nanoseconds run_direct()     { return fire(&motor::run_direct); }
+        std::chrono::nanoseconds stop()           { return fire(&motor::stop); }
+
+        // Skew of all starts of this group.
+        struct skew_stats {
+            std::uint64_t count = 0;
+            std::chrono::nanoseconds last{0};
+            std::chrono::nanoseconds max{0};
+            std::chrono::nanoseconds total{0};
+        };
+
+        const skew_stats& stats() const noexcept { return _stats; }
+
+    private:
+        struct entry {
+            motor *m;
+            motor::transaction setpoints;
+        };
+
+        std::chrono::nanoseconds fire(void (motor::*command)());
+
+        dispatch _dispatch;
+        std::deque<entry> _members;
+        skew_stats _stats;
+};
+
 //-----------------------------------------------------------------------------
 // The DC motor class provides a uniform interface for using regular DC motors
 // with no fancy controls or feedback. This includes LEGO MINDSTORMS RCX motors
@@ -1070,6 +2036,13 @@ class dc_motor : protected device {
         dc_motor(address_type address = OUTPUT_AUTO, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
         using device::device_index;
 
         // Run the motor until another command is sent.
@@ -1107,7 +2080,7 @@ class dc_motor : protected device {
 
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_const_string("address"); }
 
         // Command: write-only
         // Sets the command for the motor. Possible values are `run-forever`, `run-timed` and
@@ -1121,12 +2094,12 @@ class dc_motor : protected device {
         // Commands: read-only
         // Returns a list of commands supported by the motor
         // controller.
-        mode_set commands() const { return get_attr_set("commands"); }
+        mode_set commands() const { return get_attr_const_set("commands"); }
 
         // Driver Name: read-only
         // Returns the name of the motor driver that loaded this device. See the list
         // of [supported devices] for a list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_const_string("driver_name"); }
 
         // Duty Cycle: read-only
         // Shows the current duty cycle of the PWM signal sent to the motor. Values
@@ -1176,6 +2149,11 @@ class dc_motor : protected device {
         // `duty_cycle_sp`.
         mode_set state() const { return get_attr_set("state"); }
 
+        // The same as state(), as a bitmask of motor::flag_running and
+        // motor::flag_ramping. Does not allocate.
+        uint8_t state_flags() const;
+        bool is_running() const { return (state_flags() & motor::flag_running) != 0; }
+
         // Stop Action: write-only
         // Sets the stop action that will be used when the motor stops. Read
         // `stop_actions` to get the list of valid values.
@@ -1187,7 +2165,7 @@ class dc_motor : protected device {
         // Stop Actions: read-only
         // Gets a list of stop actions. Valid values are `coast`
         // and `brake`.
-        mode_set stop_actions() const { return get_attr_set("stop_actions"); }
+        mode_set stop_actions() const { return get_attr_const_set("stop_actions"); }
 
         // Time SP: read/write
         // Writing specifies the amount of time the motor will run when using the
@@ -1219,6 +2197,7 @@ class dc_motor : protected device {
 
     protected:
         std::string _port_name;
+        attribute<mode_set> _state{"state"};
 };
 
 //-----------------------------------------------------------------------------
@@ -1230,6 +2209,13 @@ class servo_motor : protected device {
         servo_motor(address_type address = OUTPUT_AUTO, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
         using device::device_index;
 
         // Drive servo to the position set in the `position_sp` attribute.
@@ -1248,7 +2234,7 @@ class servo_motor : protected device {
 
         // Address: read-only
         // Returns the name of the port that this motor is connected to.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_const_string("address"); }
 
         // Command: write-only
         // Sets the command for the servo. Valid values are `run` and `float`. Setting
@@ -1262,7 +2248,7 @@ class servo_motor : protected device {
         // Driver Name: read-only
         // Returns the name of the motor driver that loaded this device. See the list
         // of [supported devices] for a list of drivers.
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_const_string("driver_name"); }
 
         // Max Pulse SP: read/write
         // Used to set the pulse size in milliseconds for the signal that tells the
@@ -1358,10 +2344,17 @@ class led : protected device {
         led(std::string name, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
 
         // Max Brightness: read-only
         // Returns the maximum allowable brightness value.
-        int max_brightness() const { return get_attr_int("max_brightness"); }
+        int max_brightness() const { return get_attr_const_int("max_brightness"); }
 
         // Brightness: read/write
         // Sets the brightness level. Possible values are from 0 to `max_brightness`.
@@ -1496,9 +2489,6 @@ class led : protected device {
         static void set_color(const std::vector<led*> &group, const std::vector<float> &color);
 
         static void all_off();
-
-    protected:
-        int _max_brightness = 0;
 };
 
 //-----------------------------------------------------------------------------
@@ -1510,6 +2500,13 @@ class power_supply : protected device {
         power_supply(std::string name, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
 
         // Measured Current: read-only
         // The measured current that the battery is supplying (in microamps)
@@ -1526,10 +2523,10 @@ class power_supply : protected device {
         int min_voltage() const { return get_attr_int("voltage_min_design"); }
 
         // Technology: read-only
-        std::string technology() const { return get_attr_string("technology"); }
+        std::string technology() const { return get_attr_const_string("technology"); }
 
         // Type: read-only
-        std::string type() const { return get_attr_string("type"); }
+        std::string type() const { return get_attr_const_string("type"); }
 
         float measured_amps()       const { return static_cast<float>(measured_current()) / 1000000.f; }
         float measured_volts()      const { return static_cast<float>(measured_current()) / 1000000.f; }
@@ -1701,21 +2698,28 @@ class lego_port : protected device {
         lego_port(address_type, const ISystem& system = default_system);
 
         using device::connected;
+        using device::path;
+        using device::cache_stats;
+        using device::set_shadow_writes;
+        using device::shadow_writes;
+        using device::forget_writes;
+        using device::elided_writes;
+        using device::watch;
         using device::device_index;
 
         // Address: read-only
         // Returns the name of the port. See individual driver documentation for
         // the name that will be returned.
-        std::string address() const { return get_attr_string("address"); }
+        std::string address() const { return get_attr_const_string("address"); }
 
         // Driver Name: read-only
         // Returns the name of the driver that loaded this device. You can find the
         // complete list of drivers in the [list of port drivers].
-        std::string driver_name() const { return get_attr_string("driver_name"); }
+        std::string driver_name() const { return get_attr_const_string("driver_name"); }
 
         // Modes: read-only
         // Returns a list of the available modes of the port.
-        mode_set modes() const { return get_attr_set("modes"); }
+        mode_set modes() const { return get_attr_const_set("modes"); }
 
         // Mode: read/write
         // Reading returns the currently selected mode. Writing sets the mode.
@@ -1752,4 +2756,569 @@ class lego_port : protected device {
         bool connect(const std::map<std::string, std::set<std::string>>&) noexcept;
 };
 
+//-----------------------------------------------------------------------------
+// Reads a fixed set of attributes, possibly of many devices, in one go, e.g.
+// everything a control loop needs for one tick:
+//
+//     read_batch batch{sys};
+//     const auto left = batch.add(left_motor, "position");
+//     const auto dist = batch.add(us_sensor, "value0");
+//     for (;;) {
+//         batch.submit();
+//         int error = batch.value(left) - batch.value(dist);
+//         ...
+//     }
+//
+// With an fd based system (FdSystem) every attribute is read with pread()
+// on a file opened once. backend::io_uring instead hands all reads of a
+// submit() to the kernel as one io_uring batch, a single syscall for the
+// whole tick, and falls back to pread() where io_uring is not available
+// (old kernel, seccomp, built without the Linux headers). It is not the
+// default: sysfs files cannot be read without blocking, so the kernel passes
+// every read on to a worker thread, which costs more than the syscalls saved
+// (see benchmarks/tick_bench). Other systems read through their streams.
+//-----------------------------------------------------------------------------
+class read_batch {
+    public:
+        enum class backend { automatic, io_uring, pread, stream };
+
+        // Longest attribute value kept, longer values are cut.
+        static constexpr std::size_t max_value_size = 128;
+
+        explicit read_batch(const ISystem& system = default_system, backend preferred = backend::automatic);
+        ~read_batch();
+
+        read_batch(const read_batch &) = delete;
+        read_batch& operator=(const read_batch &) = delete;
+
+        // Adds attribute `name` of the device in directory `device_path` and
+        // returns its slot. The file is opened right away.
+        std::size_t add(const std::string &device_path, const char *name);
+
+        template <typename Device>
+        std::size_t add(const Device &d, const char *name) { return add(d.path(), name); }
+
+        // Reads every attribute, also those after one that fails, and
+        // returns the number of reads that failed. Throws std::system_error
+        // only if the batch as a whole could not be submitted.
+        std::size_t submit();
+
+        // Contents of slot `index` as of the last submit(), without the
+        // newline. Throws std::system_error if that read failed.
+        std::string_view text(std::size_t index) const;
+        // Same, parsed as an integer.
+        int value(std::size_t index) const;
+        // Why the last read of slot `index` failed, empty if it did not.
+        std::error_code error(std::size_t index) const;
+
+        std::size_t size() const noexcept { return _slots.size(); }
+        backend active_backend() const noexcept { return _backend; }
+
+    private:
+        struct slot {
+            std::string path;
+            std::unique_ptr<file_istream> in;
+            int fd = -1;
+            std::size_t length = 0;
+            int error = 0;
+            std::array<char, max_value_size> buf;
+        };
+
+        struct ring;
+
+        void submit_io_uring();
+        void submit_pread();
+        void submit_stream();
+
+        const ISystem &_system;
+        backend _backend;
+        std::deque<slot> _slots;
+        std::unique_ptr<ring> _ring;
+};
+
+//-----------------------------------------------------------------------------
+// Bounded lock-free queue for one producer thread and one consumer thread.
+// The capacity is rounded up to a power of two. push() fails when the ring is
+// full, pop() when it is empty.
+//-----------------------------------------------------------------------------
+template <typename T>
+class spsc_ring {
+    public:
+        explicit spsc_ring(std::size_t capacity)
+            : _mask(round_up(capacity) - 1)
+            , _buf(new T[_mask + 1])
+        { }
+
+        spsc_ring(const spsc_ring &) = delete;
+        spsc_ring& operator=(const spsc_ring &) = delete;
+
+        // Producer side.
+        bool push(const T &value) noexcept {
+            const auto tail = _tail.load(std::memory_order_relaxed);
+            if (tail - _head.load(std::memory_order_acquire) > _mask)
+                return false;
+            _buf[tail & _mask] = value;
+            _tail.store(tail + 1, std::memory_order_release);
+            return true;
+        }
+
+        // Consumer side.
+        bool pop(T &value) noexcept {
+            const auto head = _head.load(std::memory_order_relaxed);
+            if (head == _tail.load(std::memory_order_acquire))
+                return false;
+            value = _buf[head & _mask];
+            _head.store(head + 1, std::memory_order_release);
+            return true;
+        }
+
+        std::size_t size() const noexcept {
+            return _tail.load(std::memory_order_acquire) - _head.load(std::memory_order_acquire);
+        }
+
+        std::size_t capacity() const noexcept { return _mask + 1; }
+
+    private:
+        static std::size_t round_up(std::size_t n) noexcept {
+            std::size_t result = 1;
+            while (result < n)
+                result <<= 1;
+            return result;
+        }
+
+        const std::size_t _mask;
+        std::unique_ptr<T[]> _buf;
+        // On separate cache lines, so producer and consumer do not bounce one.
+        alignas(64) std::atomic<std::size_t> _head{0};
+        alignas(64) std::atomic<std::size_t> _tail{0};
+};
+
+//-----------------------------------------------------------------------------
+// Samples a set of integer attributes on a thread of its own at a fixed rate
+// and queues timestamped samples per channel:
+//
+//     sensor_sampler sampler{std::chrono::milliseconds{10}, sys};
+//     const auto dist = sampler.add(us_sensor, "value0");
+//     sampler.start();
+//     ...
+//     sensor_sampler::sample s;
+//     while (sampler.pop(dist, s))
+//         use(s.time, s.value);
+//
+// Every tick reads all attributes through one read_batch, an attribute that
+// several channels ask for is read only once, and all samples of a tick get
+// the same timestamp. Each channel has its own ring, which one consumer
+// thread drains without locks. When a ring is full, new samples of that
+// channel are dropped and counted. A channel whose attribute cannot be
+// read or parsed misses that tick, the other channels do not. A tick that
+// overruns the period is not made up for, the next one starts right away.
+//-----------------------------------------------------------------------------
+class sensor_sampler {
+    public:
+        struct sample {
+            std::chrono::steady_clock::time_point time;
+            int value = 0;
+        };
+
+        explicit sensor_sampler(std::chrono::microseconds period, const ISystem& system = default_system);
+        ~sensor_sampler();
+
+        sensor_sampler(const sensor_sampler &) = delete;
+        sensor_sampler& operator=(const sensor_sampler &) = delete;
+
+        // Adds a channel for attribute `name` of a device and returns its
+        // number. Channels can only be added while the sampler is stopped.
+        std::size_t add(const std::string &device_path, const char *name, std::size_t capacity = 256);
+
+        template <typename Device>
+        std::size_t add(const Device &d, const char *name, std::size_t capacity = 256) {
+            return add(d.path(), name, capacity);
+        }
+
+        void start();
+        void stop();
+        bool running() const noexcept { return _thread.joinable(); }
+
+        // Takes effect from the next tick.
+        void set_period(std::chrono::microseconds period) noexcept { _period.store(period.count()); }
+        std::chrono::microseconds period() const noexcept { return std::chrono::microseconds{_period.load()}; }
+
+        // Takes the oldest queued sample of channel `index`.
+        bool pop(std::size_t index, sample &out) noexcept { return _channels[index].ring.pop(out); }
+
+        std::uint64_t dropped(std::size_t index) const noexcept { return _channels[index].dropped.load(); }
+        // Ticks in which channel `index` got no sample because of an error.
+        std::uint64_t failed(std::size_t index) const noexcept { return _channels[index].failed.load(); }
+        std::uint64_t ticks() const noexcept { return _ticks.load(); }
+        // Ticks in which reading or parsing an attribute failed.
+        std::uint64_t errors() const noexcept { return _errors.load(); }
+        // Distinct attributes read per tick.
+        std::size_t reads_per_tick() const noexcept { return _batch.size(); }
+
+    private:
+        struct channel {
+            channel(std::size_t slot_, std::size_t capacity) : slot(slot_), ring(capacity) {}
+
+            std::size_t slot;
+            spsc_ring<sample> ring;
+            std::atomic<std::uint64_t> dropped{0};
+            std::atomic<std::uint64_t> failed{0};
+        };
+
+        void loop();
+
+        read_batch _batch;
+        std::map<std::string, std::size_t> _slots;
+        std::deque<channel> _channels;
+        std::atomic<std::int64_t> _period;
+        std::atomic<std::uint64_t> _ticks{0};
+        std::atomic<std::uint64_t> _errors{0};
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        bool _stop = false;
+        std::thread _thread;
+};
+
+//-----------------------------------------------------------------------------
+// A value that one writer publishes and any number of readers copy, without
+// locks and without syscalls (a sequence lock). A reader that overlaps a
+// write tries again, so it never sees a torn value, and the writer never
+// waits for readers. T must be trivially copyable. The value is kept in
+// machine words, which are lock-free atomics on every platform, the EV3's
+// 32-bit ARM included.
+//-----------------------------------------------------------------------------
+template <typename T>
+class seqlock {
+    static_assert(std::is_trivially_copyable_v<T>, "seqlock needs a trivially copyable type");
+
+    public:
+        seqlock() noexcept { write_words(T{}); }
+
+        seqlock(const seqlock &) = delete;
+        seqlock& operator=(const seqlock &) = delete;
+
+        // Only one thread may store.
+        void store(const T &value) noexcept {
+            const auto sequence = _sequence.load(std::memory_order_relaxed);
+            _sequence.store(sequence + 1, std::memory_order_relaxed);
+            std::atomic_thread_fence(std::memory_order_release);
+            write_words(value);
+            _sequence.store(sequence + 2, std::memory_order_release);
+        }
+
+        T load() const noexcept {
+            word words[word_count];
+            for (;;) {
+                const auto before = _sequence.load(std::memory_order_acquire);
+                if ((before & 1) == 0) {
+                    for (std::size_t i = 0; i < word_count; ++i)
+                        words[i] = _words[i].load(std::memory_order_relaxed);
+                    std::atomic_thread_fence(std::memory_order_acquire);
+                    if (_sequence.load(std::memory_order_relaxed) == before)
+                        break;
+                }
+                // On a single core the writer needs the CPU to finish.
+                std::this_thread::yield();
+            }
+
+            T value;
+            std::memcpy(&value, words, sizeof(T));
+            return value;
+        }
+
+        // Number of stores so far.
+        unsigned version() const noexcept { return _sequence.load(std::memory_order_acquire) / 2; }
+
+    private:
+        using word = std::uintptr_t;
+        static constexpr std::size_t word_count = (sizeof(T) + sizeof(word) - 1) / sizeof(word);
+
+        void write_words(const T &value) noexcept {
+            word words[word_count] = {};
+            std::memcpy(words, &value, sizeof(T));
+            for (std::size_t i = 0; i < word_count; ++i)
+                _words[i].store(words[i], std::memory_order_relaxed);
+        }
+
+        std::atomic<unsigned> _sequence{0};
+        std::array<std::atomic<word>, word_count> _words;
+};
+
+//-----------------------------------------------------------------------------
+// The latest state of a set of motors and sensors. One thread, the one that
+// does the device I/O anyway, calls update(), every other thread, like a UI,
+// calls read() and gets a consistent copy without touching sysfs:
+//
+//     device_snapshot snapshot{sys};
+//     const auto x = snapshot.track(x_motor, device_snapshot::read_position);
+//     ...
+//     snapshot.update();                          // control thread
+//     draw(snapshot.read().motors[x].position);   // UI thread
+//
+// Entries that are not tracked, or fields a motor is not tracked for, stay 0.
+//-----------------------------------------------------------------------------
+class device_snapshot {
+    public:
+        static constexpr std::size_t max_motors = 8;
+        static constexpr std::size_t max_sensors = 8;
+
+        // What to read of a motor, see track().
+        static constexpr unsigned read_position = 0x1;
+        static constexpr unsigned read_speed    = 0x2;
+        static constexpr unsigned read_state    = 0x4;
+        static constexpr unsigned read_all      = read_position | read_speed | read_state;
+
+        struct motor_entry {
+            int position = 0;
+            int speed = 0;
+            std::uint8_t flags = 0;    // motor::flag_*
+        };
+
+        struct sensor_entry {
+            std::array<int, sensor::max_values> value{};
+            unsigned count = 0;
+        };
+
+        struct data {
+            // When update() finished reading, zero before the first update.
+            std::chrono::steady_clock::time_point time;
+            std::array<motor_entry, max_motors> motors{};
+            std::array<sensor_entry, max_sensors> sensors{};
+        };
+
+        explicit device_snapshot(const ISystem& system = default_system) : _batch(system) {}
+
+        // Start tracking a device, returns its index in data::motors or
+        // data::sensors. A sensor's values are the num_values() of its mode
+        // at the time of the call. Not thread safe with update().
+        std::size_t track(const motor &m, unsigned what = read_all);
+        std::size_t track(const sensor &s);
+
+        // Reads every tracked attribute and publishes the result. A value
+        // that cannot be read or parsed keeps what the previous update found,
+        // the others are updated all the same. Returns the number of such
+        // failures. Throws std::system_error, publishing nothing, only if the
+        // batch as a whole could not be read.
+        std::size_t update();
+
+        data read() const noexcept { return _published.load(); }
+        // Number of updates published so far.
+        unsigned version() const noexcept { return _published.version(); }
+
+    private:
+        static constexpr std::size_t none = static_cast<std::size_t>(-1);
+
+        struct motor_slots {
+            std::size_t position = none;
+            std::size_t speed = none;
+            std::size_t state = none;
+        };
+
+        struct sensor_slots {
+            std::size_t first;
+            unsigned count;
+        };
+
+        read_batch _batch;
+        std::vector<motor_slots> _motors;
+        std::vector<sensor_slots> _sensors;
+        seqlock<data> _published;
+};
+
+//-----------------------------------------------------------------------------
+// Runs device I/O on a thread of its own, so a UI or planning thread does not
+// stall on slow sysfs writes:
+//
+//     io_worker io;
+//     io.post([&] { m.set_speed_sp(300); });                // fire and forget
+//     auto pos = io.submit([&] { return m.position(); });  // std::future<int>
+//
+// Any number of threads may queue tasks. Queueing is lock-free, the mutex is
+// only taken to wake the worker up when it sleeps. Tasks run one at a time in
+// the order they were queued, so the tasks on one device never overlap.
+// Other threads may use the same devices directly as well, within the rules
+// of the device class (see "Threads" there).
+//
+// Exceptions of submit() tasks are stored in the future. Those of post()
+// tasks are counted in errors() and passed to the error handler, which runs
+// on the worker thread. The destructor runs the tasks still queued and then
+// joins the thread.
+//-----------------------------------------------------------------------------
+class io_worker {
+    public:
+        using error_handler = std::function<void(std::exception_ptr)>;
+
+        explicit io_worker(error_handler on_error = {});
+        ~io_worker();
+
+        io_worker(const io_worker &) = delete;
+        io_worker& operator=(const io_worker &) = delete;
+
+        template <typename F>
+        void post(F &&f) {
+            push(new task<std::decay_t<F>>(std::forward<F>(f)));
+        }
+
+        template <typename F>
+        auto submit(F &&f) -> std::future<std::invoke_result_t<std::decay_t<F>&>> {
+            std::packaged_task<std::invoke_result_t<std::decay_t<F>&>()> t{std::forward<F>(f)};
+            auto result = t.get_future();
+            post(std::move(t));
+            return result;
+        }
+
+        // Waits until every task queued before the call has run. Must not be
+        // called from a task.
+        void drain() { submit([] {}).wait(); }
+
+        std::uint64_t errors() const noexcept { return _errors.load(std::memory_order_relaxed); }
+
+    private:
+        // A node of the intrusive MPSC queue (Dmitry Vyukov's design).
+        struct node {
+            virtual ~node() = default;
+            virtual void run() {}
+
+            std::atomic<node*> next{nullptr};
+        };
+
+        template <typename F>
+        struct task : node {
+            template <typename G>
+            explicit task(G &&g) : f(std::forward<G>(g)) {}
+            void run() override { f(); }
+
+            F f;
+        };
+
+        void push(node *n) noexcept;
+        node* pop() noexcept;
+        void loop();
+
+        node _stub;
+        std::atomic<node*> _head{&_stub};
+        node *_tail = &_stub;
+        // Queued tasks that have not finished yet, bumped before a task is
+        // linked into the queue.
+        std::atomic<std::size_t> _pending{0};
+        std::atomic<bool> _sleeping{false};
+        std::atomic<bool> _stop{false};
+        std::atomic<std::uint64_t> _errors{0};
+        std::mutex _mutex;
+        std::condition_variable _wake;
+        error_handler _on_error;
+        std::thread _thread;
+};
+
+//-----------------------------------------------------------------------------
+// A system that simulates tacho motors and touch, color and gyro sensors in
+// memory, for running a program, or benchmarking it, without hardware:
+//
+//     SimSystem sim;
+//     SimSystem::motor_config x;
+//     x.address = OUTPUT_B;
+//     x.min_position = -400;
+//     x.max_position = 900;
+//     sim.add_motor(x);
+//
+//     large_motor m{OUTPUT_B, sim};
+//     m.set_speed_sp(500).set_position_sp(360).run_to_abs_pos();
+//     sim.advance(std::chrono::seconds{1});  // m.position() == 360 now
+//
+// Motors follow the tacho-motor driver: run-forever, run-timed and the
+// run-to-pos commands regulate to speed_sp with acceleration limited by
+// ramp_up_sp and ramp_down_sp, run-direct follows duty_cycle_sp, and stop
+// coasts, brakes or holds as stop_action says. A motor driven against an
+// end stop stops there and reports "stalled". Invalid writes fail with
+// EINVAL like the kernel's.
+//
+// Simulated time only moves on advance(), so a program that polls and
+// advances in the same loop runs as fast as it can. follow_clock() makes
+// it follow steady_clock instead, `scale` times as fast, for code that
+// sleeps between polls. Physics is stepped in 1 ms increments.
+//
+// Thread safe: every access takes one lock.
+//-----------------------------------------------------------------------------
+class SimSystem : public ISystem {
+    public:
+        struct motor_config {
+            std::string address;
+            std::string driver_name = "lego-ev3-l-motor";
+            // Speed at 100% duty cycle in tacho counts per second, 0 for the
+            // nominal speed of the driver (1050 large, 1560 medium).
+            int max_speed = 0;
+            int count_per_rot = 360;
+            // Mechanical end stops, in tacho counts from where the motor
+            // starts.
+            std::optional<int> min_position;
+            std::optional<int> max_position;
+            // Time from standstill to full speed without a ramp, and from
+            // full speed to standstill when coasting or braking.
+            std::chrono::milliseconds spin_up_time{40};
+            std::chrono::milliseconds coast_time{400};
+            std::chrono::milliseconds brake_time{80};
+        };
+
+        struct color_reading {
+            int color = 0;          // 0 (none) to 7 (brown), see color_sensor::color()
+            int reflected = 0;      // percent
+            int ambient = 0;        // percent
+            int red = 0, green = 0, blue = 0;   // 0 to 1020
+        };
+
+        explicit SimSystem(std::string sys_root = "/sim");
+        ~SimSystem() override;
+
+        SimSystem(const SimSystem &) = delete;
+        SimSystem& operator=(const SimSystem &) = delete;
+
+        std::unique_ptr<file_ostream> OpenForWrite(const std::string &path) const override;
+        std::unique_ptr<file_istream> OpenForRead(const std::string &path) const override;
+        void System(const char *command) const override;
+        void ListFiles(zstring_ref dir, const std::function<bool(zstring_ref)>& fileFound) const override;
+        const std::string &get_sys_root() const override { return _sys_root; }
+
+        // Return the index N of the new motorN / sensorN.
+        std::size_t add_motor(const motor_config &config);
+        std::size_t add_sensor(const std::string &address, const std::string &driver_name);
+
+        void advance(std::chrono::nanoseconds time);
+        void follow_clock(double scale = 1.0);
+        std::chrono::nanoseconds now() const;
+
+        // Where the motor shaft is, in tacho counts from where it started.
+        // Unlike the position attribute this is not changed by reset or by
+        // writing position.
+        double shaft_position(std::size_t motor) const;
+
+        void set_touch(std::size_t sensor, bool pressed);
+        void set_color(std::size_t sensor, const color_reading &reading);
+        // The gyro angle integrates the rate over simulated time.
+        void set_gyro_rate(std::size_t sensor, double degrees_per_second);
+
+    private:
+        struct sim_motor;
+        struct sim_sensor;
+        class istream;
+        class ostream;
+
+        // All of these must hold _mutex. read() and write() return an errno
+        // value, write() without a value only checks the attribute exists.
+        void sync() const;
+        void run_for(std::chrono::nanoseconds time) const;
+        int read(const std::string &path, std::string &text) const;
+        int write(const std::string &path, std::optional<std::string_view> value) const;
+        std::pair<sim_motor*, sim_sensor*> find(std::string_view path, std::string_view &attribute) const;
+
+        std::string _sys_root;
+        mutable std::mutex _mutex;
+        mutable std::vector<std::unique_ptr<sim_motor>> _motors;
+        mutable std::vector<std::unique_ptr<sim_sensor>> _sensors;
+        mutable std::chrono::nanoseconds _now{0};
+        // Simulated time not stepped yet, less than a step.
+        mutable std::chrono::nanoseconds _pending{0};
+        double _scale = 0;
+        mutable std::chrono::steady_clock::time_point _last_sync;
+};
+
 } // namespace ev3dev
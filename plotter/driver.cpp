@@ -43,14 +43,15 @@ bool state::draw(ev3plotter::display& d, bool force_redraw) {
         std::string_view overlay_text{"[{}|{},{}]"};
         char buffer[256];
         if (homed_) {
+            const auto snapshot{snapshot_.read()};
             overlay_text = {buffer,
                             fmt::format_to_n(
                                 buffer,
                                 std::size(buffer),
                                 overlay_text,
-                                pos::read_z(*this),
-                                pos::read_x(*this),
-                                pos::read_y(*this))
+                                pos::read_z(*this, snapshot),
+                                pos::read_x(*this, snapshot),
+                                pos::read_y(*this, snapshot))
                                 .size};
         } else {
             overlay_text = {buffer,
@@ -208,6 +209,7 @@ void commands::home(
                 break;
 
             case home::stop:
+                s_.snapshot_.update();
                 return done_(results_);
 
             case home::stop_failed:
@@ -263,12 +265,7 @@ void commands::home(
             }
         }
 
-        auto has_state(ev3dev::motor& motor, const std::string& state) {
-            const auto& current_states = motor.state();
-            return current_states.find(state) != current_states.end();
-        }
-
-        bool stalled(ev3dev::motor& motor) { return has_state(motor, motor.state_stalled); }
+        bool stalled(ev3dev::motor& motor) { return motor.is_stalled(); }
 
         void start_motor(ev3dev::motor& motor, int cycle_sp) {
             motor.set_polarity(motor.polarity_normal).set_duty_cycle_sp(cycle_sp).run_direct();
@@ -324,17 +321,23 @@ void commands::go(
             , y_{y}
             , z_{z}
             , done_{std::move(done)} {
+            // One group, so X and Y start as close together as possible.
+            auto& group{s.moves_};
+            group.clear();
+
             if (x) {
-                s.x_motor.set_stop_action("hold").set_speed_sp(speed_x).set_position_sp(x->get()).run_to_abs_pos();
+                group.add(s.x_motor).stop_action(ev3dev::motor::stop_action_hold).speed_sp(speed_x).position_sp(x->get());
             }
 
             if (y) {
-                s.y_motor.set_stop_action("hold").set_speed_sp(speed_y).set_position_sp(y->get()).run_to_abs_pos();
+                group.add(s.y_motor).stop_action(ev3dev::motor::stop_action_hold).speed_sp(speed_y).position_sp(y->get());
             }
 
             if (z) {
-                s.tool_motor.set_stop_action("hold").set_speed_sp(200).set_position_sp(z->get()).run_to_abs_pos();
+                group.add(s.tool_motor).stop_action(ev3dev::motor::stop_action_hold).speed_sp(200).position_sp(z->get());
             }
+
+            group.run_to_abs_pos();
         }
 
         void step() {
@@ -342,17 +345,21 @@ void commands::go(
                 return;
             }
 
+            // One batched read of all positions, which the overlay shows too.
+            s_.snapshot_.update();
+            const auto snapshot{s_.snapshot_.read()};
+
             bool all_reached{true};
             if (x_) {
-                all_reached = all_reached && raw_pos{s_.x_motor.position()} == *x_;
+                all_reached = all_reached && raw_pos{state::position(snapshot, s_.x_entry, s_.x_motor)} == *x_;
             }
 
             if (y_) {
-                all_reached = all_reached && raw_pos{s_.y_motor.position()} == *y_;
+                all_reached = all_reached && raw_pos{state::position(snapshot, s_.y_entry, s_.y_motor)} == *y_;
             }
 
             if (z_) {
-                all_reached = all_reached && raw_pos{s_.tool_motor.position()} == *z_;
+                all_reached = all_reached && raw_pos{state::position(snapshot, s_.tool_entry, s_.tool_motor)} == *z_;
             }
 
             if (! all_reached) {
@@ -410,6 +417,28 @@ normalized_pos pos::read_z(const state& s) noexcept {
     return detail::to_norm(s.homed_->tool_down_pos, s.homed_->tool_up_pos, raw_pos{s.tool_motor.position()});
 }
 
+normalized_pos pos::read_x(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept {
+    if (! s.x_entry) {
+        return read_x(s);
+    }
+    return detail::to_norm(s.homed_->x_min, s.homed_->x_max, raw_pos{snapshot.motors[*s.x_entry].position});
+}
+
+normalized_pos pos::read_y(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept {
+    if (! s.y_entry) {
+        return read_y(s);
+    }
+    return detail::to_norm(s.homed_->y_min, s.homed_->y_max, raw_pos{snapshot.motors[*s.y_entry].position});
+}
+
+normalized_pos pos::read_z(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept {
+    if (! s.tool_entry) {
+        return read_z(s);
+    }
+    return detail::to_norm(
+        s.homed_->tool_down_pos, s.homed_->tool_up_pos, raw_pos{snapshot.motors[*s.tool_entry].position});
+}
+
 normalized_pos pos::advanced_x(const state& s, normalized_pos by) noexcept {
     return detail::clamp(read_x(s) + by, normalized_pos{0}, x_travel(*s.homed_));
 }
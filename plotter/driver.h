@@ -7,6 +7,7 @@
 #include "gcode_state.h"
 
 #include <functional>
+#include <optional>
 #include <variant>
 #include <string>
 
@@ -43,7 +44,22 @@ namespace ev3plotter {
     class Scheduler;
 
     struct state {
-        state(Scheduler& scheduler, ev3dev::ISystem& sys = ev3dev::default_system) : scheduler_{scheduler}, tool_motor{ev3dev::OUTPUT_A, sys},x_motor{ev3dev::OUTPUT_B, sys}, y_motor{ev3dev::OUTPUT_C, sys} {}
+        state(Scheduler& scheduler, ev3dev::ISystem& sys = ev3dev::default_system) : scheduler_{scheduler}, tool_motor{ev3dev::OUTPUT_A, sys},x_motor{ev3dev::OUTPUT_B, sys}, y_motor{ev3dev::OUTPUT_C, sys}, snapshot_{sys} {
+            // Every move sets stop_action and speed_sp again, mostly to the same values.
+            tool_motor.set_shadow_writes(true);
+            x_motor.set_shadow_writes(true);
+            y_motor.set_shadow_writes(true);
+
+            const auto track{[this](const ev3dev::motor& m) -> std::optional<std::size_t> {
+                if (! m.connected()) {
+                    return {};
+                }
+                return snapshot_.track(m, ev3dev::device_snapshot::read_position);
+            }};
+            tool_entry = track(tool_motor);
+            x_entry = track(x_motor);
+            y_entry = track(y_motor);
+        }
 
         std::unique_ptr<IWidget::widget_state> widget_;
         bool changed_{false};
@@ -59,6 +75,23 @@ namespace ev3plotter {
         ev3dev::large_motor x_motor;
         ev3dev::large_motor y_motor;
 
+        // Motor positions as of the last update() by the homing and move
+        // commands, draw() shows them without reading sysfs. Only connected
+        // motors have an entry.
+        ev3dev::device_snapshot snapshot_;
+        std::optional<std::size_t> tool_entry;
+        std::optional<std::size_t> x_entry;
+        std::optional<std::size_t> y_entry;
+
+        // Position of `m` in `snapshot` if it is tracked, else read from the
+        // motor, which throws if it is not connected.
+        static int position(const ev3dev::device_snapshot::data& snapshot, const std::optional<std::size_t>& entry, const ev3dev::motor& m) {
+            return entry ? snapshot.motors[*entry].position : m.position();
+        }
+
+        // Starts the motors of every move, its stats() tell how far apart.
+        ev3dev::motor_group moves_;
+
         void handle_events();
         void set_widget(std::unique_ptr<IWidget::widget_state> widget);
         bool draw(ev3plotter::display &d, bool force_redraw);
@@ -100,6 +133,11 @@ namespace ev3plotter {
         normalized_pos read_y(const state& s) noexcept;
         normalized_pos read_z(const state& s) noexcept;
 
+        // Same, from a snapshot of the positions.
+        normalized_pos read_x(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept;
+        normalized_pos read_y(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept;
+        normalized_pos read_z(const state& s, const ev3dev::device_snapshot::data& snapshot) noexcept;
+
         normalized_pos x_travel(const homing_results &h) noexcept;
         normalized_pos y_travel(const homing_results &h) noexcept;
         normalized_pos z_travel(const homing_results &h) noexcept;
@@ -1,5 +1,6 @@
 #include <atomic>
 #include <chrono>
+#include <cstdlib>
 #include <display.h>
 #include <driver.h>
 #include <ev3dev.h>
@@ -8,6 +9,7 @@
 #include "server.h"
 #include <mutex>
 #include <numeric>
+#include <optional>
 #include <scheduler.h>
 #include <string>
 #include <string_view>
@@ -142,7 +144,18 @@ int main() {
 
     ev3dev::lcd display{};
 
-    state s{sch};
+    // EV3DEV_IO_STATS=<file> measures the motor I/O and writes it to <file>
+    // on exit, as JSON if the name ends in .json.
+    std::optional<ev3dev::InstrumentedSystem> io_stats;
+    if (const char* file = std::getenv("EV3DEV_IO_STATS")) {
+        const std::string_view name{file};
+        const bool json{name.size() >= 5 && name.substr(name.size() - 5) == ".json"};
+        io_stats.emplace(ev3dev::default_system);
+        io_stats->dump_at_exit(file, json ? ev3dev::InstrumentedSystem::format::json
+                                          : ev3dev::InstrumentedSystem::format::text);
+    }
+
+    state s{sch, io_stats ? static_cast<ev3dev::ISystem&>(*io_stats) : ev3dev::default_system};
 
     const StaticMenu* main_menu_ptr{};
 
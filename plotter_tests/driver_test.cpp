@@ -3,6 +3,7 @@
 #include <scheduler.h>
 #include <sstream>
 #include <string>
+#include <system_error>
 #include <unordered_map>
 #include <algorithm>
 
@@ -345,3 +346,57 @@ TEST_CASE("home() will run all motors till they stall and report stalled values"
     REQUIRE(results.tool_up_pos.get() == -10);
     REQUIRE(results.tool_down_pos.get() == 25);
 }
+
+TEST_CASE("go() runs the motors to the target on a simulated plotter") {
+    ev3dev::SimSystem sim;
+    for (const auto* address : {ev3dev::OUTPUT_A, ev3dev::OUTPUT_B, ev3dev::OUTPUT_C}) {
+        ev3dev::SimSystem::motor_config config;
+        config.address = address;
+        config.driver_name = address == ev3dev::OUTPUT_A ? ev3dev::motor::motor_medium : ev3dev::motor::motor_large;
+        sim.add_motor(config);
+    }
+
+    Scheduler scheduler{[&] { sim.advance(std::chrono::milliseconds{200}); }};
+    state s{scheduler, sim};
+
+    bool done{false};
+    commands::go(s, scheduler, raw_pos{300}, raw_pos{-450}, raw_pos{20}, 200, 300, [&] { done = true; });
+    scheduler.run();
+
+    REQUIRE(done);
+    REQUIRE(s.x_motor.position() == 300);
+    REQUIRE(s.y_motor.position() == -450);
+    REQUIRE(s.tool_motor.position() == 20);
+    REQUIRE(sim.now() >= std::chrono::milliseconds{1500});
+    REQUIRE(sim.now() < std::chrono::seconds{3});
+}
+
+TEST_CASE("go() with a motor missing moves the others and fails for it") {
+    ev3dev::SimSystem sim;
+    for (const auto* address : {ev3dev::OUTPUT_B, ev3dev::OUTPUT_C}) {
+        ev3dev::SimSystem::motor_config config;
+        config.address = address;
+        config.driver_name = ev3dev::motor::motor_large;
+        sim.add_motor(config);
+    }
+
+    Scheduler scheduler{[&] { sim.advance(std::chrono::milliseconds{200}); }};
+    state s{scheduler, sim};
+    REQUIRE(! s.tool_entry);
+    REQUIRE(s.x_entry);
+    REQUIRE(s.y_entry);
+
+    bool done{false};
+    commands::go(s, scheduler, raw_pos{300}, raw_pos{-450}, {}, 200, 300, [&] { done = true; });
+    scheduler.run();
+    REQUIRE(done);
+    REQUIRE(s.x_motor.position() == 300);
+    REQUIRE(s.y_motor.position() == -450);
+
+    REQUIRE_THROWS_AS(
+        [&] {
+            commands::go(s, scheduler, {}, {}, raw_pos{20}, [] {});
+            scheduler.run();
+        }(),
+        std::system_error);
+}
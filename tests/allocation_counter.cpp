@@ -0,0 +1,26 @@
+#include "allocation_counter.h"
+
+#include <atomic>
+#include <cstdlib>
+#include <new>
+
+// Kept in its own translation unit so the replaced operators are never
+// inlined into (and cross-checked against) the code under test.
+
+namespace
+{
+    std::atomic<std::size_t> g_allocations{0};
+}
+
+std::size_t ev3dev_testing::allocation_count() noexcept { return g_allocations.load(); }
+
+void* operator new(std::size_t size) {
+    ++g_allocations;
+    if (void* p = std::malloc(size)) {
+        return p;
+    }
+    throw std::bad_alloc{};
+}
+
+void operator delete(void* p) noexcept { std::free(p); }
+void operator delete(void* p, std::size_t) noexcept { std::free(p); }
@@ -0,0 +1,10 @@
+#pragma once
+
+#include <cstddef>
+
+namespace ev3dev_testing {
+
+// Number of global operator new calls made so far by this process.
+std::size_t allocation_count() noexcept;
+
+} // namespace ev3dev_testing
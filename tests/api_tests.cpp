@@ -4,8 +4,11 @@
 #include <sstream>
 #include <cstdlib>
 #include <ev3dev.h>
+#include <fake_sysfs.h>
+#include "allocation_counter.h"
 #include <unordered_map>
 #include <string_view>
+#include <thread>
 
 namespace ev3 = ev3dev;
 
@@ -148,6 +151,8 @@ namespace
             {"bin_data_format","s8"},
             {"bin_data","\x10\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0\0"},
             {"num_values","1"},
+            {"decimals","0"},
+            {"units","pct"},
             {"value0","16"}
         }},
         {"tacho-motor/motor", {
@@ -268,3 +273,1472 @@ TEST_CASE("Infrared Sensor") {
     REQUIRE(v[0] == 16);
     REQUIRE(s.bin_data() == v);
 }
+
+TEST_CASE("FdSystem") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_B, ev3::motor::motor_large)};
+    sysfs.write(dir + "position", "-1234\n");
+    sysfs.write(dir + "state", "running stalled\n");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_AUTO, sys};
+
+    REQUIRE(m.connected());
+    REQUIRE(m.address() == ev3::OUTPUT_B);
+
+    SECTION("reads") {
+        REQUIRE(m.position() == -1234);
+        REQUIRE(m.count_per_rot() == 360);
+        REQUIRE(m.polarity() == "normal");
+        REQUIRE(m.state() == std::set<std::string>{"running", "stalled"});
+    }
+
+    SECTION("re-reading sees new contents") {
+        REQUIRE(m.position() == -1234);
+        sysfs.write(dir + "position", "42\n");
+        REQUIRE(m.position() == 42);
+    }
+
+    SECTION("writes") {
+        m.set_speed_sp(500);
+        REQUIRE(sysfs.read(dir + "speed_sp") == "500");
+
+        m.set_command(ev3::motor::command_stop);
+        REQUIRE(sysfs.read(dir + "command") == "stop");
+    }
+
+    SECTION("unparsable value") {
+        sysfs.write(dir + "position", "garbage\n");
+        REQUIRE_THROWS_AS(m.position(), std::system_error);
+    }
+}
+
+TEST_CASE("Attribute handles do not allocate in steady state") {
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large);
+    sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_gyro);
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_AUTO, sys};
+    ev3::gyro_sensor g{ev3::INPUT_AUTO, sys};
+    REQUIRE(m.connected());
+    REQUIRE(g.connected());
+
+    // The first access binds the handles and opens the files.
+    int sum{m.position() + m.speed() + g.value(0)};
+    m.set_speed_sp(0).set_position_sp(0).run_to_abs_pos();
+
+    const auto before{ev3dev_testing::allocation_count()};
+    for (int i = 0; i != 100; ++i) {
+        sum += m.position() + m.speed() + g.value(0);
+        m.set_speed_sp(i).set_position_sp(i).run_to_abs_pos();
+    }
+    const auto after{ev3dev_testing::allocation_count()};
+
+    REQUIRE(sum == 0);
+    REQUIRE(after == before);
+}
+
+TEST_CASE("Attribute handles are not shared between copies") {
+    MockSystem sys;
+    sys.populate_arena({"medium_motor:0@ev3-ports:outA", "medium_motor:1@ev3-ports:outB"});
+    sys.files[sys.sys_root + "/tacho-motor/motor1/position"] = "7";
+
+    ev3::medium_motor a{ev3::OUTPUT_A, sys};
+    REQUIRE(a.position() == 42);
+
+    const ev3::medium_motor copy{a};
+    REQUIRE(copy.position() == 42);
+
+    const ev3::medium_motor b{ev3::OUTPUT_B, sys};
+    REQUIRE(b.position() == 7);
+    REQUIRE(a.position() == 42);
+}
+
+TEST_CASE("Stream table") {
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large);
+    sysfs.add_motor(1, ev3::OUTPUT_B, ev3::motor::motor_large);
+
+    ev3::FdSystem sys{sysfs.root()};
+    const auto dir{sysfs.root() + "/tacho-motor/"};
+    ev3::device a{sys};
+    ev3::device b{sys};
+    a.connect(dir, "motor", {{std::string("address"), {ev3::OUTPUT_A}}});
+    b.connect(dir, "motor", {{std::string("address"), {ev3::OUTPUT_B}}});
+    REQUIRE(a.connected());
+    REQUIRE(b.connected());
+
+    const auto base{a.cache_stats()};
+
+    SECTION("keeps every attribute of a motor open") {
+        const char* names[] = {"count_per_rot", "duty_cycle", "duty_cycle_sp", "max_speed", "position",
+                               "position_sp", "ramp_down_sp", "ramp_up_sp", "speed", "speed_sp", "time_sp"};
+        for (int pass = 0; pass != 3; ++pass) {
+            for (auto name : names) {
+                REQUIRE(a.get_attr_int(name) >= 0);
+            }
+            REQUIRE(a.get_attr_string("driver_name") == ev3::motor::motor_large);
+            REQUIRE(a.get_attr_string("polarity") == "normal");
+            REQUIRE(a.get_attr_line("commands").size() > 0);
+            REQUIRE(a.get_attr_line("stop_actions").size() > 0);
+            REQUIRE(a.get_attr_string("stop_action") == "coast");
+            REQUIRE(a.get_attr_string("address") == ev3::OUTPUT_A);
+        }
+
+        const auto stats{a.cache_stats()};
+        constexpr auto distinct{std::size(names) + 6};
+        REQUIRE(stats.misses - base.misses <= distinct);
+        REQUIRE(stats.hits - base.hits >= 2 * distinct);
+        REQUIRE(stats.evictions == 0);
+    }
+
+    SECTION("different devices on different threads") {
+        constexpr int count{2000};
+        auto worker = [](ev3::device& d) {
+            for (int i = 0; i != count; ++i) {
+                d.set_attr_int("position_sp", i);
+                if (d.get_attr_int("position_sp") != i) {
+                    return false;
+                }
+            }
+            return true;
+        };
+
+        bool ok_a{false};
+        bool ok_b{false};
+        std::thread ta{[&] { ok_a = worker(a); }};
+        std::thread tb{[&] { ok_b = worker(b); }};
+        ta.join();
+        tb.join();
+
+        REQUIRE(ok_a);
+        REQUIRE(ok_b);
+        const auto stats{a.cache_stats()};
+        REQUIRE(stats.hits + stats.misses - base.hits - base.misses == 2 * count);
+    }
+}
+
+TEST_CASE("Sensor mode writes are elided") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_sensor(0, ev3::INPUT_2, ev3::sensor::ev3_gyro)};
+
+    // Returns what was last written to `mode` and empties the file, so the
+    // next check only sees new writes.
+    auto written_mode = [&] {
+        auto m{sysfs.read(dir + "mode")};
+        sysfs.write(dir + "mode", "");
+        return m;
+    };
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::gyro_sensor g{ev3::INPUT_AUTO, sys};
+    REQUIRE(g.connected());
+
+    g.angle();
+    REQUIRE(written_mode() == ev3::gyro_sensor::mode_gyro_ang);
+
+    g.angle();
+    g.angle();
+    REQUIRE(written_mode().empty());
+
+    g.rate();
+    REQUIRE(written_mode() == ev3::gyro_sensor::mode_gyro_rate);
+
+    SECTION("re-reading the mode re-validates it") {
+        sysfs.write(dir + "mode", ev3::gyro_sensor::mode_gyro_ang);
+        REQUIRE(g.mode() == ev3::gyro_sensor::mode_gyro_ang);
+        g.rate();
+        REQUIRE(written_mode() == ev3::gyro_sensor::mode_gyro_rate);
+    }
+
+    SECTION("a failed read forgets the mode") {
+        sysfs.write(dir + "value0", "garbage");
+        REQUIRE_THROWS(g.rate());
+        written_mode();
+
+        sysfs.write(dir + "value0", "1");
+        g.rate();
+        REQUIRE(written_mode() == ev3::gyro_sensor::mode_gyro_rate);
+    }
+}
+
+TEST_CASE("Sensor mode metadata is cached per mode") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_ultrasonic)};
+    sysfs.write(dir + "value0", "1234");
+    sysfs.write(dir + "decimals", "1");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::ultrasonic_sensor us{ev3::INPUT_AUTO, sys};
+    REQUIRE(us.connected());
+
+    REQUIRE(us.distance_centimeters() == Approx(123.4f));
+    REQUIRE(us.num_values() == 1);
+    REQUIRE_THROWS_AS(us.value(1), std::invalid_argument);
+
+    // Metadata changes without a mode switch are not picked up...
+    sysfs.write(dir + "decimals", "2");
+    sysfs.write(dir + "num_values", "2");
+    REQUIRE(us.distance_centimeters() == Approx(123.4f));
+    REQUIRE(us.num_values() == 1);
+
+    // ...a mode switch reloads it.
+    us.distance_inches();
+    REQUIRE(us.decimals() == 2);
+    REQUIRE(us.num_values() == 2);
+    REQUIRE(us.float_value(0) == Approx(12.34f));
+    REQUIRE(us.value(1) == 0);
+}
+
+TEST_CASE("Sensor values snapshot") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_gyro)};
+    sysfs.write(dir + "num_values", "2");
+    // Not what bin_data holds, to tell which one was read.
+    sysfs.write(dir + "value0", "0");
+    sysfs.write(dir + "value1", "0");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::gyro_sensor g{ev3::INPUT_AUTO, sys};
+    REQUIRE(g.connected());
+
+    SECTION("decoded from bin_data") {
+        const int16_t raw[] = {-5, 300};
+        sysfs.write(dir + "bin_data", std::string(reinterpret_cast<const char*>(raw), sizeof(raw)));
+
+        const auto [first, second] = g.rate_and_angle();
+        REQUIRE(first == -5);
+        REQUIRE(second == 300);
+    }
+
+    SECTION("big endian bin_data") {
+        sysfs.write(dir + "bin_data_format", "s16_be");
+        sysfs.write(dir + "bin_data", std::string{"\xff\xfb\x01\x2c", 4});
+
+        const auto v{g.values()};
+        REQUIRE(v.size() == 2);
+        REQUIRE(v[0] == -5);
+        REQUIRE(v[1] == 300);
+    }
+
+    SECTION("falls back to value<N> for other formats") {
+        sysfs.write(dir + "bin_data_format", "float");
+        sysfs.write(dir + "value0", "-5");
+        sysfs.write(dir + "value1", "300");
+
+        const auto v{g.values()};
+        REQUIRE(std::vector<int>(v.begin(), v.end()) == std::vector<int>{-5, 300});
+        REQUIRE_THROWS_AS(v.at(2), std::invalid_argument);
+    }
+}
+
+TEST_CASE("bin_data decoding") {
+    REQUIRE(ev3::parse_bin_format("s16_be") == ev3::bin_format::s16_be);
+    REQUIRE(ev3::parse_bin_format("float") == ev3::bin_format::float32);
+    REQUIRE(ev3::parse_bin_format("s64") == ev3::bin_format::unknown);
+    REQUIRE(ev3::bin_format_size(ev3::bin_format::unknown) == 0);
+
+    SECTION("every format") {
+        const uint8_t u8[] = {0, 200, 255};
+        const int8_t s8[] = {0, -100, 127};
+        const uint16_t u16[] = {0, 60000, 1};
+        const int16_t s16[] = {-1, 300, -32768};
+        const int32_t s32[] = {-70000, 0, 70000};
+        const float f32[] = {-1.5f, 0.25f, 1e6f};
+        auto bytes = [](const auto& a) { return gsl::span<const char>{reinterpret_cast<const char*>(a), sizeof(a)}; };
+
+        int out[3];
+        auto check = [&](ev3::bin_format f, gsl::span<const char> raw, std::vector<int> expected) {
+            auto v = ev3::decode_bin_data<int>(f, raw, out);
+            REQUIRE(std::vector<int>(v.begin(), v.end()) == expected);
+        };
+        check(ev3::bin_format::u8, bytes(u8), {0, 200, 255});
+        check(ev3::bin_format::s8, bytes(s8), {0, -100, 127});
+        check(ev3::bin_format::u16, bytes(u16), {0, 60000, 1});
+        check(ev3::bin_format::s16, bytes(s16), {-1, 300, -32768});
+        check(ev3::bin_format::s32, bytes(s32), {-70000, 0, 70000});
+        check(ev3::bin_format::s16_be, std::string_view{"\xff\xfb\x01\x2c", 4}, {-5, 300});
+        check(ev3::bin_format::unknown, bytes(s32), {});
+
+        float fout[3];
+        auto fv = ev3::decode_bin_data<float>(ev3::bin_format::float32, bytes(f32), fout);
+        REQUIRE(fv.size() == 3);
+        REQUIRE(fv[0] == -1.5f);
+        REQUIRE(fv[2] == 1e6f);
+    }
+
+    SECTION("batched and scaled") {
+        std::vector<int16_t> log(1000);
+        for (std::size_t i = 0; i != log.size(); ++i) {
+            log[i] = static_cast<int16_t>(i) - 500;
+        }
+
+        std::vector<float> out(log.size());
+        auto v = ev3::decode_bin_data(
+            ev3::bin_format::s16,
+            {reinterpret_cast<const char*>(log.data()), log.size() * sizeof(int16_t)},
+            out,
+            0.1f);
+        REQUIRE(v.size() == log.size());
+        REQUIRE(v[0] == Approx(-50.0f));
+        REQUIRE(v[999] == Approx(49.9f));
+    }
+
+    SECTION("output shorter than input") {
+        const int16_t s16[] = {1, 2, 3, 4};
+        int16_t out[2];
+        auto v = ev3::decode_bin_data<int16_t>(
+            ev3::bin_format::s16, {reinterpret_cast<const char*>(s16), sizeof(s16)}, out);
+        REQUIRE(v.size() == 2);
+        REQUIRE(v[1] == 2);
+    }
+}
+
+TEST_CASE("Sensor bin_values") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::nxt_i2c_sensor)};
+    sysfs.write(dir + "num_values", "2");
+    const int16_t raw[] = {-5, 300};
+    sysfs.write(dir + "bin_data", std::string(reinterpret_cast<const char*>(raw), sizeof(raw)));
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::sensor s{ev3::INPUT_AUTO, sys};
+    REQUIRE(s.connected());
+
+    SECTION("native type") {
+        int16_t out[8];
+        auto v = s.bin_values<int16_t>(out);
+        REQUIRE(v.size() == 2);
+        REQUIRE(v[0] == -5);
+        REQUIRE(v[1] == 300);
+    }
+
+    SECTION("converted") {
+        double out[1];
+        auto v = s.bin_values<double>(out);
+        REQUIRE(v.size() == 1);
+        REQUIRE(v[0] == -5.0);
+    }
+
+    SECTION("unknown format") {
+        sysfs.write(dir + "bin_data_format", "s64");
+        s.set_mode("OTHER");
+        int out[2];
+        REQUIRE_THROWS_AS(s.bin_values<int>(out), std::system_error);
+    }
+}
+
+TEST_CASE("Device registry") {
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_medium);
+    sysfs.add_motor(1, ev3::OUTPUT_B, ev3::motor::motor_large);
+    sysfs.add_motor(2, ev3::OUTPUT_C, ev3::motor::motor_large);
+
+    ev3::FdSystem sys{sysfs.root()};
+    auto& registry{sys.registry()};
+
+    ev3::medium_motor a{ev3::OUTPUT_AUTO, sys};
+    ev3::large_motor b{ev3::OUTPUT_B, sys};
+    ev3::large_motor c{ev3::OUTPUT_C, sys};
+    ev3::motor any{ev3::OUTPUT_C, sys};
+    REQUIRE(a.connected());
+    REQUIRE(b.connected());
+    REQUIRE(c.connected());
+    REQUIRE(any.connected());
+    REQUIRE(a.address() == ev3::OUTPUT_A);
+    REQUIRE(c.device_index() == 2);
+    REQUIRE(any.device_index() == 2);
+    REQUIRE(registry.scans() == 1);
+
+    SECTION("driver and address must both match") {
+        ev3::medium_motor wrong{ev3::OUTPUT_B, sys};
+        REQUIRE(!wrong.connected());
+    }
+
+    SECTION("a device plugged in later is found") {
+        sysfs.add_motor(3, ev3::OUTPUT_D, ev3::motor::motor_large);
+        ev3::large_motor d{ev3::OUTPUT_D, sys};
+        REQUIRE(d.connected());
+        REQUIRE(d.device_index() == 3);
+        REQUIRE(registry.scans() == 2);
+    }
+
+    SECTION("an unplugged device is not connected") {
+        sysfs.remove_device("tacho-motor", "motor1");
+        ev3::large_motor gone{ev3::OUTPUT_B, sys};
+        REQUIRE(!gone.connected());
+        REQUIRE(registry.find(sysfs.root() + "/tacho-motor/", "motor", {{"address", {ev3::OUTPUT_B}}}).empty());
+
+        sysfs.add_motor(1, ev3::OUTPUT_B, ev3::motor::motor_large);
+        std::this_thread::sleep_for(ev3::device_registry::refresh_interval);
+        ev3::large_motor back{ev3::OUTPUT_B, sys};
+        REQUIRE(back.connected());
+    }
+
+    SECTION("misses in a row list the directory once") {
+        for (int i = 0; i != 10; ++i) {
+            ev3::large_motor missing{ev3::OUTPUT_D, sys};
+            REQUIRE(!missing.connected());
+        }
+        REQUIRE(registry.scans() == 2);
+    }
+
+    SECTION("\".\" and \"..\" are not read as devices") {
+        const ev3::InstrumentedSystem instrumented{sys};
+        ev3::large_motor m{ev3::OUTPUT_B, instrumented};
+        REQUIRE(m.connected());
+        for (const auto& p : instrumented.stats())
+            REQUIRE(p.path.find("/.") == std::string::npos);
+    }
+}
+
+TEST_CASE("Device watcher") {
+    using namespace std::chrono_literals;
+
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large);
+    sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch);
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::device_watcher watcher{sys, ev3::device_watcher::source::inotify};
+
+    std::vector<ev3::device_watcher::event> events;
+    watcher.subscribe([&](const ev3::device_watcher::event& e) { events.push_back(e); });
+
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+    REQUIRE(m.position() == 0);
+
+    SECTION("unplug and replug") {
+        sysfs.remove_device("tacho-motor", "motor0");
+        REQUIRE(watcher.dispatch(1s) == 1);
+        REQUIRE(events.size() == 1);
+        REQUIRE(events[0].kind == ev3::device_watcher::event::removed);
+        REQUIRE(events[0].class_dir == sysfs.root() + "/tacho-motor/");
+        REQUIRE(events[0].name == "motor0");
+
+        // The open file is dropped, no stale read.
+        REQUIRE_THROWS_AS(m.position(), std::system_error);
+
+        sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large);
+        sysfs.write(sysfs.root() + "/tacho-motor/motor0/position", "42");
+        REQUIRE(watcher.dispatch(1s) >= 1);
+        REQUIRE(events.back().kind == ev3::device_watcher::event::added);
+        REQUIRE(m.position() == 42);
+    }
+
+    SECTION("new devices go into the registry without a rescan") {
+        const auto scans{sys.registry().scans()};
+
+        sysfs.add_motor(1, ev3::OUTPUT_B, ev3::motor::motor_medium);
+        REQUIRE(watcher.dispatch(1s) >= 1);
+
+        ev3::medium_motor b{ev3::OUTPUT_B, sys};
+        REQUIRE(b.connected());
+        REQUIRE(sys.registry().scans() == scans);
+    }
+
+    SECTION("background thread") {
+        std::atomic<int> removed{0};
+        watcher.subscribe([&](const ev3::device_watcher::event& e) {
+            if (e.kind == ev3::device_watcher::event::removed) {
+                ++removed;
+            }
+        });
+        watcher.start();
+        sysfs.remove_device("lego-sensor", "sensor0");
+        for (int i = 0; i != 200 && removed == 0; ++i) {
+            std::this_thread::sleep_for(5ms);
+        }
+        watcher.stop();
+        REQUIRE(removed == 1);
+    }
+}
+
+TEST_CASE("Waiting for attribute changes") {
+    using namespace std::chrono_literals;
+    using clock = std::chrono::steady_clock;
+
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    sysfs.write(dir + "state", "running ramping");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+
+    SECTION("condition already met") {
+        REQUIRE(m.wait_until(ev3::motor::state_running, 0ms));
+    }
+
+    SECTION("times out") {
+        const auto start{clock::now()};
+        REQUIRE(!m.wait_while(ev3::motor::state_running, 30ms));
+        REQUIRE(clock::now() - start >= 30ms);
+    }
+
+    SECTION("wakes up on change") {
+        std::thread t{[&] {
+            std::this_thread::sleep_for(20ms);
+            sysfs.write(dir + "state", "holding");
+        }};
+
+        // The fake file is truncated before it is rewritten, so wait for the
+        // new flag rather than for the old one to go away.
+        const auto start{clock::now()};
+        const bool holding{m.wait_until(ev3::motor::state_holding, 5s)};
+        const auto elapsed{clock::now() - start};
+        t.join();
+
+        REQUIRE(holding);
+        REQUIRE(elapsed < 1s);
+    }
+
+    SECTION("any attribute") {
+        std::thread t{[&] {
+            std::this_thread::sleep_for(10ms);
+            sysfs.write(dir + "position", "720");
+        }};
+
+        const bool reached{m.watch("position", [](const std::string& v) { return !v.empty() && std::stoi(v) >= 360; }, 5s)};
+        t.join();
+        REQUIRE(reached);
+    }
+
+    SECTION("through ifstreams") {
+        ev3::RealSystem real{sysfs.root()};
+        ev3::large_motor rm{ev3::OUTPUT_A, real};
+        REQUIRE(rm.connected());
+
+        std::thread t{[&] {
+            std::this_thread::sleep_for(20ms);
+            sysfs.write(dir + "state", "holding");
+        }};
+
+        const bool holding{rm.wait_until(ev3::motor::state_holding, 5s)};
+        t.join();
+        REQUIRE(holding);
+
+        // Wrappers hand the descriptor through.
+        const ev3::InstrumentedSystem instrumented{real};
+        auto is{instrumented.OpenForPoll(dir + "state")};
+        is->prepare(dir + "state");
+        REQUIRE(is->native_handle() >= 0);
+    }
+}
+
+TEST_CASE("Motor state flags") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+
+    REQUIRE(m.state_flags() == 0);
+    REQUIRE(!m.is_running());
+
+    sysfs.write(dir + "state", "running ramping stalled\n");
+    REQUIRE(m.state_flags() == (ev3::motor::flag_running | ev3::motor::flag_ramping | ev3::motor::flag_stalled));
+    REQUIRE(m.is_running());
+    REQUIRE(m.is_stalled());
+
+    sysfs.write(dir + "state", "holding overloaded unknown");
+    REQUIRE(m.state_flags() == (ev3::motor::flag_holding | ev3::motor::flag_overloaded));
+    REQUIRE(ev3::motor::flags_from_state("holding overloaded unknown") == m.state_flags());
+
+    int stalled{0};
+    const auto before{ev3dev_testing::allocation_count()};
+    for (int i = 0; i != 100; ++i) {
+        stalled += m.is_stalled();
+    }
+    const auto after{ev3dev_testing::allocation_count()};
+    REQUIRE(stalled == 0);
+    REQUIRE(after == before);
+}
+
+TEST_CASE("Constant attributes are read once per connection") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+
+    const auto before{m.cache_stats()};
+    REQUIRE(m.driver_name() == ev3::motor::motor_large);
+    REQUIRE(m.address() == ev3::OUTPUT_A);
+    REQUIRE(m.cache_stats().misses == before.misses);
+    REQUIRE(m.cache_stats().hits == before.hits);
+
+    REQUIRE(m.max_speed() == 1050);
+    REQUIRE(m.count_per_rot() == 360);
+    REQUIRE(m.stop_actions().count(ev3::motor::stop_action_hold) == 1);
+
+    sysfs.write(dir + "max_speed", "1");
+    sysfs.write(dir + "stop_actions", "coast");
+    REQUIRE(m.max_speed() == 1050);
+    REQUIRE(m.stop_actions().size() == 3);
+
+    const auto copy{m};
+    REQUIRE(copy.max_speed() == 1050);
+}
+
+TEST_CASE("Shadow writes") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+    REQUIRE(!m.shadow_writes());
+
+    // Reads and empties an attribute, empty means nothing was written since.
+    auto written = [&](const std::string &name) {
+        const auto value{sysfs.read(dir + name)};
+        sysfs.write(dir + name, "");
+        return value;
+    };
+    written("stop_action");
+
+    m.set_speed_sp(100);
+    m.set_speed_sp(100);
+    REQUIRE(written("speed_sp") == "100");
+    REQUIRE(m.elided_writes() == 0);
+
+    m.set_shadow_writes(true);
+    m.set_speed_sp(100).set_stop_action("hold");
+    REQUIRE(written("speed_sp") == "100");
+    REQUIRE(written("stop_action") == "hold");
+
+    m.set_speed_sp(100).set_stop_action("hold");
+    REQUIRE(written("speed_sp").empty());
+    REQUIRE(written("stop_action").empty());
+    REQUIRE(m.elided_writes() == 2);
+
+    m.set_speed_sp(200);
+    REQUIRE(written("speed_sp") == "200");
+
+    SECTION("commands and position always go through") {
+        m.stop();
+        m.stop();
+        REQUIRE(written("command") == "stop");
+        m.set_position(0);
+        m.set_position(0);
+        REQUIRE(written("position") == "0");
+        REQUIRE(m.elided_writes() == 2);
+    }
+
+    SECTION("reset forgets the written values") {
+        m.reset();
+        m.set_speed_sp(200);
+        REQUIRE(written("speed_sp") == "200");
+    }
+
+    SECTION("forget_writes") {
+        m.forget_writes();
+        m.set_speed_sp(200);
+        REQUIRE(written("speed_sp") == "200");
+    }
+}
+
+namespace
+{
+    // FdSystem that logs the file name of every write, in order.
+    struct write_log_system : ev3::FdSystem {
+        using FdSystem::FdSystem;
+
+        struct write_log_ostream : ev3::file_ostream {
+            write_log_ostream(std::unique_ptr<ev3::file_ostream> os, std::string name, const write_log_system &sys)
+                : _os{std::move(os)}, _name{std::move(name)}, _sys{sys} {}
+
+            bool is_open() const override { return _os->is_open(); }
+            void close() override { _os->close(); }
+            void clear() override { _os->clear(); }
+            void prepare(const std::string &path) override { _os->prepare(path); }
+
+            std::ostream& get() override { return _os->get(); }
+            const std::ostream& get() const override { return _os->get(); }
+
+            bool write_int(int value) override {
+                _sys.record(_name);
+                return _os->write_int(value);
+            }
+
+            bool write_string(std::string_view value) override {
+                _sys.record(_name);
+                return _os->write_string(value);
+            }
+
+        private:
+            std::unique_ptr<ev3::file_ostream> _os;
+            std::string _name;
+            const write_log_system &_sys;
+        };
+
+        std::unique_ptr<ev3::file_ostream> OpenForWrite(const std::string &path) const override {
+            return std::make_unique<write_log_ostream>(
+                FdSystem::OpenForWrite(path), path.substr(path.rfind('/') + 1), *this);
+        }
+
+        void record(const std::string &name) const {
+            std::lock_guard<std::mutex> lock{mutex};
+            writes.push_back(name);
+        }
+
+        mutable std::mutex mutex;
+        mutable std::vector<std::string> writes;
+    };
+}
+
+TEST_CASE("Motor configure transaction") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+
+    write_log_system sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+    sysfs.write(dir + "stop_action", "");
+
+    const auto latency{m.configure()
+        .position_sp(90)
+        .speed_sp(500)
+        .stop_action(ev3::motor::stop_action_hold)
+        .run_to_abs_pos()};
+
+    REQUIRE(latency.count() > 0);
+    REQUIRE(sys.writes == std::vector<std::string>{"stop_action", "speed_sp", "position_sp", "command"});
+    REQUIRE(sysfs.read(dir + "stop_action") == "hold");
+    REQUIRE(sysfs.read(dir + "speed_sp") == "500");
+    REQUIRE(sysfs.read(dir + "position_sp") == "90");
+    REQUIRE(sysfs.read(dir + "command") == "run-to-abs-pos");
+
+    SECTION("a transaction is empty after commit") {
+        auto t{m.configure()};
+        t.time_sp(100).run_timed();
+        sys.writes.clear();
+        t.apply();
+        REQUIRE(sys.writes.empty());
+    }
+}
+
+TEST_CASE("Motor group") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir_a{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    const auto dir_b{sysfs.add_motor(1, ev3::OUTPUT_B, ev3::motor::motor_large)};
+
+    write_log_system sys{sysfs.root()};
+    ev3::large_motor a{ev3::OUTPUT_A, sys};
+    ev3::large_motor b{ev3::OUTPUT_B, sys};
+    REQUIRE(a.connected());
+    REQUIRE(b.connected());
+
+    SECTION("setpoints go out before the commands") {
+        ev3::motor_group group;
+        group.add(a).speed_sp(300).position_sp(1000);
+        group.add(b).speed_sp(150).position_sp(500);
+        REQUIRE(group.size() == 2);
+
+        const auto skew{group.run_to_abs_pos()};
+        REQUIRE(sys.writes == std::vector<std::string>{
+            "speed_sp", "position_sp", "speed_sp", "position_sp", "command", "command"});
+        REQUIRE(sysfs.read(dir_a + "position_sp") == "1000");
+        REQUIRE(sysfs.read(dir_b + "position_sp") == "500");
+        REQUIRE(sysfs.read(dir_b + "command") == "run-to-abs-pos");
+
+        REQUIRE(group.stats().count == 1);
+        REQUIRE(group.stats().last == skew);
+        REQUIRE(group.stats().max == skew);
+
+        group.clear();
+        group.add(b).position_sp(2000);
+        group.run_to_abs_pos();
+        REQUIRE(group.size() == 1);
+        REQUIRE(sysfs.read(dir_b + "position_sp") == "2000");
+        REQUIRE(sysfs.read(dir_a + "position_sp") == "1000");
+        REQUIRE(group.stats().count == 2);
+    }
+
+    SECTION("parallel dispatch") {
+        ev3::motor_group group{ev3::motor_group::dispatch::parallel};
+        group.add(a).time_sp(100);
+        group.add(b).time_sp(200);
+
+        group.run_timed();
+        REQUIRE(sysfs.read(dir_a + "command") == "run-timed");
+        REQUIRE(sysfs.read(dir_b + "command") == "run-timed");
+        REQUIRE(sysfs.read(dir_b + "time_sp") == "200");
+        REQUIRE(group.stats().count == 1);
+    }
+}
+
+TEST_CASE("I/O worker") {
+    SECTION("tasks run in order and return through futures") {
+        ev3::io_worker io;
+        std::vector<int> order;
+        for (int i = 0; i < 100; ++i)
+            io.post([&order, i] { order.push_back(i); });
+
+        auto size{io.submit([&order] { return order.size(); })};
+        REQUIRE(size.get() == 100);
+        for (int i = 0; i < 100; ++i)
+            REQUIRE(order[static_cast<std::size_t>(i)] == i);
+    }
+
+    SECTION("many producers") {
+        constexpr int producers{4};
+        constexpr int per_producer{10000};
+
+        std::atomic<int> sum{0};
+        {
+            ev3::io_worker io;
+            std::vector<std::thread> threads;
+            for (int p = 0; p < producers; ++p) {
+                threads.emplace_back([&io, &sum] {
+                    for (int i = 0; i < per_producer; ++i)
+                        io.post([&sum] { sum.fetch_add(1, std::memory_order_relaxed); });
+                });
+            }
+            for (auto &t : threads)
+                t.join();
+        }
+        REQUIRE(sum.load() == producers * per_producer);
+    }
+
+    SECTION("errors") {
+        std::atomic<int> handled{0};
+        ev3::io_worker io{[&handled](std::exception_ptr) { ++handled; }};
+
+        io.post([] { throw std::runtime_error("post"); });
+        auto f{io.submit([]() -> int { throw std::runtime_error("submit"); })};
+        REQUIRE_THROWS_AS(f.get(), std::runtime_error);
+
+        io.drain();
+        REQUIRE(io.errors() == 1);
+        REQUIRE(handled.load() == 1);
+    }
+
+    SECTION("device I/O") {
+        ev3dev_testing::fake_sysfs sysfs;
+        const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+        ev3::FdSystem sys{sysfs.root()};
+        ev3::large_motor m{ev3::OUTPUT_A, sys};
+        REQUIRE(m.connected());
+
+        ev3::io_worker io;
+        io.post([&m] { m.set_speed_sp(321); });
+        REQUIRE(io.submit([&m] { return m.speed_sp(); }).get() == 321);
+    }
+}
+
+TEST_CASE("Read batch") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto motor_dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch)};
+
+    auto check = [&](const ev3::ISystem &sys, ev3::read_batch::backend preferred) {
+        ev3::large_motor m{ev3::OUTPUT_A, sys};
+        ev3::touch_sensor s{ev3::INPUT_1, sys};
+        REQUIRE(m.connected());
+        REQUIRE(s.connected());
+
+        ev3::read_batch batch{sys, preferred};
+        const auto position{batch.add(m, "position")};
+        const auto state{batch.add(m, "state")};
+        const auto value{batch.add(s, "value0")};
+        REQUIRE(batch.size() == 3);
+
+        sysfs.write(motor_dir + "position", "-42\n");
+        sysfs.write(motor_dir + "state", "running stalled\n");
+        sysfs.write(sensor_dir + "value0", "1\n");
+        batch.submit();
+        REQUIRE(batch.value(position) == -42);
+        REQUIRE(batch.text(state) == "running stalled");
+        REQUIRE(batch.value(value) == 1);
+
+        sysfs.write(motor_dir + "position", "7\n");
+        batch.submit();
+        REQUIRE(batch.value(position) == 7);
+        REQUIRE(!batch.error(position));
+
+        // One value that does not parse spoils only its own slot.
+        sysfs.write(motor_dir + "position", "garbage\n");
+        sysfs.write(sensor_dir + "value0", "0\n");
+        REQUIRE(batch.submit() == 0);
+        REQUIRE_THROWS_AS(batch.value(position), std::system_error);
+        REQUIRE(batch.value(value) == 0);
+
+        REQUIRE_THROWS_AS(batch.add(m, "no_such_attribute"), std::system_error);
+        REQUIRE(batch.size() == 3);
+
+        return batch.active_backend();
+    };
+
+    const ev3::FdSystem fd_system{sysfs.root()};
+    const ev3::RealSystem stream_system{sysfs.root()};
+
+    SECTION("io_uring, or pread where it is not available") {
+        const auto used{check(fd_system, ev3::read_batch::backend::io_uring)};
+        REQUIRE((used == ev3::read_batch::backend::io_uring || used == ev3::read_batch::backend::pread));
+    }
+
+    SECTION("pread") {
+        REQUIRE(check(fd_system, ev3::read_batch::backend::automatic) == ev3::read_batch::backend::pread);
+    }
+
+    SECTION("streams") {
+        REQUIRE(check(stream_system, ev3::read_batch::backend::automatic) == ev3::read_batch::backend::stream);
+    }
+}
+
+TEST_CASE("SPSC ring") {
+    ev3::spsc_ring<int> ring{5};
+    REQUIRE(ring.capacity() == 8);
+
+    int value{0};
+    REQUIRE(!ring.pop(value));
+    for (int i = 0; i < 8; ++i)
+        REQUIRE(ring.push(i));
+    REQUIRE(!ring.push(8));
+    REQUIRE(ring.size() == 8);
+
+    REQUIRE(ring.pop(value));
+    REQUIRE(value == 0);
+    REQUIRE(ring.push(8));
+
+    SECTION("across threads") {
+        ev3::spsc_ring<int> r{64};
+        constexpr int count{100000};
+
+        std::thread producer{[&r] {
+            for (int i = 0; i < count; ++i)
+                while (!r.push(i))
+                    std::this_thread::yield();
+        }};
+
+        bool in_order{true};
+        for (int expected = 0; expected < count; ++expected) {
+            int v{-1};
+            while (!r.pop(v))
+                std::this_thread::yield();
+            in_order = in_order && v == expected;
+        }
+        producer.join();
+        REQUIRE(in_order);
+    }
+}
+
+TEST_CASE("Sensor sampler") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto motor_dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch)};
+    sysfs.write(motor_dir + "position", "123\n");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    ev3::touch_sensor t{ev3::INPUT_1, sys};
+
+    ev3::sensor_sampler sampler{std::chrono::milliseconds{1}, sys};
+    const auto position{sampler.add(m, "position")};
+    const auto overlay{sampler.add(m, "position")};
+    const auto touch{sampler.add(t, "value0", 4)};
+    REQUIRE(sampler.reads_per_tick() == 2);
+
+    sampler.start();
+    REQUIRE(sampler.running());
+    REQUIRE_THROWS_AS(sampler.add(m, "speed"), std::system_error);
+
+    const auto deadline{std::chrono::steady_clock::now() + std::chrono::seconds{5}};
+    while (sampler.ticks() < 10 && std::chrono::steady_clock::now() < deadline)
+        std::this_thread::sleep_for(std::chrono::milliseconds{1});
+    sampler.stop();
+    REQUIRE(!sampler.running());
+    REQUIRE(sampler.ticks() >= 10);
+    REQUIRE(sampler.errors() == 0);
+
+    ev3::sensor_sampler::sample a, b;
+    REQUIRE(sampler.pop(position, a));
+    REQUIRE(sampler.pop(overlay, b));
+    REQUIRE(a.value == 123);
+    REQUIRE(b.value == 123);
+    REQUIRE(a.time == b.time);
+
+    ev3::sensor_sampler::sample next;
+    REQUIRE(sampler.pop(position, next));
+    REQUIRE(next.time > a.time);
+
+    REQUIRE(sampler.dropped(touch) > 0);
+    REQUIRE(sampler.dropped(position) == 0);
+    REQUIRE(sampler.failed(position) == 0);
+
+    SECTION("a broken channel does not stop the others") {
+        while (sampler.pop(position, next)) {
+        }
+        while (sampler.pop(touch, next)) {
+        }
+
+        sysfs.write(sensor_dir + "value0", "garbage\n");
+        const auto ticks{sampler.ticks()};
+        const auto again{std::chrono::steady_clock::now() + std::chrono::seconds{5}};
+        sampler.start();
+        while (sampler.ticks() < ticks + 5 && std::chrono::steady_clock::now() < again)
+            std::this_thread::sleep_for(std::chrono::milliseconds{1});
+        sampler.stop();
+
+        REQUIRE(sampler.failed(touch) >= 5);
+        REQUIRE(sampler.failed(position) == 0);
+        REQUIRE(sampler.errors() >= 5);
+        REQUIRE(sampler.pop(position, next));
+        REQUIRE(next.value == 123);
+        REQUIRE(!sampler.pop(touch, next));
+    }
+}
+
+TEST_CASE("Seqlock") {
+    struct pair_of_counters {
+        std::uint64_t a;
+        std::uint64_t b;
+        char padding[40];
+    };
+
+    ev3::seqlock<pair_of_counters> lock;
+    REQUIRE(lock.version() == 0);
+    REQUIRE(lock.load().a == 0);
+
+    constexpr std::uint64_t count{20000};
+    std::atomic<bool> done{false};
+    std::atomic<bool> torn{false};
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < 2; ++i) {
+        readers.emplace_back([&] {
+            while (!done.load()) {
+                const auto v{lock.load()};
+                if (v.a != v.b)
+                    torn = true;
+            }
+        });
+    }
+
+    for (std::uint64_t i = 1; i <= count; ++i)
+        lock.store(pair_of_counters{i, i, {}});
+    done = true;
+    for (auto &t : readers)
+        t.join();
+
+    REQUIRE(!torn.load());
+    REQUIRE(lock.version() == count);
+    REQUIRE(lock.load().a == count);
+}
+
+TEST_CASE("Device snapshot") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto motor_dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch)};
+    sysfs.write(sensor_dir + "num_values", "2");
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    ev3::touch_sensor t{ev3::INPUT_1, sys};
+
+    ev3::device_snapshot snapshot{sys};
+    const auto motor{snapshot.track(m)};
+    const auto position_only{snapshot.track(m, ev3::device_snapshot::read_position)};
+    const auto sensor{snapshot.track(t)};
+    REQUIRE(snapshot.version() == 0);
+
+    sysfs.write(motor_dir + "position", "250\n");
+    sysfs.write(motor_dir + "speed", "-90\n");
+    sysfs.write(motor_dir + "state", "running stalled\n");
+    sysfs.write(sensor_dir + "value0", "1\n");
+    sysfs.write(sensor_dir + "value1", "7\n");
+    snapshot.update();
+
+    const auto d{snapshot.read()};
+    REQUIRE(snapshot.version() == 1);
+    REQUIRE(d.motors[motor].position == 250);
+    REQUIRE(d.motors[motor].speed == -90);
+    REQUIRE(d.motors[motor].flags == (ev3::motor::flag_running | ev3::motor::flag_stalled));
+    REQUIRE(d.motors[position_only].position == 250);
+    REQUIRE(d.motors[position_only].speed == 0);
+    REQUIRE(d.sensors[sensor].count == 2);
+    REQUIRE(d.sensors[sensor].value[0] == 1);
+    REQUIRE(d.sensors[sensor].value[1] == 7);
+
+    // Readers do no I/O, they see the last update.
+    sysfs.write(motor_dir + "position", "0\n");
+    REQUIRE(snapshot.read().motors[motor].position == 250);
+
+    SECTION("a value that fails keeps the last one, the rest are updated") {
+        sysfs.write(sensor_dir + "value1", "garbage\n");
+        REQUIRE(snapshot.update() == 1);
+        REQUIRE(snapshot.version() == 2);
+        REQUIRE(snapshot.read().motors[motor].position == 0);
+        REQUIRE(snapshot.read().sensors[sensor].value[1] == 7);
+    }
+}
+
+TEST_CASE("Exception-free accessors") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_gyro);
+
+    ev3::FdSystem sys{sysfs.root()};
+    ev3::large_motor m{ev3::OUTPUT_A, sys};
+    ev3::gyro_sensor g{ev3::INPUT_1, sys};
+    REQUIRE(m.connected());
+    REQUIRE(g.connected());
+
+    REQUIRE(m.try_position().value() == 0);
+    REQUIRE(m.try_state_flags().value() == 0);
+    REQUIRE(m.try_set_speed_sp(300));
+    REQUIRE(m.try_command(ev3::motor::command_run_forever));
+    REQUIRE(sysfs.read(dir + "speed_sp") == "300");
+    REQUIRE(sysfs.read(dir + "command") == "run-forever");
+    REQUIRE(g.try_value(0).value() == 0);
+    REQUIRE(g.try_value(7).error() == std::errc::invalid_argument);
+
+    // An unreadable attribute: errors come back without exceptions or
+    // allocations, the throwing accessor names the file.
+    sysfs.write(dir + "position", "garbage");
+    REQUIRE(m.try_position().error() == std::errc::no_such_device);
+
+    int failures{0};
+    const auto before{ev3dev_testing::allocation_count()};
+    for (int i = 0; i != 100; ++i) {
+        failures += !m.try_position();
+    }
+    const auto after{ev3dev_testing::allocation_count()};
+    REQUIRE(failures == 100);
+    REQUIRE(after == before);
+
+    try {
+        m.position();
+        FAIL("position() did not throw");
+    } catch (const std::system_error &e) {
+        REQUIRE(e.code() == std::errc::no_such_device);
+        REQUIRE(std::string{e.what()}.find(dir + "position") != std::string::npos);
+    }
+
+    ev3::device d{sys};
+    REQUIRE(d.try_get_attr_int("position").error() == std::errc::function_not_supported);
+    REQUIRE(d.try_set_attr_int("speed_sp", 1).error() == std::errc::function_not_supported);
+
+    REQUIRE(d.connect(sysfs.root() + "/tacho-motor/", "motor", {}));
+    REQUIRE(d.try_get_attr_string("stop_action").value() == "coast");
+    REQUIRE(d.try_set_attr_string("stop_action", "brake"));
+    REQUIRE(d.try_get_attr_line("stop_action").value() == "brake");
+    REQUIRE(d.try_get_attr_int("no_such_attribute").error() == std::errc::no_such_device);
+    REQUIRE_THROWS_AS(d.get_attr_int("no_such_attribute"), std::system_error);
+}
+
+TEST_CASE("Concurrent device access") {
+    // Configure with -DENABLE_SANITIZER_THREAD=ON to have TSan check this.
+    MockSystem sys;
+    sys.populate_arena({"medium_motor:0@ev3-ports:outA", "medium_motor:1@ev3-ports:outB",
+            "infrared_sensor:0@ev3-ports:in1"});
+
+    ev3::medium_motor shared{ev3::OUTPUT_A, sys};
+    ev3::medium_motor other{ev3::OUTPUT_B, sys};
+    ev3::infrared_sensor ir{ev3::INPUT_1, sys};
+    ev3::device by_name{sys};
+    REQUIRE(shared.connected());
+    REQUIRE(other.connected());
+    REQUIRE(ir.connected());
+    REQUIRE(by_name.connect(sys.get_sys_root() + "/tacho-motor/", "motor0", {}));
+    shared.set_shadow_writes(true);
+
+    constexpr int threads{8};
+    constexpr int iterations{400};
+    std::atomic<int> errors{0};
+    std::vector<std::thread> workers;
+    for (int t = 0; t != threads; ++t) {
+        workers.emplace_back([&, t] {
+            for (int i = 0; i != iterations; ++i) {
+                try {
+                    switch ((t + i) % 5) {
+                    case 0:
+                        // Handles, constant and by-name attributes of one motor.
+                        if (shared.position() != 42 || shared.try_speed().value() != 0 ||
+                                shared.address() != ev3::OUTPUT_A ||
+                                by_name.get_attr_int("time_sp") != 1000 ||
+                                by_name.get_attr_string("polarity") != "normal")
+                            ++errors;
+                        break;
+                    case 1:
+                        shared.set_speed_sp(i).set_stop_action(ev3::motor::stop_action_hold);
+                        if (!shared.try_command(ev3::motor::command_run_forever) || !shared.is_running())
+                            ++errors;
+                        break;
+                    case 2:
+                        // Mode switches race with reads of the mode metadata.
+                        ir.set_mode(i % 2 ? ev3::infrared_sensor::mode_ir_prox
+                                          : ev3::infrared_sensor::mode_ir_seek);
+                        if (ir.value(0) != 16 || ir.num_values() != 1 || ir.values().size() != 1)
+                            ++errors;
+                        break;
+                    case 3:
+                        other.set_position_sp(i);
+                        if (other.count_per_rot() != 360 || other.state_flags() != ev3::motor::flag_running)
+                            ++errors;
+                        break;
+                    default: {
+                        // Connecting goes through the shared registry.
+                        ev3::medium_motor m{ev3::OUTPUT_B, sys};
+                        if (!m.connected() || m.position() != 42)
+                            ++errors;
+                        break;
+                    }
+                    }
+                } catch (...) {
+                    ++errors;
+                }
+            }
+        });
+    }
+
+    for (auto &w : workers) {
+        w.join();
+    }
+    REQUIRE(errors == 0);
+}
+
+TEST_CASE("Instrumented system") {
+    MockSystem mock;
+    mock.populate_arena({"medium_motor:0@ev3-ports:outA"});
+    ev3::InstrumentedSystem sys{mock};
+
+    ev3::medium_motor m{ev3::OUTPUT_A, sys};
+    REQUIRE(m.connected());
+    for (int i = 0; i != 3; ++i) {
+        REQUIRE(m.position() == 42);
+    }
+    m.set_speed_sp(500);
+
+    const auto position_path{m.path() + "position"};
+    const auto find = [&](const std::string &path) {
+        const auto all{sys.stats()};
+        const auto found{std::find_if(all.begin(), all.end(), [&](auto &p) { return p.path == path; })};
+        REQUIRE(found != all.end());
+        return *found;
+    };
+
+    auto position{find(position_path)};
+    REQUIRE(position[ev3::InstrumentedSystem::op::open_read].count == 1);
+    REQUIRE(position[ev3::InstrumentedSystem::op::read].count == 3);
+    REQUIRE(position[ev3::InstrumentedSystem::op::read].bytes == 6);
+    REQUIRE(position[ev3::InstrumentedSystem::op::read].errors == 0);
+    REQUIRE(position.reopens == 0);
+
+    const auto speed_sp{find(m.path() + "speed_sp")};
+    REQUIRE(speed_sp[ev3::InstrumentedSystem::op::write].count == 1);
+    REQUIRE(speed_sp[ev3::InstrumentedSystem::op::write].bytes == 3);
+
+    std::uint64_t bucketed{0};
+    for (auto n : position[ev3::InstrumentedSystem::op::read].histogram) {
+        bucketed += n;
+    }
+    REQUIRE(bucketed == 3);
+    REQUIRE(position[ev3::InstrumentedSystem::op::read].percentile(1.0) <=
+            position[ev3::InstrumentedSystem::op::read].max);
+
+    // A second object has handles of its own: the file is opened again.
+    ev3::medium_motor again{ev3::OUTPUT_A, sys};
+    REQUIRE(again.position() == 42);
+    position = find(position_path);
+    REQUIRE(position[ev3::InstrumentedSystem::op::open_read].count == 2);
+    REQUIRE(position.reopens == 1);
+
+    std::ostringstream text;
+    sys.dump(text);
+    REQUIRE(text.str().find(position_path) != std::string::npos);
+    REQUIRE(text.str().find("read: count 4") != std::string::npos);
+
+    std::ostringstream json;
+    sys.dump(json, ev3::InstrumentedSystem::format::json);
+    REQUIRE(json.str().rfind("{\"paths\":[{\"path\":", 0) == 0);
+    REQUIRE(json.str().find("\"read\":{\"count\":4,") != std::string::npos);
+
+    sys.reset();
+    REQUIRE(find(position_path)[ev3::InstrumentedSystem::op::read].count == 0);
+}
+
+TEST_CASE("Record and replay") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto motor_dir{sysfs.add_motor(0, ev3::OUTPUT_A, ev3::motor::motor_large)};
+    const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch)};
+    sysfs.write(motor_dir + "position", "120\n");
+    sysfs.write(motor_dir + "state", "running\n");
+    sysfs.write(sensor_dir + "value0", "1\n");
+    const auto file{sysfs.root() + "/session.ev3rec"};
+
+    const auto session = [](const ev3::ISystem &sys, int speed) {
+        ev3::large_motor m{ev3::OUTPUT_A, sys};
+        ev3::touch_sensor t{ev3::INPUT_1, sys};
+        REQUIRE(m.connected());
+        REQUIRE(t.connected());
+        m.set_speed_sp(speed).set_position_sp(360).run_to_abs_pos();
+        return std::make_tuple(m.position(), m.state_flags(), t.is_pressed(false));
+    };
+
+    ev3::FdSystem real{sysfs.root()};
+    std::uint64_t events{0};
+    {
+        ev3::RecordingSystem recorder{real, file};
+        REQUIRE(session(recorder, 500) == std::make_tuple(120, ev3::motor::flag_running, true));
+        events = recorder.events();
+    }
+    REQUIRE(events > 10);
+
+    // The devices change, the replay still sees what was recorded.
+    sysfs.write(motor_dir + "position", "0\n");
+    sysfs.remove_device("lego-sensor", "sensor0");
+
+    SECTION("same session") {
+        ev3::ReplaySystem replay{file};
+        REQUIRE(replay.get_sys_root() == sysfs.root());
+        REQUIRE(session(replay, 500) == std::make_tuple(120, ev3::motor::flag_running, true));
+
+        const auto result{replay.result()};
+        REQUIRE(result.ok());
+        REQUIRE(result.writes == 3);
+        REQUIRE(replay.unreplayed() == 0);
+        REQUIRE(replay.recorded_duration().count() > 0);
+    }
+
+    SECTION("different writes") {
+        ev3::ReplaySystem replay{file};
+        session(replay, 250);
+
+        const auto result{replay.result()};
+        REQUIRE(!result.ok());
+        REQUIRE(result.mismatches == 1);
+        REQUIRE(result.details.at(0).find("speed_sp: wrote '250', recorded '500'") != std::string::npos);
+    }
+
+    SECTION("reads past the recording fail") {
+        ev3::ReplaySystem replay{file};
+        session(replay, 500);
+
+        REQUIRE(replay.result().missing_reads == 0);
+
+        ev3::large_motor m{ev3::OUTPUT_A, replay};
+        REQUIRE(!m.try_position());
+        REQUIRE(replay.result().missing_reads > 0);
+    }
+
+    SECTION("malformed files are rejected") {
+        sysfs.write(file, "EV3REC");
+        REQUIRE_THROWS_AS(ev3::ReplaySystem{file}, std::system_error);
+    }
+}
+
+TEST_CASE("Simulated system") {
+    using namespace std::chrono_literals;
+
+    ev3::SimSystem sim;
+    ev3::SimSystem::motor_config config;
+    config.address = ev3::OUTPUT_A;
+    config.min_position = -200;
+    config.max_position = 1000;
+    sim.add_motor(config);
+    sim.add_sensor(ev3::INPUT_1, ev3::sensor::ev3_touch);
+    sim.add_sensor(ev3::INPUT_2, ev3::sensor::ev3_color);
+    sim.add_sensor(ev3::INPUT_3, ev3::sensor::ev3_gyro);
+
+    ev3::large_motor m{ev3::OUTPUT_A, sim};
+    REQUIRE(m.connected());
+    REQUIRE(m.max_speed() == 1050);
+
+    SECTION("run-to-abs-pos stops on the target and holds") {
+        m.set_stop_action(ev3::motor::stop_action_hold).set_speed_sp(500).set_position_sp(360).run_to_abs_pos();
+        sim.advance(100ms);
+        REQUIRE(m.state_flags() == ev3::motor::flag_running);
+        REQUIRE(m.speed() == 500);
+        REQUIRE(m.position() > 40);
+        REQUIRE(m.position() < 60);
+
+        sim.advance(1s);
+        REQUIRE(m.position() == 360);
+        REQUIRE(m.speed() == 0);
+        REQUIRE(m.state_flags() == ev3::motor::flag_holding);
+    }
+
+    SECTION("stop with hold keeps the shaft where it is") {
+        m.set_stop_action(ev3::motor::stop_action_hold).set_speed_sp(100).set_position_sp(1000).run_to_abs_pos();
+        sim.advance(500ms);
+        const auto stopped_at{m.position()};
+        REQUIRE(std::abs(stopped_at - 50) <= 1);
+
+        m.stop();
+        sim.advance(10ms);
+        REQUIRE(m.position() == stopped_at);
+        REQUIRE(m.state_flags() == ev3::motor::flag_holding);
+    }
+
+    SECTION("ramps limit the acceleration") {
+        m.set_ramp_up_sp(1000).set_speed_sp(1050).run_forever();
+        sim.advance(500ms);
+        REQUIRE(m.state_flags() == (ev3::motor::flag_running | ev3::motor::flag_ramping));
+        REQUIRE(std::abs(m.speed() - 525) <= 1);
+
+        // Coasting takes a while, braking less.
+        m.stop();
+        sim.advance(100ms);
+        REQUIRE(m.speed() > 0);
+        REQUIRE(m.state_flags() == 0);
+    }
+
+    SECTION("run-direct stalls against an end stop") {
+        m.set_duty_cycle_sp(-50).run_direct();
+        sim.advance(2s);
+        REQUIRE(m.position() == -200);
+        REQUIRE(m.is_stalled());
+
+        m.stop();
+        REQUIRE(!m.is_stalled());
+    }
+
+    SECTION("reset and polarity move the position, not the shaft") {
+        m.set_speed_sp(500).set_position_sp(100).run_to_abs_pos();
+        sim.advance(1s);
+        m.reset();
+        REQUIRE(m.position() == 0);
+
+        m.set_polarity(ev3::motor::polarity_inversed).set_speed_sp(500).set_position_sp(100).run_to_abs_pos();
+        sim.advance(1s);
+        REQUIRE(m.position() == 100);
+        REQUIRE(sim.shaft_position(0) == 0);
+    }
+
+    SECTION("invalid values are rejected") {
+        REQUIRE(m.try_set_speed_sp(2000).error() == std::errc::invalid_argument);
+        REQUIRE(m.try_command("jump").error() == std::errc::invalid_argument);
+    }
+
+    SECTION("sensors") {
+        ev3::touch_sensor touch{ev3::INPUT_1, sim};
+        ev3::color_sensor color{ev3::INPUT_2, sim};
+        ev3::gyro_sensor gyro{ev3::INPUT_3, sim};
+
+        REQUIRE(!touch.is_pressed());
+        sim.set_touch(0, true);
+        REQUIRE(touch.is_pressed());
+
+        ev3::SimSystem::color_reading reading;
+        reading.color = 5;
+        reading.reflected = 42;
+        reading.red = 1000;
+        sim.set_color(1, reading);
+        REQUIRE(color.color() == 5);
+        REQUIRE(color.reflected_light_intensity() == 42);
+        REQUIRE(std::get<0>(color.raw()) == 1000);
+
+        REQUIRE(gyro.angle() == 0);
+        sim.set_gyro_rate(2, -90);
+        sim.advance(500ms);
+        REQUIRE(gyro.angle() == -45);
+        REQUIRE(gyro.rate() == -90);
+    }
+}
@@ -0,0 +1,154 @@
+#include <catch2.hpp>
+
+#include <broker/device_broker.h>
+#include <ev3dev.h>
+#include <fake_sysfs.h>
+
+#include <chrono>
+#include <filesystem>
+#include <system_error>
+#include <string>
+#include <thread>
+
+#include <sys/wait.h>
+#include <unistd.h>
+
+namespace ev3 = ev3dev;
+namespace broker = ev3dev::broker;
+
+TEST_CASE("Device broker") {
+    ev3dev_testing::fake_sysfs sysfs;
+    const auto motor_dir{sysfs.add_motor(0, ev3::OUTPUT_B, ev3::motor::motor_large)};
+    const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_2, ev3::sensor::ev3_touch)};
+    sysfs.write(motor_dir + "position", "77\n");
+    sysfs.write(sensor_dir + "value0", "1\n");
+
+    const std::string name{"/ev3dev-broker-test-" + std::to_string(::getpid())};
+    const ev3::FdSystem sys{sysfs.root()};
+    broker::device_broker b{name, sys};
+
+    broker::broker_client client{name};
+    REQUIRE(client.motor_count() == 1);
+    REQUIRE(client.sensor_count() == 1);
+    REQUIRE(client.find_motor(ev3::OUTPUT_B) == 0u);
+    REQUIRE(!client.find_motor(ev3::OUTPUT_A));
+    REQUIRE(client.find_sensor(ev3::INPUT_2) == 0u);
+    REQUIRE(std::string{client.motor_info(0).driver_name.data()} == ev3::motor::motor_large);
+
+    REQUIRE(client.version() == 0);
+    b.poll();
+    REQUIRE(client.version() == 1);
+    REQUIRE(client.state().motors[0].position == 77);
+    REQUIRE(client.state().sensors[0].value[0] == 1);
+
+    SECTION("commands are applied as one transaction") {
+        sysfs.write(motor_dir + "stop_action", "");
+
+        broker::motor_command c;
+        c.motor = 0;
+        c.command = broker::motor_command::run_to_abs_pos;
+        c.stop_action = broker::motor_command::hold;
+        c.fields = broker::motor_command::set_speed_sp | broker::motor_command::set_position_sp;
+        c.speed_sp = 400;
+        c.position_sp = 1000;
+        REQUIRE(client.submit(c));
+
+        b.poll();
+        REQUIRE(b.shared().commands_applied.load() == 1);
+        REQUIRE(sysfs.read(motor_dir + "stop_action") == "hold");
+        REQUIRE(sysfs.read(motor_dir + "speed_sp") == "400");
+        REQUIRE(sysfs.read(motor_dir + "position_sp") == "1000");
+        REQUIRE(sysfs.read(motor_dir + "command") == "run-to-abs-pos");
+
+        c.motor = 5;
+        REQUIRE(client.submit(c));
+        b.poll();
+        REQUIRE(b.shared().commands_failed.load() == 1);
+    }
+
+    SECTION("the command queue is bounded") {
+        broker::motor_command c;
+        for (std::uint32_t i = 0; i < broker::segment::command_capacity; ++i)
+            REQUIRE(client.submit(c));
+        REQUIRE(!client.submit(c));
+        b.poll();
+        REQUIRE(client.submit(c));
+    }
+
+    SECTION("another process") {
+        const auto child{::fork()};
+        REQUIRE(child >= 0);
+        if (child == 0) {
+            // Only async-signal-safe exits from here on, no Catch.
+            int status{1};
+            try {
+                broker::broker_client other{name};
+                broker::motor_command c;
+                c.command = broker::motor_command::stop;
+                if (other.state().motors[0].position == 77 && other.submit(c))
+                    status = 0;
+            } catch (...) {
+            }
+            ::_exit(status);
+        }
+
+        int status{-1};
+        REQUIRE(::waitpid(child, &status, 0) == child);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+
+        b.poll();
+        REQUIRE(sysfs.read(motor_dir + "command") == "stop");
+    }
+}
+
+TEST_CASE("Device broker ownership") {
+    ev3dev_testing::fake_sysfs sysfs;
+    sysfs.add_motor(0, ev3::OUTPUT_B, ev3::motor::motor_large);
+
+    const std::string name{"/ev3dev-broker-owner-test-" + std::to_string(::getpid())};
+    const ev3::FdSystem sys{sysfs.root()};
+
+    SECTION("a live broker keeps its name") {
+        broker::device_broker b{name, sys};
+        REQUIRE_THROWS_AS(broker::device_broker(name, sys), std::system_error);
+
+        broker::broker_client client{name};
+        REQUIRE(client.motor_count() == 1);
+    }
+
+    SECTION("the segment of a dead broker is taken over") {
+        const auto child{::fork()};
+        REQUIRE(child >= 0);
+        if (child == 0) {
+            // Dies without running the destructor, leaving the segment.
+            try {
+                broker::device_broker b{name, sys};
+                ::_exit(0);
+            } catch (...) {
+            }
+            ::_exit(1);
+        }
+
+        int status{-1};
+        REQUIRE(::waitpid(child, &status, 0) == child);
+        REQUIRE(WIFEXITED(status));
+        REQUIRE(WEXITSTATUS(status) == 0);
+
+        broker::device_broker b{name, sys};
+        broker::broker_client client{name};
+        REQUIRE(client.motor_count() == 1);
+    }
+
+    SECTION("a broker that fails to start removes its segment") {
+        // Tracking the sensor needs its num_values.
+        const auto sensor_dir{sysfs.add_sensor(0, ev3::INPUT_1, ev3::sensor::ev3_touch)};
+        std::filesystem::remove(sensor_dir + "num_values");
+        REQUIRE_THROWS_AS(broker::device_broker(name, sys), std::system_error);
+        REQUIRE_THROWS_AS(broker::broker_client{name}, std::system_error);
+
+        sysfs.write(sensor_dir + "num_values", "1");
+        broker::device_broker b{name, sys};
+        REQUIRE(b.shared().sensor_count == 1);
+    }
+}
@@ -0,0 +1,121 @@
+#pragma once
+
+// A throw-away sysfs look-alike on a real file system, for exercising the
+// file based ISystem backends without hardware attached.
+
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <initializer_list>
+#include <sstream>
+#include <string>
+#include <utility>
+
+namespace ev3dev_testing {
+
+class fake_sysfs {
+  public:
+    // Prefers /dev/shm, which is a tmpfs just like /sys, so timings are not
+    // dominated by the block layer.
+    fake_sysfs() {
+        namespace fs = std::filesystem;
+
+        std::string pattern =
+            (fs::is_directory("/dev/shm") ? std::string{"/dev/shm"} : fs::temp_directory_path().string()) +
+            "/ev3dev-sysfs-XXXXXX";
+
+        if (mkdtemp(pattern.data()) != nullptr) {
+            root_ = pattern;
+        }
+    }
+
+    ~fake_sysfs() {
+        std::error_code ec;
+        std::filesystem::remove_all(root_, ec);
+    }
+
+    fake_sysfs(const fake_sysfs&) = delete;
+    fake_sysfs& operator=(const fake_sysfs&) = delete;
+
+    const std::string& root() const noexcept { return root_; }
+
+    // Creates <root>/<class_name>/<device_name>/ and returns its path.
+    std::string add_device(
+        const std::string& class_name,
+        const std::string& device_name,
+        std::initializer_list<std::pair<std::string, std::string>> attributes) {
+        const auto dir{root_ + '/' + class_name + '/' + device_name + '/'};
+        std::filesystem::create_directories(dir);
+
+        for (auto&& a : attributes) {
+            write(dir + a.first, a.second);
+        }
+
+        return dir;
+    }
+
+    std::string add_motor(int index, const std::string& address, const std::string& driver_name) {
+        return add_device(
+            "tacho-motor",
+            "motor" + std::to_string(index),
+            {{"address", address},
+             {"driver_name", driver_name},
+             {"command", ""},
+             {"commands", "run-forever run-to-abs-pos run-to-rel-pos run-timed run-direct stop reset"},
+             {"count_per_rot", "360"},
+             {"duty_cycle", "0"},
+             {"duty_cycle_sp", "0"},
+             {"max_speed", "1050"},
+             {"polarity", "normal"},
+             {"position", "0"},
+             {"position_sp", "0"},
+             {"ramp_down_sp", "0"},
+             {"ramp_up_sp", "0"},
+             {"speed", "0"},
+             {"speed_sp", "0"},
+             {"state", ""},
+             {"stop_action", "coast"},
+             {"stop_actions", "coast brake hold"},
+             {"time_sp", "0"}});
+    }
+
+    std::string add_sensor(int index, const std::string& address, const std::string& driver_name) {
+        return add_device(
+            "lego-sensor",
+            "sensor" + std::to_string(index),
+            {{"address", address},
+             {"driver_name", driver_name},
+             {"bin_data", std::string(4, '\0')},
+             {"bin_data_format", "s16"},
+             {"decimals", "0"},
+             {"mode", ""},
+             {"modes", ""},
+             {"num_values", "1"},
+             {"units", ""},
+             {"value0", "0"},
+             {"value1", "0"}});
+    }
+
+    // Unplugs a device added by add_device().
+    void remove_device(const std::string& class_name, const std::string& device_name) {
+        std::filesystem::remove_all(root_ + '/' + class_name + '/' + device_name);
+    }
+
+    // Replaces the whole file, like the kernel regenerating an attribute.
+    static void write(const std::string& path, const std::string& contents) {
+        std::ofstream f{path, std::ios::trunc | std::ios::binary};
+        f << contents;
+    }
+
+    static std::string read(const std::string& path) {
+        std::ifstream f{path, std::ios::binary};
+        std::ostringstream ss;
+        ss << f.rdbuf();
+        return ss.str();
+    }
+
+  private:
+    std::string root_;
+};
+
+} // namespace ev3dev_testing